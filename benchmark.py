@@ -0,0 +1,197 @@
+#!/usr/bin/env python3
+#
+# End-to-end benchmark of the ESC node
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+# Runs esc_node on a simulated source (--sim) against a local mock OpenSAS
+# (mock_opensas.py) with throwaway certificates, for a fixed time, and reports:
+#   - the sustained input rate of every RX channel
+#   - the requests and reports that reached the server, by endpoint and outcome
+#   - report and detection to upload latency percentiles
+#   - the CPU time of every node thread (esc_rx<k>, esc_upload, main)
+#   - the percentiles of the "<stage> time: N us" lines printed with STATS
+#
+# Example, a 30 s run as fast as the pipeline goes with 10 % of the uploads failing:
+#   ./benchmark.py --node build/esc_node --duration 30 --server-args="--fail-rate 0.1" -- --sim-realtime false --frame-rate 0
+# Everything after "--" is passed to esc_node.
+
+import argparse
+import json
+import os
+import re
+import shlex
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def make_certs(workdir):
+    """A CA, a server certificate for 127.0.0.1 and a client certificate, all signed by the CA"""
+    def openssl(*args):
+        subprocess.run(["openssl"] + list(args), cwd=workdir, check=True,
+                       stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    openssl("req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "2", "-subj", "/CN=esc-benchmark-ca",
+            "-keyout", "ca.key", "-out", "ca.crt")
+    with open(os.path.join(workdir, "server.ext"), "w") as f:
+        f.write("subjectAltName=IP:127.0.0.1,DNS:localhost\n")
+    for name in ("server", "client"):
+        openssl("req", "-newkey", "rsa:2048", "-nodes", "-subj", "/CN=esc-benchmark-" + name,
+                "-keyout", name + ".key", "-out", name + ".csr")
+        openssl("x509", "-req", "-in", name + ".csr", "-CA", "ca.crt", "-CAkey", "ca.key", "-CAcreateserial",
+                "-days", "2", "-out", name + ".crt", *(["-extfile", "server.ext"] if name == "server" else []))
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def thread_cpu(pid):
+    """CPU seconds of every thread of a process, by thread name"""
+    ticks = os.sysconf("SC_CLK_TCK")
+    cpu = {}
+    try:
+        tasks = os.listdir("/proc/%d/task" % pid)
+    except OSError:
+        return cpu
+    for tid in tasks:
+        try:
+            with open("/proc/%d/task/%s/stat" % (pid, tid)) as f:
+                stat = f.read()
+        except OSError:
+            continue
+        # the name is in parentheses and may hold spaces, the fields after it are fixed
+        name = stat[stat.index("(") + 1:stat.rindex(")")]
+        fields = stat[stat.rindex(")") + 2:].split()
+        cpu[name] = cpu.get(name, 0) + (int(fields[11]) + int(fields[12])) / ticks
+    return cpu
+
+
+def percentiles(values):
+    values = sorted(values)
+    pick = lambda q: values[min(len(values) - 1, int(q * len(values)))]
+    return {"count": len(values), "p50": pick(0.5), "p90": pick(0.9), "p99": pick(0.99), "max": values[-1]}
+
+
+def parse_node_log(path):
+    input_rates, stages = {}, {}
+    errors = 0
+    with open(path, errors="replace") as f:
+        for line in f:
+            m = re.match(r"Sim RX (\d+) input rate: ([\d.]+) Msps", line)
+            if m:
+                input_rates.setdefault(int(m.group(1)), []).append(float(m.group(2)))
+                continue
+            m = re.match(r"(.+?) time(?: ch\d+)?: (-?\d+) us", line)
+            if m:
+                stages.setdefault(m.group(1), []).append(int(m.group(2)))
+                continue
+            if line.startswith("ERROR") or "ERROR" in line[:40]:
+                errors += 1
+    return input_rates, stages, errors
+
+
+def main():
+    argv = sys.argv[1:]
+    node_args = []
+    if "--" in argv:
+        node_args = argv[argv.index("--") + 1:]
+        argv = argv[:argv.index("--")]
+    parser = argparse.ArgumentParser(description="End-to-end benchmark of the ESC node on a simulated source",
+                                     usage="%(prog)s --node PATH [options] [-- esc_node options]")
+    parser.add_argument("--node", required=True, help="the esc_node binary")
+    parser.add_argument("--duration", type=float, default=30, help="seconds to run the node")
+    parser.add_argument("--warmup", type=float, default=3, help="seconds at the start left out of the CPU figures")
+    parser.add_argument("--rate", default="122.88e6", help="sample rate of the simulated source")
+    parser.add_argument("--freq", default="3650e6", help="center frequency of the simulated source")
+    parser.add_argument("--server-args", default="", help="extra mock_opensas.py options, e.g. \"--delay 0.05 --fail-rate 0.1\"")
+    parser.add_argument("--workdir", help="directory for certificates, logs and results, a new temporary one by default")
+    args = parser.parse_args(argv)
+
+    workdir = args.workdir or tempfile.mkdtemp(prefix="esc_benchmark_")
+    os.makedirs(workdir, exist_ok=True)
+    make_certs(workdir)
+    port = free_port()
+    server_stats = os.path.join(workdir, "server.json")
+    node_log = os.path.join(workdir, "node.log")
+
+    server = subprocess.Popen([sys.executable, os.path.join(HERE, "mock_opensas.py"), "--port", str(port),
+                               "--cert", "server.crt", "--key", "server.key", "--ca", "ca.crt",
+                               "--report-interval", "0", "--stats", server_stats] + shlex.split(args.server_args),
+                              cwd=workdir, stdout=open(os.path.join(workdir, "server.log"), "w"),
+                              stderr=subprocess.STDOUT)
+    time.sleep(1)
+    if server.poll() is not None:
+        sys.exit("mock OpenSAS did not start, see %s" % os.path.join(workdir, "server.log"))
+
+    node_cmd = [os.path.abspath(args.node), "--sim", "--rate", args.rate, "--freq", args.freq,
+                "--opensas-url", "https://127.0.0.1:%d/sas-api/" % port,
+                "--client-cert", "client.crt", "--client-key", "client.key", "--ca-cert", "ca.crt"] + node_args
+    print("Running %s" % " ".join(shlex.quote(a) for a in node_cmd))
+    node = subprocess.Popen(node_cmd, cwd=workdir, stdout=open(node_log, "w"), stderr=subprocess.STDOUT)
+
+    time.sleep(min(args.warmup, args.duration))
+    cpu_start, wall_start = thread_cpu(node.pid), time.time()
+    while time.time() - wall_start < args.duration - args.warmup and node.poll() is None:
+        time.sleep(0.2)
+    cpu_end, wall = thread_cpu(node.pid), time.time() - wall_start
+    node_exit = node.poll()
+    if node_exit is None:
+        node.send_signal(signal.SIGINT)
+        try:
+            node.wait(10)
+        except subprocess.TimeoutExpired:
+            node.kill()
+            node.wait()
+    server.send_signal(signal.SIGINT)
+    server.wait(30)
+
+    input_rates, stages, errors = parse_node_log(node_log)
+    with open(server_stats) as f:
+        received = json.load(f)
+    cpu = {name: 100 * (cpu_end.get(name, 0) - cpu_start.get(name, 0)) / wall for name in cpu_end}
+    result = {
+        "node": node_cmd, "server_args": args.server_args, "duration_s": args.duration,
+        "node_exit": node_exit,
+        "input_rate_msps": {rx: {"mean": sum(r[1:] or r) / len(r[1:] or r), "min": min(r[1:] or r)}
+                            for rx, r in input_rates.items()},
+        "server": received,
+        "cpu_percent": cpu,
+        "stage_us": {stage: percentiles(v) for stage, v in stages.items()},
+        "node_errors": errors,
+    }
+    with open(os.path.join(workdir, "result.json"), "w") as f:
+        json.dump(result, f, indent=2)
+
+    if node_exit is not None:
+        print("esc_node exited early with %d, see %s" % (node_exit, node_log))
+    print("\nInput rate (Msps, first second left out)")
+    for rx, r in sorted(result["input_rate_msps"].items()):
+        print("  RX %d: mean %.2f min %.2f" % (rx, r["mean"], r["min"]))
+    print("\nUploads received")
+    for name, ep in received["endpoints"].items():
+        print("  %-14s %6d requests %6d reports  %s" % (name, ep["requests"], ep["reports"],
+              " ".join("%s:%d" % item for item in sorted(ep["outcomes"].items()))))
+        for key, label in (("report_latency_ms", "report to upload"), ("detect_latency_ms", "detection to upload")):
+            p = ep[key]
+            if p:
+                print("  %14s %s: p50 %.1f p90 %.1f p99 %.1f max %.1f ms" % (
+                    "", label, p["p50"], p["p90"], p["p99"], p["max"]))
+    print("\nCPU per thread (%, after warmup)")
+    for name, pct in sorted(cpu.items(), key=lambda item: -item[1]):
+        print("  %-16s %6.1f" % (name, pct))
+    print("\nStage times (us)")
+    for stage, p in sorted(result["stage_us"].items()):
+        print("  %-24s n %6d p50 %8d p90 %8d p99 %8d max %8d" % (stage, p["count"], p["p50"], p["p90"], p["p99"], p["max"]))
+    print("\n%d error lines in the node log, results in %s" % (errors, workdir))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,435 @@
+//
+// ESC sensor node - fusion of the power reports of several sensors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_AGGREGATOR_HPP
+#define ESC_AGGREGATOR_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+namespace esc_aggregator {
+
+//! The channel power report of one RX channel of one sensor
+struct sensor_report
+{
+    std::string sensor_id;
+    size_t rx_channel;
+    double lat;
+    double lon;
+    int64_t time_us;
+    std::vector<float> channel_pwr;
+    std::vector<bool> detected;
+    std::vector<std::string> signal;
+    std::vector<float> confidence;
+
+    //! Sensors are told apart by id and RX channel
+    std::string get_key(void) const
+    {
+        return sensor_id + "/" + std::to_string(rx_channel);
+    }
+};
+
+/***********************************************************************
+ * Datagram format, native byte order (the sensors are little endian):
+ *   uint32 magic, uint8 version, uint8 id length, uint16 rx channel,
+ *   uint16 channels, int64 time_us, float64 lat, float64 lon, id,
+ *   then per channel float32 power, float32 confidence,
+ *   uint8 detected, uint8 label length, label
+ **********************************************************************/
+static const uint32_t report_magic   = 0x52435345; // "ESCR"
+static const uint8_t report_version  = 1;
+static const size_t max_datagram_len = 65507;
+
+template <typename T> void put(std::vector<uint8_t>& out, const T& value)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(&value);
+    out.insert(out.end(), p, p + sizeof(T));
+}
+
+template <typename T> bool get(const uint8_t*& p, const uint8_t* end, T& value)
+{
+    if (size_t(end - p) < sizeof(T))
+        return false;
+    std::memcpy(&value, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+}
+
+inline bool get_string(const uint8_t*& p, const uint8_t* end, size_t len, std::string& value)
+{
+    if (size_t(end - p) < len)
+        return false;
+    value.assign(reinterpret_cast<const char*>(p), len);
+    p += len;
+    return true;
+}
+
+//! Printable ASCII without quotes or backslashes, safe to write into JSON strings unescaped
+inline bool is_safe_text(const std::string& text)
+{
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] < 0x20 or text[i] > 0x7e or text[i] == '"' or text[i] == '\\')
+            return false;
+    }
+    return true;
+}
+
+//! Serialize a report into one datagram, ids and labels are cut at 255 bytes
+inline void encode_report(const sensor_report& report, std::vector<uint8_t>& out)
+{
+    out.clear();
+    const std::string id = report.sensor_id.substr(0, 255);
+    put(out, report_magic);
+    put(out, report_version);
+    put(out, uint8_t(id.size()));
+    put(out, uint16_t(report.rx_channel));
+    put(out, uint16_t(report.channel_pwr.size()));
+    put(out, report.time_us);
+    put(out, report.lat);
+    put(out, report.lon);
+    out.insert(out.end(), id.begin(), id.end());
+    for (size_t i = 0; i < report.channel_pwr.size(); i++) {
+        const std::string label = report.signal[i].substr(0, 255);
+        put(out, report.channel_pwr[i]);
+        put(out, report.confidence[i]);
+        put(out, uint8_t(report.detected[i]));
+        put(out, uint8_t(label.size()));
+        out.insert(out.end(), label.begin(), label.end());
+    }
+}
+
+//! Parse a datagram, false if it is not a valid report or its id or a label is not safe text
+inline bool decode_report(const uint8_t* data, size_t len, sensor_report& report)
+{
+    const uint8_t* p   = data;
+    const uint8_t* end = data + len;
+    uint32_t magic;
+    uint8_t version, id_len;
+    uint16_t rx_channel, num_channels;
+    if (not get(p, end, magic) or magic != report_magic or not get(p, end, version)
+        or version != report_version or not get(p, end, id_len) or not get(p, end, rx_channel)
+        or not get(p, end, num_channels) or not get(p, end, report.time_us)
+        or not get(p, end, report.lat) or not get(p, end, report.lon)
+        or not get_string(p, end, id_len, report.sensor_id) or not is_safe_text(report.sensor_id))
+        return false;
+    report.rx_channel = rx_channel;
+    report.channel_pwr.resize(num_channels);
+    report.confidence.resize(num_channels);
+    report.detected.resize(num_channels);
+    report.signal.resize(num_channels);
+    for (size_t i = 0; i < num_channels; i++) {
+        uint8_t detected, label_len;
+        if (not get(p, end, report.channel_pwr[i]) or not get(p, end, report.confidence[i])
+            or not get(p, end, detected) or not get(p, end, label_len)
+            or not get_string(p, end, label_len, report.signal[i]) or not is_safe_text(report.signal[i]))
+            return false;
+        report.detected[i] = detected != 0;
+    }
+    return p == end;
+}
+
+/*!
+ * Sends reports to an aggregator over UDP. A lost datagram is a lost
+ * report, the next one follows a report period later. Safe to use from
+ * several threads.
+ */
+class report_sender
+{
+public:
+    //! \param address the aggregator as host:port
+    report_sender(const std::string& address) : _fd(-1)
+    {
+        const size_t colon = address.rfind(':');
+        if (colon == std::string::npos)
+            throw std::runtime_error("aggregator address must be host:port, got " + address);
+        addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        addrinfo* info    = nullptr;
+        if (getaddrinfo(address.substr(0, colon).c_str(), address.substr(colon + 1).c_str(), &hints, &info) != 0
+            or info == nullptr)
+            throw std::runtime_error("cannot resolve aggregator " + address);
+        _fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        // connected, so errors of earlier datagrams (no listener) show up on send
+        const bool connected = _fd >= 0 and connect(_fd, info->ai_addr, info->ai_addrlen) == 0;
+        freeaddrinfo(info);
+        if (not connected) {
+            if (_fd >= 0)
+                ::close(_fd);
+            throw std::runtime_error("cannot open a socket to aggregator " + address);
+        }
+    }
+
+    ~report_sender(void)
+    {
+        ::close(_fd);
+    }
+
+    report_sender(const report_sender&) = delete;
+    report_sender& operator=(const report_sender&) = delete;
+
+    //! Send a report, false if it could not be sent
+    bool send(const sensor_report& report)
+    {
+        std::vector<uint8_t> datagram;
+        encode_report(report, datagram);
+        if (datagram.size() > max_datagram_len)
+            return false;
+        return ::send(_fd, &datagram.front(), datagram.size(), 0) == ssize_t(datagram.size());
+    }
+
+private:
+    int _fd;
+};
+
+//! Receives reports on a UDP port, from every interface
+class report_receiver
+{
+public:
+    report_receiver(unsigned short port)
+        : _fd(socket(AF_INET6, SOCK_DGRAM, 0)), _buffer(max_datagram_len), _num_invalid(0)
+    {
+        int bound = -1;
+        if (_fd >= 0) {
+            // take IPv4 senders on the same socket
+            const int off = 0;
+            setsockopt(_fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+            sockaddr_in6 addr;
+            std::memset(&addr, 0, sizeof(addr));
+            addr.sin6_family = AF_INET6;
+            addr.sin6_addr   = in6addr_any;
+            addr.sin6_port   = htons(port);
+            bound = bind(_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        } else {
+            // no IPv6 on this host
+            _fd = socket(AF_INET, SOCK_DGRAM, 0);
+            if (_fd < 0)
+                throw std::runtime_error("cannot open the aggregator socket");
+            sockaddr_in addr;
+            std::memset(&addr, 0, sizeof(addr));
+            addr.sin_family      = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_ANY);
+            addr.sin_port        = htons(port);
+            bound = bind(_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        }
+        if (bound < 0) {
+            ::close(_fd);
+            throw std::runtime_error("cannot bind the aggregator to UDP port " + std::to_string(port));
+        }
+    }
+
+    ~report_receiver(void)
+    {
+        ::close(_fd);
+    }
+
+    report_receiver(const report_receiver&) = delete;
+    report_receiver& operator=(const report_receiver&) = delete;
+
+    /*!
+     * Wait for the next valid report.
+     * \param report filled with the report
+     * \param timeout_ms the longest wait
+     * \return false on timeout, invalid datagrams are counted and skipped
+     */
+    bool receive(sensor_report& report, int timeout_ms)
+    {
+        pollfd pfd;
+        pfd.fd     = _fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, std::max(0, timeout_ms)) <= 0)
+            return false;
+        const ssize_t len = recv(_fd, &_buffer.front(), _buffer.size(), 0);
+        if (len <= 0)
+            return false;
+        if (decode_report(&_buffer.front(), size_t(len), report))
+            return true;
+        _num_invalid++;
+        return false;
+    }
+
+    //! The number of datagrams that were not valid reports
+    size_t get_num_invalid(void) const
+    {
+        return _num_invalid;
+    }
+
+private:
+    int _fd;
+    std::vector<uint8_t> _buffer;
+    size_t _num_invalid;
+};
+
+//! One channel of a fused report
+struct fused_channel
+{
+    float max_power;    //!< strongest report in dB
+    float mean_power;   //!< mean of the reports in linear power, in dB
+    size_t num_sensors; //!< sensors that cover the channel
+    size_t votes;       //!< sensors that detect a signal
+    bool detected;      //!< votes reach the minimum
+    std::string signal; //!< the label with the most confidence among the detecting sensors
+    float confidence;   //!< chance that at least one of the sensors with that label is right
+};
+
+//! The reports of all sensors for one time window
+struct fused_report
+{
+    int64_t time_us; //!< start of the window
+    std::vector<std::string> sensors;
+    std::vector<fused_channel> channels;
+};
+
+/*!
+ * Aligns the reports of several sensors in time and fuses them per channel.
+ *
+ * Time is cut into windows of window_us by the report timestamps (the
+ * sensor clocks are expected to be synchronized, NTP is plenty). A window
+ * keeps the latest report of every sensor and is fused once the wall clock
+ * is latency_us past its end, reports for a window that is already fused
+ * are counted as late and dropped.
+ *
+ * Per channel the fused power is the max and the linear mean over the
+ * sensors that cover it (a sensor reports uncovered channels at -100 dB or
+ * below, those are left out). The channel is detected when at least
+ * min_votes sensors detect it. Its label is the one with the highest summed
+ * confidence among the detecting sensors, and its confidence
+ * 1 - prod(1 - c) over those sensors, so agreeing sensors raise it.
+ */
+class report_fuser
+{
+public:
+    report_fuser(int64_t window_us, int64_t latency_us, size_t min_votes)
+        : _window_us(window_us), _latency_us(latency_us), _min_votes(min_votes), _next_window(std::numeric_limits<int64_t>::min()), _num_late(0)
+    {
+        if (window_us <= 0 or latency_us < 0)
+            throw std::runtime_error("invalid aggregation window");
+    }
+
+    //! Add a report, false if its window is already fused
+    bool add(const sensor_report& report)
+    {
+        const int64_t window = floor_div(report.time_us, _window_us);
+        if (window < _next_window) {
+            _num_late++;
+            return false;
+        }
+        _windows[window][report.get_key()] = report;
+        return true;
+    }
+
+    /*!
+     * Fuse every window that is complete.
+     * \param now_us the wall clock in microseconds since the epoch
+     * \param out the fused reports are appended, oldest first
+     */
+    void flush(int64_t now_us, std::vector<fused_report>& out)
+    {
+        while (not _windows.empty()) {
+            const int64_t window = _windows.begin()->first;
+            if ((window + 1) * _window_us + _latency_us > now_us)
+                break;
+            out.push_back(fuse(window, _windows.begin()->second));
+            _windows.erase(_windows.begin());
+            _next_window = window + 1;
+        }
+    }
+
+    //! When the oldest pending window is due, -1 when there is none
+    int64_t get_next_deadline(void) const
+    {
+        return _windows.empty() ? -1 : (_windows.begin()->first + 1) * _window_us + _latency_us;
+    }
+
+    //! The number of reports that arrived after their window was fused
+    size_t get_num_late(void) const
+    {
+        return _num_late;
+    }
+
+private:
+    static int64_t floor_div(int64_t a, int64_t b)
+    {
+        return a / b - ((a % b != 0) and ((a < 0) != (b < 0)));
+    }
+
+    fused_report fuse(int64_t window, const std::map<std::string, sensor_report>& reports) const
+    {
+        fused_report fused;
+        fused.time_us     = window * _window_us;
+        size_t num_channels = 0;
+        for (std::map<std::string, sensor_report>::const_iterator it = reports.begin(); it != reports.end(); ++it) {
+            fused.sensors.push_back(it->first);
+            num_channels = std::max(num_channels, it->second.channel_pwr.size());
+        }
+
+        fused.channels.resize(num_channels);
+        for (size_t i = 0; i < num_channels; i++) {
+            fused_channel& ch = fused.channels[i];
+            ch.max_power      = -100;
+            ch.num_sensors    = 0;
+            ch.votes          = 0;
+            double linear_sum = 0;
+            std::map<std::string, double> label_weight, label_miss;
+            for (std::map<std::string, sensor_report>::const_iterator it = reports.begin(); it != reports.end(); ++it) {
+                const sensor_report& r = it->second;
+                if (i >= r.channel_pwr.size() or r.channel_pwr[i] <= -100)
+                    continue;
+                ch.num_sensors++;
+                ch.max_power = std::max(ch.max_power, r.channel_pwr[i]);
+                linear_sum += std::pow(10.0, r.channel_pwr[i] / 10);
+                if (not r.detected[i])
+                    continue;
+                ch.votes++;
+                if (label_miss.count(r.signal[i]) == 0)
+                    label_miss[r.signal[i]] = 1;
+                label_weight[r.signal[i]] += r.confidence[i];
+                label_miss[r.signal[i]] *= 1 - std::min(1.0f, std::max(0.0f, r.confidence[i]));
+            }
+            ch.mean_power = ch.num_sensors ? float(10 * std::log10(linear_sum / ch.num_sensors)) : -100;
+            ch.detected   = ch.votes > 0 and ch.votes >= _min_votes;
+            ch.signal     = "unknown";
+            ch.confidence = 0;
+            double best   = -1;
+            for (std::map<std::string, double>::const_iterator it = label_weight.begin(); it != label_weight.end(); ++it) {
+                // a label beats unknown, otherwise the most summed confidence wins
+                const double weight = (it->first == "unknown") ? -0.5 : it->second;
+                if (ch.detected and weight > best) {
+                    best          = weight;
+                    ch.signal     = it->first;
+                    ch.confidence = float(1 - label_miss.find(it->first)->second);
+                }
+            }
+        }
+        return fused;
+    }
+
+    int64_t _window_us;
+    int64_t _latency_us;
+    size_t _min_votes;
+    std::map<int64_t, std::map<std::string, sensor_report>> _windows;
+    int64_t _next_window; // windows before this one are fused
+    size_t _num_late;
+};
+
+} // namespace esc_aggregator
+
+#endif /*ESC_AGGREGATOR_HPP*/
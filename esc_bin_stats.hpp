@@ -0,0 +1,263 @@
+//
+// ESC sensor node - per-bin spectrum statistics
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_BIN_STATS_HPP
+#define ESC_BIN_STATS_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+namespace esc_bin_stats {
+
+//! Per-bin statistics settings
+struct stats_config
+{
+    double window;                   //!< seconds of frames per snapshot
+    float floor_db;                  //!< lowest histogram level in dB, lower powers count there
+    float step_db;                   //!< histogram level spacing in dB
+    std::vector<double> percentiles; //!< percentiles to report, in (0, 100)
+
+    stats_config(void)
+        : window(60)
+        , floor_db(-150)
+        , step_db(1)
+        , percentiles({10, 50, 90})
+    {
+        /* NOP */
+    }
+};
+
+//! The statistics of every bin over one window
+struct stats_snapshot
+{
+    double first_freq;                //!< frequency of the first bin in Hz
+    double bin_width;                 //!< bin spacing in Hz
+    size_t num_bins;                  //!< bins per statistic
+    size_t frames;                    //!< frames in the window
+    int64_t start_us;                 //!< time of the first frame, microseconds since the epoch
+    int64_t stop_us;                  //!< time of the last frame
+    std::vector<float> max_db;        //!< max-hold
+    std::vector<float> min_db;        //!< min-hold
+    std::vector<float> mean_db;       //!< mean of the linear power
+    std::vector<double> percentiles;  //!< the percentiles of percentile_db
+    std::vector<float> percentile_db; //!< num_bins values per percentile, to the histogram resolution
+};
+
+/*!
+ * Max-hold, min-hold, mean and percentiles of every spectrum bin over
+ * tumbling windows, without keeping the frames.
+ *
+ * The state is a structure of arrays, one array per statistic over the
+ * bins, so every frame costs a few passes over the bins the compiler
+ * vectorizes. The percentiles come from a histogram of every bin with
+ * levels step_db apart from floor_db up, stored level by level so that
+ * adjacent bins at the same power land next to each other. The level of
+ * a bin is found with a polynomial log2 good to about 0.03 dB, not with
+ * log10. The per-frame cost does not depend on the window length; the
+ * percentiles are only searched for when a snapshot is taken. Not thread
+ * safe, fed and read by the pipeline thread.
+ */
+class bin_accumulator
+{
+public:
+    /*!
+     * \param num_bins the bins per spectrum frame
+     * \param first_freq the frequency of bin 0 in Hz
+     * \param bin_width the bin spacing in Hz
+     * \param config the histogram and the percentiles
+     */
+    bin_accumulator(size_t num_bins, double first_freq, double bin_width, const stats_config& config)
+        : _num_bins(num_bins)
+        , _first_freq(first_freq)
+        , _bin_width(bin_width)
+        , _floor_db(config.floor_db)
+        , _step_db(config.step_db)
+        , _percentiles(config.percentiles)
+        , _max(num_bins)
+        , _min(num_bins)
+        , _sum(num_bins)
+        , _level(num_bins)
+        , _hist(num_levels * num_bins)
+        , _frames(0)
+        , _start_us(0)
+        , _stop_us(0)
+    {
+        if (num_bins == 0 or config.step_db <= 0)
+            throw std::runtime_error("bin statistics need bins and a positive level step");
+        for (size_t i = 0; i < _percentiles.size(); i++) {
+            if (not(_percentiles[i] > 0 and _percentiles[i] < 100))
+                throw std::runtime_error("bin statistics percentiles must be within (0, 100)");
+        }
+        reset();
+    }
+
+    //! The number of frames added since the last snapshot
+    size_t get_frames(void) const
+    {
+        return _frames;
+    }
+
+    /*!
+     * Add a spectrum frame.
+     * \param lin the spectrum in linear power, num_bins values
+     * \param time_us the frame timestamp in microseconds since the epoch
+     */
+    void add(const float* lin, int64_t time_us)
+    {
+        if (_frames++ == 0)
+            _start_us = time_us;
+        _stop_us = time_us;
+
+        float* max  = &_max.front();
+        float* min  = &_min.front();
+        double* sum = &_sum.front();
+        for (size_t n = 0; n < _num_bins; n++) {
+            max[n] = std::max(max[n], lin[n]);
+            min[n] = std::min(min[n], lin[n]);
+            sum[n] += lin[n];
+        }
+
+        // histogram level, (10 log10(x) - floor) / step = log2(x) * a - b
+        const float a   = 10 * std::log10(2.0f) / _step_db;
+        const float b   = _floor_db / _step_db;
+        const float top = float(num_levels - 1);
+        uint8_t* level  = &_level.front();
+        for (size_t n = 0; n < _num_bins; n++) {
+            const float l = fast_log2(lin[n]) * a - b;
+            level[n]      = uint8_t(std::min(std::max(l, 0.0f), top));
+        }
+        uint32_t* hist = &_hist.front();
+        for (size_t n = 0; n < _num_bins; n++)
+            hist[level[n] * _num_bins + n]++;
+    }
+
+    /*!
+     * Take the statistics of the frames added so far and start a new window.
+     * \param out replaced with the statistics, its storage is reused
+     * \return false, and nothing taken, if no frame was added
+     */
+    bool snapshot(stats_snapshot& out)
+    {
+        if (_frames == 0)
+            return false;
+        out.first_freq = _first_freq;
+        out.bin_width  = _bin_width;
+        out.num_bins   = _num_bins;
+        out.frames     = _frames;
+        out.start_us   = _start_us;
+        out.stop_us    = _stop_us;
+        out.max_db.resize(_num_bins);
+        out.min_db.resize(_num_bins);
+        out.mean_db.resize(_num_bins);
+        for (size_t n = 0; n < _num_bins; n++) {
+            out.max_db[n]  = 10 * std::log10(_max[n]);
+            out.min_db[n]  = 10 * std::log10(_min[n]);
+            out.mean_db[n] = float(10 * std::log10(_sum[n] / _frames));
+        }
+
+        // walk up the levels of all bins at once, a percentile is the level
+        // where the count of its bin reaches its rank
+        out.percentiles = _percentiles;
+        out.percentile_db.assign(_percentiles.size() * _num_bins, _floor_db + (num_levels - 0.5f) * _step_db);
+        _cumulative.assign(_num_bins, 0);
+        _found.assign(_percentiles.size() * _num_bins, 0);
+        for (size_t l = 0; l < num_levels; l++) {
+            const uint32_t* row = &_hist[l * _num_bins];
+            const float db      = _floor_db + (l + 0.5f) * _step_db;
+            for (size_t n = 0; n < _num_bins; n++)
+                _cumulative[n] += row[n];
+            for (size_t i = 0; i < _percentiles.size(); i++) {
+                const uint32_t rank = uint32_t(std::ceil(_percentiles[i] / 100 * _frames));
+                uint8_t* found      = &_found[i * _num_bins];
+                float* value        = &out.percentile_db[i * _num_bins];
+                for (size_t n = 0; n < _num_bins; n++) {
+                    if (not found[n] and _cumulative[n] >= rank) {
+                        value[n] = db;
+                        found[n] = 1;
+                    }
+                }
+            }
+        }
+        reset();
+        return true;
+    }
+
+private:
+    static const size_t num_levels = 256;
+
+    //! log2 from the float exponent and a quadratic in the mantissa, within 0.01
+    static float fast_log2(float x)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        const float e = float(int32_t(bits >> 23) - 127);
+        bits          = (bits & 0x007fffffu) | 0x3f800000u;
+        float m;
+        std::memcpy(&m, &bits, sizeof(m));
+        return e + (-0.33688359f * m + 1.99491085f) * m - 1.64899973f;
+    }
+
+    void reset(void)
+    {
+        std::fill(_max.begin(), _max.end(), 0.0f);
+        std::fill(_min.begin(), _min.end(), std::numeric_limits<float>::max());
+        std::fill(_sum.begin(), _sum.end(), 0.0);
+        std::fill(_hist.begin(), _hist.end(), 0);
+        _frames = 0;
+    }
+
+    size_t _num_bins;
+    double _first_freq;
+    double _bin_width;
+    float _floor_db;
+    float _step_db;
+    std::vector<double> _percentiles;
+    std::vector<float> _max;
+    std::vector<float> _min;
+    std::vector<double> _sum;
+    std::vector<uint8_t> _level;      // histogram level of every bin of the last frame
+    std::vector<uint32_t> _hist;      // num_bins counts per level, levels from the floor up
+    std::vector<uint32_t> _cumulative; // snapshot scratch
+    std::vector<uint8_t> _found;       // snapshot scratch
+    size_t _frames;
+    int64_t _start_us;
+    int64_t _stop_us;
+};
+
+/*!
+ * Quantize dB values to 8-bit codes spanning their range, as the history does.
+ * \param db the values
+ * \param n the number of values
+ * \param codes replaced with n codes
+ * \param offset set to the dB value of code 0
+ * \param scale set to the dB per code step
+ */
+inline void quantize(const float* db, size_t n, std::vector<uint8_t>& codes, float& offset, float& scale)
+{
+    float lo = db[0], hi = db[0];
+    for (size_t i = 1; i < n; i++) {
+        lo = std::min(lo, db[i]);
+        hi = std::max(hi, db[i]);
+    }
+    // -inf values (exactly zero power) sit at code 0
+    lo                    = std::max(lo, hi - 255.0f);
+    scale                 = (hi > lo) ? (hi - lo) / 255 : 1.0f;
+    offset                = lo;
+    const float inv_scale = 1 / scale;
+    codes.resize(n);
+    for (size_t i = 0; i < n; i++)
+        codes[i] = uint8_t(std::min((std::max(db[i], lo) - lo) * inv_scale + 0.5f, 255.0f));
+}
+
+} // namespace esc_bin_stats
+
+#endif /*ESC_BIN_STATS_HPP*/
@@ -0,0 +1,306 @@
+//
+// ESC sensor node - locked, hugepage backed buffer pool
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_BUFFER_POOL_HPP
+#define ESC_BUFFER_POOL_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <vector>
+
+namespace esc_buffer_pool {
+
+//! Huge page size the pool is rounded and aligned to
+static const size_t huge_page_size = 2 * 1024 * 1024;
+
+//! Cache line size slots are aligned to
+static const size_t slot_align = 64;
+
+class buffer_pool;
+
+/*!
+ * A slot taken from a buffer_pool, returned to it on destruction.
+ * Movable, not copyable. A default constructed handle holds no slot.
+ */
+class buffer_handle
+{
+public:
+    buffer_handle(void) : _pool(nullptr), _slot(0), _data(nullptr), _size(0)
+    {
+        /* NOP */
+    }
+
+    buffer_handle(buffer_handle&& other)
+        : _pool(other._pool), _slot(other._slot), _data(other._data), _size(other._size)
+    {
+        other._pool = nullptr;
+        other._data = nullptr;
+    }
+
+    buffer_handle& operator=(buffer_handle&& other)
+    {
+        if (this != &other) {
+            release();
+            _pool       = other._pool;
+            _slot       = other._slot;
+            _data       = other._data;
+            _size       = other._size;
+            other._pool = nullptr;
+            other._data = nullptr;
+        }
+        return *this;
+    }
+
+    buffer_handle(const buffer_handle&) = delete;
+    buffer_handle& operator=(const buffer_handle&) = delete;
+
+    ~buffer_handle(void)
+    {
+        release();
+    }
+
+    //! True if the handle holds a slot
+    bool valid(void) const
+    {
+        return _data != nullptr;
+    }
+
+    //! The slot memory as an array of T
+    template <typename T> T* as(void) const
+    {
+        return static_cast<T*>(_data);
+    }
+
+    //! The slot size in bytes
+    size_t size(void) const
+    {
+        return _size;
+    }
+
+    //! Give the slot back to its pool early
+    inline void release(void);
+
+private:
+    friend class buffer_pool;
+
+    buffer_handle(buffer_pool* pool, size_t slot, void* data, size_t size)
+        : _pool(pool), _slot(slot), _data(data), _size(size)
+    {
+        /* NOP */
+    }
+
+    buffer_pool* _pool;
+    size_t _slot;
+    void* _data;
+    size_t _size;
+};
+
+/*!
+ * Fixed number of equally sized slots carved out of one mapping.
+ *
+ * The mapping uses explicit huge pages (MAP_HUGETLB) when the system has
+ * them reserved, otherwise 2 MB aligned anonymous memory marked for
+ * transparent huge pages. It is locked (when the memlock limit allows) and
+ * every page is written at construction, so using a slot never page faults.
+ * Pages are placed on the NUMA node of the thread that builds the pool
+ * (first touch), so build it on the thread that consumes it, after that
+ * thread is pinned.
+ */
+class buffer_pool
+{
+public:
+    /*!
+     * \param slot_bytes the size of every slot
+     * \param num_slots the number of slots
+     * \param lock lock the pool in memory
+     */
+    buffer_pool(size_t slot_bytes, size_t num_slots, bool lock = true)
+        : _slot_bytes(slot_bytes)
+        , _stride((slot_bytes + slot_align - 1) / slot_align * slot_align)
+        , _length((_stride * num_slots + huge_page_size - 1) / huge_page_size * huge_page_size)
+        , _mapping(nullptr)
+        , _map_length(0)
+        , _base(nullptr)
+        , _huge(false)
+        , _locked(false)
+    {
+        if (slot_bytes == 0 or num_slots == 0)
+            throw std::runtime_error("buffer pool needs at least one non-empty slot");
+
+        void* map = mmap(nullptr,
+            _length,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+            -1,
+            0);
+        if (map != MAP_FAILED) {
+            _huge       = true;
+            _mapping    = map;
+            _map_length = _length;
+            _base       = static_cast<uint8_t*>(map);
+        } else {
+            // over-allocate to cut out a huge page aligned range
+            _map_length = _length + huge_page_size;
+            map         = mmap(nullptr,
+                _map_length,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS,
+                -1,
+                0);
+            if (map == MAP_FAILED)
+                throw std::runtime_error("cannot map buffer pool memory");
+            _mapping         = map;
+            const uintptr_t addr = reinterpret_cast<uintptr_t>(map);
+            _base = reinterpret_cast<uint8_t*>(
+                (addr + huge_page_size - 1) / huge_page_size * huge_page_size);
+#ifdef MADV_HUGEPAGE
+            madvise(_base, _length, MADV_HUGEPAGE);
+#endif
+        }
+
+        if (lock) {
+            _locked = mlock(_base, _length) == 0;
+            if (not _locked)
+                std::cerr << "Cannot lock " << _length / 1024
+                          << " kB buffer pool, raise the memlock limit" << std::endl;
+        }
+        // pre-fault every page on this thread's NUMA node
+        std::memset(_base, 0, _length);
+
+        _free.reserve(num_slots);
+        for (size_t i = num_slots; i > 0; i--)
+            _free.push_back(i - 1);
+        _num_slots = num_slots;
+    }
+
+    ~buffer_pool(void)
+    {
+        if (_locked)
+            munlock(_base, _length);
+        munmap(_mapping, _map_length);
+    }
+
+    buffer_pool(const buffer_pool&) = delete;
+    buffer_pool& operator=(const buffer_pool&) = delete;
+
+    /*!
+     * Take a free slot.
+     * \return the slot, or an invalid handle when every slot is in use
+     */
+    buffer_handle acquire(void)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_free.empty())
+            return buffer_handle();
+        const size_t slot = _free.back();
+        _free.pop_back();
+        return buffer_handle(this, slot, _base + slot * _stride, _slot_bytes);
+    }
+
+    //! The number of free slots
+    size_t get_num_free(void)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _free.size();
+    }
+
+    size_t get_num_slots(void) const
+    {
+        return _num_slots;
+    }
+
+    size_t get_slot_bytes(void) const
+    {
+        return _slot_bytes;
+    }
+
+    //! True if the pool got explicit huge pages
+    bool is_huge(void) const
+    {
+        return _huge;
+    }
+
+    //! True if the pool is locked in memory
+    bool is_locked(void) const
+    {
+        return _locked;
+    }
+
+private:
+    friend class buffer_handle;
+
+    void put_back(size_t slot)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _free.push_back(slot); // capacity is reserved, never allocates
+    }
+
+    size_t _slot_bytes;
+    size_t _stride;
+    size_t _length;
+    void* _mapping;
+    size_t _map_length;
+    uint8_t* _base;
+    bool _huge;
+    bool _locked;
+    size_t _num_slots;
+    std::vector<size_t> _free;
+    std::mutex _mutex;
+};
+
+inline void buffer_handle::release(void)
+{
+    if (_pool != nullptr)
+        _pool->put_back(_slot);
+    _pool = nullptr;
+    _data = nullptr;
+}
+
+//! True if the process may lock any amount of memory: no memlock limit, or CAP_IPC_LOCK
+inline bool can_lock_any(void)
+{
+    rlimit limit;
+    if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 and limit.rlim_cur == RLIM_INFINITY)
+        return true;
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 7, "CapEff:") == 0)
+            return (std::stoull(line.substr(7), nullptr, 16) >> 14) & 1; // CAP_IPC_LOCK
+    }
+    return false;
+}
+
+/*!
+ * Lock the whole process in memory, what is mapped now and every later
+ * mapping, so that the memory outside the pools (DFT plans, detector,
+ * sweep and classifier scratch, thread stacks) does not page fault in the
+ * hot path either: pages are faulted in when they are mapped. Only done
+ * when nothing limits locked memory, under a limit an allocation past it
+ * would fail instead of just staying unlocked.
+ * eturn an empty string, or why the process is not locked
+ */
+inline std::string lock_process(void)
+{
+    if (not can_lock_any())
+        return "the memlock limit is set (ulimit -l unlimited or CAP_IPC_LOCK lifts it)";
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        return std::strerror(errno);
+    return "";
+}
+
+} // namespace esc_buffer_pool
+
+#endif /*ESC_BUFFER_POOL_HPP*/
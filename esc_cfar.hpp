@@ -0,0 +1,323 @@
+//
+// ESC sensor node - adaptive noise-floor CFAR detector
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_CFAR_HPP
+#define ESC_CFAR_HPP
+
+#include "esc_channel_plan.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace esc_cfar {
+
+//! How the reference level is formed from the training cells
+enum cfar_mode {
+    CFAR_CA, //!< cell averaging: mean of the training cells
+    CFAR_OS  //!< ordered statistic: k-th smallest training cell
+};
+
+//! Parse "ca" or "os" into a cfar_mode
+inline cfar_mode parse_mode(const std::string& mode)
+{
+    if (mode == "ca")
+        return CFAR_CA;
+    if (mode == "os")
+        return CFAR_OS;
+    throw std::runtime_error("unknown CFAR mode: " + mode);
+}
+
+//! Detector settings, the defaults suit a 512 bin spectrum of 10 MHz channels
+struct cfar_config
+{
+    cfar_config(void)
+        : mode(CFAR_CA)
+        , guard_cells(2)
+        , train_cells(16)
+        , os_rank(0)
+        , pfa(1e-3)
+        , floor_rate(0.05f)
+        , on_occupancy(0.1f)
+        , off_occupancy(0.05f)
+        , on_frames(2)
+        , off_frames(8)
+    {
+        /* NOP */
+    }
+
+    cfar_mode mode;
+    size_t guard_cells;  //!< cells skipped on each side of the cell under test
+    size_t train_cells;  //!< reference cells on each side of the guard cells
+    size_t os_rank;      //!< OS-CFAR rank (1-based), 0 selects 3/4 of the cells
+    double pfa;          //!< per-bin probability of false alarm
+    float floor_rate;    //!< per-bin noise floor tracking rate
+    float on_occupancy;  //!< fraction of channel bins over threshold to count a hit
+    float off_occupancy; //!< fraction of channel bins over threshold to count a miss
+    size_t on_frames;    //!< consecutive hits before a channel is declared busy
+    size_t off_frames;   //!< consecutive misses before a channel is declared idle
+};
+
+/*!
+ * Threshold factor of a CA-CFAR with n square-law training cells.
+ * \param n the number of training cells
+ * \param pfa the probability of false alarm
+ */
+inline double ca_threshold_factor(size_t n, double pfa)
+{
+    return n * (std::pow(pfa, -1.0 / n) - 1.0);
+}
+
+/*!
+ * Threshold factor of an OS-CFAR with n square-law training cells using the
+ * k-th smallest cell, found by bisection of
+ * pfa = prod_{i=0}^{k-1} (n - i) / (n - i + alpha).
+ * \param n the number of training cells
+ * \param k the rank of the reference cell, 1 <= k <= n
+ * \param pfa the probability of false alarm
+ */
+inline double os_threshold_factor(size_t n, size_t k, double pfa)
+{
+    const double log_pfa = std::log(pfa);
+    double lo = 0, hi = 1e6;
+    for (int iter = 0; iter < 100; iter++) {
+        const double alpha = (lo + hi) / 2;
+        double log_p       = 0;
+        for (size_t i = 0; i < k; i++)
+            log_p += std::log(double(n - i) / (n - i + alpha));
+        if (log_p > log_pfa)
+            lo = alpha;
+        else
+            hi = alpha;
+    }
+    return (lo + hi) / 2;
+}
+
+/*!
+ * CFAR detector over a centered log power spectrum.
+ *
+ * Each bin keeps a linear noise-floor estimate that follows the spectrum
+ * only while the bin is not detected. Gain and noise-floor shifts common to
+ * all bins are removed every frame by rescaling the floor with the median
+ * bin-to-floor ratio, which signals in a minority of bins do not move.
+ * The reference level of a bin is formed from the floor estimates of its
+ * training cells, so a wideband signal does not raise its own threshold.
+ * The fraction of detected bins per channel drives a per-channel state
+ * with hysteresis.
+ */
+class cfar_detector
+{
+public:
+    cfar_detector(const esc_channel_plan::channel_plan& plan, const cfar_config& config)
+        : _plan(plan)
+        , _config(config)
+        , _num_bins(plan.get_num_bins())
+        , _primed(false)
+        , _alpha(_num_bins)
+        , _lin(_num_bins)
+        , _floor(_num_bins)
+        , _ref(_num_bins)
+        , _hits(_num_bins)
+        , _prefix(_num_bins + 1)
+        , _detected(plan.size(), false)
+        , _run(plan.size(), 0)
+        , _occupancy(plan.size(), 0.0f)
+        , _excess(plan.size(), 0.0f)
+    {
+        if (config.train_cells == 0)
+            throw std::runtime_error("CFAR needs at least one training cell");
+        if (config.pfa <= 0 or config.pfa >= 1)
+            throw std::runtime_error("CFAR probability of false alarm must be in (0, 1)");
+
+        // the window is clipped at the spectrum edges, so the number of
+        // training cells and with it the threshold factor varies per bin
+        for (size_t n = 0; n < _num_bins; n++) {
+            size_t lo0, lo1, hi0, hi1;
+            window(n, lo0, lo1, hi0, hi1);
+            const size_t cells = (lo1 - lo0) + (hi1 - hi0);
+            if (cells == 0)
+                throw std::runtime_error("CFAR window does not fit in the spectrum");
+            if (config.mode == CFAR_CA) {
+                _alpha[n] = float(ca_threshold_factor(cells, config.pfa));
+            } else {
+                _alpha[n] = float(os_threshold_factor(cells, os_rank(cells), config.pfa));
+            }
+        }
+    }
+
+    /*!
+     * Run the detector on one spectrum frame in linear power.
+     * \param lin the centered spectrum in linear power, num_bins values
+     */
+    void process_linear(const float* lin)
+    {
+        std::copy(lin, lin + _num_bins, _lin.begin());
+        detect();
+    }
+
+    //! True while the channel is declared busy
+    bool is_detected(size_t ch) const
+    {
+        return _detected.at(ch);
+    }
+
+    //! Fraction of the channel bins over threshold in the last frame
+    float get_occupancy(size_t ch) const
+    {
+        return _occupancy.at(ch);
+    }
+
+    //! Channel power over the reference level in dB in the last frame
+    float get_excess(size_t ch) const
+    {
+        return _excess.at(ch);
+    }
+
+    //! The per-bin linear noise-floor estimates
+    const std::vector<float>& get_noise_floor(void) const
+    {
+        return _floor;
+    }
+
+    //! The busy channel with the largest excess, -1 when all are idle
+    int get_strongest_channel(void) const
+    {
+        int strongest = -1;
+        for (size_t ch = 0; ch < _detected.size(); ch++) {
+            if (_detected[ch] and (strongest < 0 or _excess[ch] > _excess[strongest]))
+                strongest = int(ch);
+        }
+        return strongest;
+    }
+
+private:
+    //! Detect on the frame in _lin
+    void detect(void)
+    {
+        // keeps the floor positive when bins read exactly zero (-inf dB)
+        const float min_floor = 1e-30f;
+        // start from a flat floor, the common-mode step below levels it
+        if (not _primed) {
+            std::fill(_floor.begin(), _floor.end(), _lin[0]);
+            _primed = true;
+        }
+
+        // the median of a square-law bin is ln(2) times its mean
+        _scratch.resize(_num_bins);
+        for (size_t n = 0; n < _num_bins; n++)
+            _scratch[n] = _lin[n] / _floor[n];
+        std::nth_element(_scratch.begin(), _scratch.begin() + _num_bins / 2, _scratch.end());
+        const float common = _scratch[_num_bins / 2] / float(std::log(2.0));
+        for (size_t n = 0; n < _num_bins; n++)
+            _floor[n] = std::max(_floor[n] * common, min_floor);
+
+        if (_config.mode == CFAR_CA)
+            reference_ca();
+        else
+            reference_os();
+
+        for (size_t n = 0; n < _num_bins; n++)
+            _hits[n] = (_lin[n] > _alpha[n] * _ref[n]) ? 1.0f : 0.0f;
+
+        // track the floor of the bins that are not detected
+        const float rate = _config.floor_rate;
+        for (size_t n = 0; n < _num_bins; n++)
+            _floor[n] += (1.0f - _hits[n]) * rate * (_lin[n] - _floor[n]);
+        for (size_t n = 0; n < _num_bins; n++)
+            _floor[n] = std::max(_floor[n], min_floor);
+
+        for (size_t ch = 0; ch < _plan.size(); ch++) {
+            if (not _plan.is_covered(ch))
+                continue;
+            _occupancy[ch] = _plan.reduce_channel(&_hits.front(), ch);
+            _excess[ch]    = 10 * std::log10(_plan.reduce_channel(&_lin.front(), ch)
+                                          / _plan.reduce_channel(&_ref.front(), ch));
+            update_state(ch);
+        }
+    }
+
+    //! Training cell ranges [lo0, lo1) and [hi0, hi1) of bin n
+    void window(size_t n, size_t& lo0, size_t& lo1, size_t& hi0, size_t& hi1) const
+    {
+        const size_t g = _config.guard_cells, t = _config.train_cells;
+        lo1 = (n > g) ? n - g : 0;
+        lo0 = (lo1 > t) ? lo1 - t : 0;
+        hi0 = std::min(n + g + 1, _num_bins);
+        hi1 = std::min(hi0 + t, _num_bins);
+    }
+
+    size_t os_rank(size_t cells) const
+    {
+        const size_t k = _config.os_rank ? _config.os_rank : (3 * cells + 3) / 4;
+        return std::max<size_t>(1, std::min(k, cells));
+    }
+
+    void reference_ca(void)
+    {
+        // sliding window sums from a prefix sum of the floor
+        _prefix[0] = 0;
+        for (size_t n = 0; n < _num_bins; n++)
+            _prefix[n + 1] = _prefix[n] + _floor[n];
+        for (size_t n = 0; n < _num_bins; n++) {
+            size_t lo0, lo1, hi0, hi1;
+            window(n, lo0, lo1, hi0, hi1);
+            const double sum =
+                (_prefix[lo1] - _prefix[lo0]) + (_prefix[hi1] - _prefix[hi0]);
+            _ref[n] = float(sum / ((lo1 - lo0) + (hi1 - hi0)));
+        }
+    }
+
+    void reference_os(void)
+    {
+        std::vector<float>& cells = _scratch;
+        for (size_t n = 0; n < _num_bins; n++) {
+            size_t lo0, lo1, hi0, hi1;
+            window(n, lo0, lo1, hi0, hi1);
+            cells.assign(_floor.begin() + lo0, _floor.begin() + lo1);
+            cells.insert(cells.end(), _floor.begin() + hi0, _floor.begin() + hi1);
+            const size_t k = os_rank(cells.size()) - 1;
+            std::nth_element(cells.begin(), cells.begin() + k, cells.end());
+            _ref[n] = cells[k];
+        }
+    }
+
+    void update_state(size_t ch)
+    {
+        // _run counts consecutive frames that disagree with the current state
+        const bool hit  = _occupancy[ch] >= _config.on_occupancy;
+        const bool miss = _occupancy[ch] < _config.off_occupancy;
+        if (_detected[ch] ? miss : hit)
+            _run[ch]++;
+        else
+            _run[ch] = 0;
+        if (_run[ch] >= (_detected[ch] ? _config.off_frames : _config.on_frames)) {
+            _detected[ch] = not _detected[ch];
+            _run[ch]      = 0;
+        }
+    }
+
+    esc_channel_plan::channel_plan _plan;
+    cfar_config _config;
+    size_t _num_bins;
+    bool _primed;
+    std::vector<float> _alpha;
+    std::vector<float> _lin;
+    std::vector<float> _floor;
+    std::vector<float> _ref;
+    std::vector<float> _hits;
+    std::vector<double> _prefix;
+    std::vector<float> _scratch;
+    std::vector<bool> _detected;
+    std::vector<size_t> _run;
+    std::vector<float> _occupancy;
+    std::vector<float> _excess;
+};
+
+} // namespace esc_cfar
+
+#endif /*ESC_CFAR_HPP*/
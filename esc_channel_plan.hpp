@@ -0,0 +1,222 @@
+//
+// ESC sensor node - channel plan and FFT bin map
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_CHANNEL_PLAN_HPP
+#define ESC_CHANNEL_PLAN_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+namespace esc_channel_plan {
+
+//! A single channel of the plan, absolute frequencies in Hz
+struct channel_def
+{
+    double center_freq;
+    double bandwidth;
+};
+
+/*!
+ * Build a list of equally spaced, equal width channels.
+ * \param first_center the center frequency of the first channel in Hz
+ * \param width the width (and spacing) of the channels in Hz
+ * \param count the number of channels
+ * \return the channel list
+ */
+inline std::vector<channel_def> make_uniform_channels(
+    double first_center, double width, size_t count)
+{
+    std::vector<channel_def> channels(count);
+    for (size_t i = 0; i < count; i++) {
+        channels[i].center_freq = first_center + i * width;
+        channels[i].bandwidth   = width;
+    }
+    return channels;
+}
+
+/*!
+ * Maps a list of channels onto the bins of a centered (DC in the middle)
+ * spectrum of num_bins bins. Bin n covers the frequencies
+ * center_freq + (n - num_bins/2 +- 0.5) * samp_rate/num_bins.
+ *
+ * The fractional bin range of each channel is computed once, bins that are
+ * only partially inside a channel get a fractional weight. Channels that are
+ * not entirely inside the usable part of the spectrum (num_bins minus
+ * edge_bins at each end, where the anti-aliasing filter rolls off) are
+ * marked as not covered and are never reduced.
+ */
+class channel_plan
+{
+public:
+    channel_plan(double center_freq,
+        double samp_rate,
+        size_t num_bins,
+        const std::vector<channel_def>& channels,
+        size_t edge_bins = 0)
+        : _center_freq(center_freq)
+        , _samp_rate(samp_rate)
+        , _num_bins(num_bins)
+        , _channels(channels)
+    {
+        if (num_bins == 0 or samp_rate <= 0)
+            throw std::runtime_error("channel plan needs a bin count and a sample rate");
+        if (2 * edge_bins >= num_bins)
+            throw std::runtime_error("channel plan edge bins exceed the bin count");
+
+        const double usable_lo = double(edge_bins) - 0.5;
+        const double usable_hi = double(num_bins - edge_bins) - 0.5;
+
+        for (size_t ch = 0; ch < channels.size(); ch++) {
+            span_type span = {0, 0, _weights.size(), 0.0f};
+            const double lo = freq_to_pos(channels[ch].center_freq - channels[ch].bandwidth / 2);
+            const double hi = freq_to_pos(channels[ch].center_freq + channels[ch].bandwidth / 2);
+            if (lo >= usable_lo and hi <= usable_hi and hi > lo) {
+                span.first = size_t(std::floor(lo + 0.5));
+                const size_t last =
+                    std::min(size_t(std::ceil(hi + 0.5)) - 1, num_bins - 1);
+                double norm = 0;
+                for (size_t n = span.first; n <= last; n++) {
+                    const double w =
+                        std::min(hi, n + 0.5) - std::max(lo, n - 0.5);
+                    _weights.push_back(float(std::max(w, 0.0)));
+                    norm += std::max(w, 0.0);
+                }
+                span.count    = last + 1 - span.first;
+                span.inv_norm = float(1.0 / norm);
+            }
+            _spans.push_back(span);
+        }
+    }
+
+    //! The number of channels in the plan
+    size_t size(void) const
+    {
+        return _channels.size();
+    }
+
+    //! The number of spectrum bins the plan was built for
+    size_t get_num_bins(void) const
+    {
+        return _num_bins;
+    }
+
+    //! The RF center frequency of the spectrum in Hz
+    double get_spectrum_freq(void) const
+    {
+        return _center_freq;
+    }
+
+    //! The sample rate of the spectrum in Sps
+    double get_samp_rate(void) const
+    {
+        return _samp_rate;
+    }
+
+    //! The center frequency of a channel in Hz
+    double get_center_freq(size_t ch) const
+    {
+        return _channels.at(ch).center_freq;
+    }
+
+    //! The bandwidth of a channel in Hz
+    double get_bandwidth(size_t ch) const
+    {
+        return _channels.at(ch).bandwidth;
+    }
+
+    //! The channel a frequency in Hz falls into, -1 if none
+    int find_channel(double freq) const
+    {
+        for (size_t ch = 0; ch < _channels.size(); ch++) {
+            if (std::abs(freq - _channels[ch].center_freq) <= _channels[ch].bandwidth / 2)
+                return int(ch);
+        }
+        return -1;
+    }
+
+    //! True when the channel lies entirely inside the usable bins
+    bool is_covered(size_t ch) const
+    {
+        return _spans.at(ch).count != 0;
+    }
+
+    //! The center frequency of a spectrum bin in Hz
+    double get_bin_freq(size_t n) const
+    {
+        return _center_freq + (double(n) - double(_num_bins / 2)) * _samp_rate / _num_bins;
+    }
+
+    /*!
+     * Weighted mean of the spectrum bins inside a channel.
+     * \param spectrum the centered spectrum, num_bins values
+     * \param ch the channel index, must be covered
+     * \return the weighted mean of the channel bins
+     */
+    float reduce_channel(const float* spectrum, size_t ch) const
+    {
+        const span_type& span = _spans[ch];
+        return weighted_sum(spectrum + span.first, &_weights[span.weight_offset], span.count)
+               * span.inv_norm;
+    }
+
+    /*!
+     * Reduce a full spectrum to one value per channel.
+     * Channels that are not covered are left untouched in out.
+     * \param spectrum the centered spectrum, num_bins values
+     * \param out the output array, size() values
+     */
+    void reduce(const float* spectrum, float* out) const
+    {
+        for (size_t ch = 0; ch < _spans.size(); ch++) {
+            if (_spans[ch].count != 0)
+                out[ch] = reduce_channel(spectrum, ch);
+        }
+    }
+
+private:
+    struct span_type
+    {
+        size_t first;
+        size_t count;
+        size_t weight_offset;
+        float inv_norm;
+    };
+
+    double freq_to_pos(double freq) const
+    {
+        return (freq - _center_freq) * _num_bins / _samp_rate + double(_num_bins / 2);
+    }
+
+    //! Dot product with independent partial sums so the compiler can vectorize it
+    static float weighted_sum(const float* x, const float* w, size_t n)
+    {
+        float acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            acc0 += x[i + 0] * w[i + 0];
+            acc1 += x[i + 1] * w[i + 1];
+            acc2 += x[i + 2] * w[i + 2];
+            acc3 += x[i + 3] * w[i + 3];
+        }
+        for (; i < n; i++)
+            acc0 += x[i] * w[i];
+        return (acc0 + acc1) + (acc2 + acc3);
+    }
+
+    double _center_freq;
+    double _samp_rate;
+    size_t _num_bins;
+    std::vector<channel_def> _channels;
+    std::vector<span_type> _spans;
+    std::vector<float> _weights;
+};
+
+} // namespace esc_channel_plan
+
+#endif /*ESC_CHANNEL_PLAN_HPP*/
@@ -0,0 +1,423 @@
+//
+// ESC sensor node - on-node signal classifier
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_CLASSIFIER_HPP
+#define ESC_CLASSIFIER_HPP
+
+#include "esc_aggregator.hpp"
+#include "esc_dft.hpp"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace esc_classifier {
+
+//! Features computed from an IQ capture, in model input order
+enum feature_index {
+    FEAT_OCCUPANCY = 0, //!< fraction of bins 10 dB over the noise floor
+    FEAT_BW_3DB,        //!< span of the bins within 3 dB of the peak, fraction of the rate
+    FEAT_BW_99,         //!< bandwidth holding 99% of the power, fraction of the rate
+    FEAT_FLATNESS,      //!< spectral flatness, geometric over arithmetic mean
+    FEAT_PEAK_SNR,      //!< spectrum peak over the noise floor in dB
+    FEAT_PAPR,          //!< peak to average power ratio in dB
+    FEAT_KURTOSIS,      //!< E|x|^4 / (E|x|^2)^2, 1 for constant envelope, 2 for Gaussian
+    FEAT_DUTY_CYCLE,    //!< fraction of the capture the envelope is on
+    FEAT_PULSE_WIDTH,   //!< log10 of the mean pulse width in seconds
+    FEAT_PRI,           //!< log10 of the mean pulse repetition interval in seconds
+    FEAT_PRI_JITTER,    //!< standard deviation over mean of the PRIs
+    FEAT_C20,           //!< |E[x^2]| / E|x|^2, second order cyclic feature (real modulations)
+    FEAT_C40,           //!< |E[x^4]| / (E|x|^2)^2, fourth order cyclic feature (QPSK)
+    NUM_FEATURES
+};
+
+//! log10 time used for the pulse features of a capture without pulses
+static const float no_pulse_log_time = -7.0f;
+
+/*!
+ * Compute the classifier features of an IQ capture.
+ * \param samps the IQ samples
+ * \param nsamps the number of samples
+ * \param samp_rate the sample rate in Sps
+ * \param features NUM_FEATURES outputs
+ */
+inline void compute_features(
+    const std::complex<float>* samps, size_t nsamps, double samp_rate, float* features)
+{
+    std::fill(features, features + NUM_FEATURES, 0.0f);
+
+    // averaged periodogram of the strongest segments, so pulsed signals show
+    // their own spectrum
+    const size_t seg_len      = 128;
+    const size_t num_segments = nsamps / seg_len;
+    const size_t num_segs     = std::min<size_t>(16, num_segments);
+    if (num_segs == 0)
+        throw std::runtime_error("capture is too short to classify");
+    std::vector<std::pair<double, size_t>> seg_energy(num_segments);
+    for (size_t s = 0; s < num_segments; s++) {
+        double energy = 0;
+        for (size_t i = 0; i < seg_len; i++)
+            energy += std::norm(samps[s * seg_len + i]);
+        seg_energy[s] = std::make_pair(energy, s);
+    }
+    std::partial_sort(seg_energy.begin(), seg_energy.begin() + num_segs, seg_energy.end(),
+        std::greater<std::pair<double, size_t>>());
+    std::vector<double> psd(seg_len, 0.0);
+    for (size_t s = 0; s < num_segs; s++) {
+        const esc_dft::log_pwr_dft_type dft =
+            esc_dft::log_pwr_dft(samps + seg_energy[s].second * seg_len, seg_len);
+        for (size_t n = 0; n < seg_len; n++)
+            psd[(n + seg_len / 2) % seg_len] += std::pow(10.0, dft[n] / 10) / num_segs;
+    }
+    std::vector<double> sorted(psd);
+    std::nth_element(sorted.begin(), sorted.begin() + seg_len / 5, sorted.end());
+    const double floor = std::max(sorted[seg_len / 5], 1e-30);
+    const size_t peak  = std::max_element(psd.begin(), psd.end()) - psd.begin();
+    double total = 0, log_sum = 0;
+    size_t occupied = 0, first_3db = peak, last_3db = peak;
+    for (size_t n = 0; n < seg_len; n++) {
+        total += psd[n];
+        log_sum += std::log(std::max(psd[n], 1e-30));
+        if (psd[n] > 10 * floor)
+            occupied++;
+        if (psd[n] >= psd[peak] / 2) {
+            first_3db = std::min(first_3db, n);
+            last_3db  = std::max(last_3db, n);
+        }
+    }
+    // the 99% bandwidth is the narrowest span around the peak holding 99% of the power
+    size_t lo = peak, hi = peak;
+    double held = psd[peak];
+    while (held < 0.99 * total and (lo > 0 or hi + 1 < seg_len)) {
+        if (hi + 1 >= seg_len or (lo > 0 and psd[lo - 1] >= psd[hi + 1]))
+            held += psd[--lo];
+        else
+            held += psd[++hi];
+    }
+    features[FEAT_OCCUPANCY] = float(occupied) / seg_len;
+    features[FEAT_BW_3DB]    = float(last_3db - first_3db + 1) / seg_len;
+    features[FEAT_BW_99]     = float(hi - lo + 1) / seg_len;
+    features[FEAT_FLATNESS]  = float(std::exp(log_sum / seg_len) / (total / seg_len));
+    features[FEAT_PEAK_SNR]  = float(10 * std::log10(psd[peak] / floor));
+
+    // moments of the samples
+    double m2 = 0, m4 = 0, peak_pwr = 0;
+    std::complex<double> c20 = 0, c40 = 0;
+    for (size_t i = 0; i < nsamps; i++) {
+        const std::complex<double> x(samps[i]);
+        const double pwr = std::norm(x);
+        const std::complex<double> x2 = x * x;
+        m2 += pwr;
+        m4 += pwr * pwr;
+        c20 += x2;
+        c40 += x2 * x2;
+        peak_pwr = std::max(peak_pwr, pwr);
+    }
+    m2 /= nsamps;
+    m4 /= nsamps;
+    if (m2 <= 0)
+        return;
+    features[FEAT_PAPR]     = float(10 * std::log10(peak_pwr / m2));
+    features[FEAT_KURTOSIS] = float(m4 / (m2 * m2));
+    features[FEAT_C20]      = float(std::abs(c20) / nsamps / m2);
+    features[FEAT_C40]      = float(std::abs(c40) / nsamps / (m2 * m2));
+
+    // pulses of the envelope, in blocks of 16 samples, 6 dB over the envelope floor
+    const size_t block      = 16;
+    const size_t num_blocks = nsamps / block;
+    std::vector<double> env(num_blocks, 0.0);
+    for (size_t b = 0; b < num_blocks; b++) {
+        for (size_t i = 0; i < block; i++)
+            env[b] += std::norm(samps[b * block + i]);
+    }
+    std::vector<double> env_sorted(env);
+    std::nth_element(env_sorted.begin(), env_sorted.begin() + num_blocks / 4, env_sorted.end());
+    const double threshold = 4 * env_sorted[num_blocks / 4];
+    std::vector<size_t> rises;
+    size_t on_blocks = 0, pulse_blocks = 0, num_pulses = 0;
+    bool on = false;
+    for (size_t b = 0; b < num_blocks; b++) {
+        const bool now_on = env[b] > threshold;
+        if (now_on) {
+            on_blocks++;
+            if (not on)
+                rises.push_back(b);
+        }
+        // only pulses that end inside the capture have a known width
+        if (on and not now_on and rises.back() > 0) {
+            pulse_blocks += b - rises.back();
+            num_pulses++;
+        }
+        on = now_on;
+    }
+    const double block_time      = block / samp_rate;
+    features[FEAT_DUTY_CYCLE]    = float(on_blocks) / std::max<size_t>(num_blocks, 1);
+    features[FEAT_PULSE_WIDTH]   = num_pulses > 0
+                                     ? float(std::log10(pulse_blocks * block_time / num_pulses))
+                                     : no_pulse_log_time;
+    features[FEAT_PRI]           = no_pulse_log_time;
+    // a capture that starts on does not show the rise of its first pulse
+    const size_t first_rise = (not rises.empty() and rises.front() == 0) ? 1 : 0;
+    if (rises.size() >= first_rise + 2) {
+        double sum = 0, sum_sq = 0;
+        const size_t num_pri = rises.size() - first_rise - 1;
+        for (size_t i = first_rise; i + 1 < rises.size(); i++) {
+            const double pri = (rises[i + 1] - rises[i]) * block_time;
+            sum += pri;
+            sum_sq += pri * pri;
+        }
+        const double mean = sum / num_pri;
+        features[FEAT_PRI]        = float(std::log10(mean));
+        features[FEAT_PRI_JITTER] = float(
+            std::sqrt(std::max(sum_sq / num_pri - mean * mean, 0.0)) / mean);
+    }
+}
+
+//! The result of a classification
+struct classification
+{
+    std::string label;
+    float confidence;
+};
+
+/*!
+ * A small multi-layer perceptron with int8 weights and activations.
+ *
+ * Features are standardized with (f - mean) / scale and quantized with the
+ * input scale. Every layer computes int32 dot products of int8 weights and
+ * int8 activations, the result is real = acc * in_scale * w_scale + bias *
+ * in_scale * w_scale, hidden layers apply a ReLU and requantize to int8 with
+ * their out_scale. The last layer gives the logits, the confidence is their
+ * softmax maximum.
+ *
+ * The model is a whitespace separated text file, lines starting with # are
+ * comments:
+ *   labels <num_labels> <label> ...
+ * where labels are printable ASCII without quotes or backslashes, as the
+ * reports and the aggregator datagrams carry them unescaped, then
+ *   features <NUM_FEATURES>
+ *   mean <NUM_FEATURES floats>
+ *   scale <NUM_FEATURES floats>
+ *   input_scale <float>
+ *   layers <num_layers>
+ * followed by num_layers times:
+ *   layer <outputs> <inputs> <relu 0|1> <w_scale> <out_scale>
+ *   <outputs * inputs int8 weights, row major>
+ *   <outputs int32 biases>
+ */
+class int8_mlp
+{
+public:
+    //! Load a model file, throws on a malformed file or an unsafe label
+    int8_mlp(const std::string& path)
+    {
+        std::ifstream file(path.c_str());
+        if (not file)
+            throw std::runtime_error("cannot open classifier model " + path);
+        std::stringstream tokens;
+        std::string line;
+        while (std::getline(file, line)) {
+            if (line.empty() or line[0] == '#')
+                continue;
+            tokens << line << '\n';
+        }
+
+        size_t num_labels, num_features, num_layers;
+        expect(tokens, "labels");
+        read(tokens, num_labels);
+        _labels.resize(num_labels);
+        for (size_t i = 0; i < num_labels; i++) {
+            read(tokens, _labels[i]);
+            if (not esc_aggregator::is_safe_text(_labels[i]))
+                throw std::runtime_error("classifier model label " + _labels[i]
+                                         + " has quotes, backslashes or non-printable characters");
+        }
+        expect(tokens, "features");
+        read(tokens, num_features);
+        if (num_features != NUM_FEATURES)
+            throw std::runtime_error("classifier model expects a different feature set");
+        _mean.resize(num_features);
+        _scale.resize(num_features);
+        expect(tokens, "mean");
+        for (size_t i = 0; i < num_features; i++)
+            read(tokens, _mean[i]);
+        expect(tokens, "scale");
+        for (size_t i = 0; i < num_features; i++)
+            read(tokens, _scale[i]);
+        expect(tokens, "input_scale");
+        read(tokens, _input_scale);
+        expect(tokens, "layers");
+        read(tokens, num_layers);
+
+        size_t inputs = num_features;
+        _layers.resize(num_layers);
+        for (size_t l = 0; l < num_layers; l++) {
+            layer_type& layer = _layers[l];
+            int relu;
+            expect(tokens, "layer");
+            read(tokens, layer.outputs);
+            read(tokens, layer.inputs);
+            read(tokens, relu);
+            read(tokens, layer.w_scale);
+            read(tokens, layer.out_scale);
+            layer.relu = relu != 0;
+            if (layer.inputs != inputs)
+                throw std::runtime_error("classifier model layer sizes do not chain");
+            layer.weights.resize(layer.outputs * layer.inputs);
+            for (size_t i = 0; i < layer.weights.size(); i++) {
+                int w;
+                read(tokens, w);
+                if (w < -128 or w > 127)
+                    throw std::runtime_error("classifier model weight out of int8 range");
+                layer.weights[i] = int8_t(w);
+            }
+            layer.bias.resize(layer.outputs);
+            for (size_t i = 0; i < layer.outputs; i++)
+                read(tokens, layer.bias[i]);
+            inputs = layer.outputs;
+        }
+        if (num_layers == 0 or inputs != num_labels)
+            throw std::runtime_error("classifier model output does not match its labels");
+    }
+
+    //! The class labels
+    const std::vector<std::string>& get_labels(void) const
+    {
+        return _labels;
+    }
+
+    /*!
+     * Classify a feature vector.
+     * \param features NUM_FEATURES features from compute_features()
+     * \return the most likely label and its softmax probability
+     */
+    classification classify(const float* features) const
+    {
+        std::vector<int8_t> act(NUM_FEATURES), next;
+        for (size_t i = 0; i < NUM_FEATURES; i++)
+            act[i] = quantize((features[i] - _mean[i]) / _scale[i] / _input_scale);
+        float in_scale = _input_scale;
+
+        std::vector<float> logits;
+        for (size_t l = 0; l < _layers.size(); l++) {
+            const layer_type& layer = _layers[l];
+            const float acc_scale   = in_scale * layer.w_scale;
+            const bool last         = l + 1 == _layers.size();
+            next.resize(layer.outputs);
+            if (last)
+                logits.resize(layer.outputs);
+            for (size_t o = 0; o < layer.outputs; o++) {
+                // contiguous int8 rows widened to int32, the compiler vectorizes this loop
+                const int8_t* w = &layer.weights[o * layer.inputs];
+                int32_t acc     = layer.bias[o];
+                for (size_t i = 0; i < layer.inputs; i++)
+                    acc += int32_t(w[i]) * int32_t(act[i]);
+                float real = acc * acc_scale;
+                if (layer.relu)
+                    real = std::max(real, 0.0f);
+                if (last)
+                    logits[o] = real;
+                else
+                    next[o] = quantize(real / layer.out_scale);
+            }
+            act.swap(next);
+            in_scale = layer.out_scale;
+        }
+
+        const size_t best = std::max_element(logits.begin(), logits.end()) - logits.begin();
+        float sum         = 0;
+        for (size_t o = 0; o < logits.size(); o++)
+            sum += std::exp(logits[o] - logits[best]);
+        classification result;
+        result.label      = _labels[best];
+        result.confidence = 1 / sum;
+        return result;
+    }
+
+private:
+    struct layer_type
+    {
+        size_t outputs;
+        size_t inputs;
+        bool relu;
+        float w_scale;
+        float out_scale;
+        std::vector<int8_t> weights;
+        std::vector<int32_t> bias;
+    };
+
+    static int8_t quantize(float x)
+    {
+        return int8_t(std::max(-127.0f, std::min(127.0f, std::round(x))));
+    }
+
+    static void expect(std::istream& in, const std::string& key)
+    {
+        std::string word;
+        if (not(in >> word) or word != key)
+            throw std::runtime_error("classifier model: expected " + key);
+    }
+
+    template <typename T> static void read(std::istream& in, T& value)
+    {
+        if (not(in >> value))
+            throw std::runtime_error("classifier model is truncated or malformed");
+    }
+
+    std::vector<std::string> _labels;
+    std::vector<float> _mean;
+    std::vector<float> _scale;
+    float _input_scale;
+    std::vector<layer_type> _layers;
+};
+
+/*!
+ * Features plus model, classifies IQ captures of a detected channel.
+ */
+class signal_classifier
+{
+public:
+    signal_classifier(const std::string& model_path)
+        : _model(model_path), _features(NUM_FEATURES)
+    {
+        /* NOP */
+    }
+
+    /*!
+     * Classify an IQ capture.
+     * \param samps the IQ samples
+     * \param nsamps the number of samples
+     * \param samp_rate the sample rate in Sps
+     * \return the most likely label and its confidence
+     */
+    classification classify(const std::complex<float>* samps, size_t nsamps, double samp_rate)
+    {
+        compute_features(samps, nsamps, samp_rate, &_features.front());
+        return _model.classify(&_features.front());
+    }
+
+    //! The features of the last capture
+    const std::vector<float>& get_features(void) const
+    {
+        return _features;
+    }
+
+private:
+    int8_mlp _model;
+    std::vector<float> _features;
+};
+
+} // namespace esc_classifier
+
+#endif /*ESC_CLASSIFIER_HPP*/
@@ -86,32 +86,48 @@ template <typename T> T to_clean_num(const T num)
     return ((num < 0) ? -1 : 1) * clean * pow10;
 }
 
-//! Compute an FFT with pre-computed factors using Cooley-Tukey
-template <typename T>
-std::complex<T> ct_fft_f(const std::complex<T>* samps,
-    size_t nsamps,
-    const std::complex<T>* factors,
-    size_t start = 0,
-    size_t step  = 1)
+//! Blackman-Harris window coefficient n of an nsamps long window
+inline double blackman_harris(size_t n, size_t nsamps)
+{
+    return 0.35875 - 0.48829 * std::cos(2 * pi * n / (nsamps - 1))
+           + 0.14128 * std::cos(4 * pi * n / (nsamps - 1))
+           - 0.01168 * std::cos(6 * pi * n / (nsamps - 1));
+}
+
+//! Complex product without the inf/nan recovery of operator*, which is not inlined
+template <typename T> std::complex<T> cmul(const std::complex<T>& a, const std::complex<T>& b)
 {
-    if (nsamps == 1)
-        return samps[start];
-    std::complex<T> E_k = ct_fft_f(samps, nsamps / 2, factors + 1, start, step * 2);
-    std::complex<T> O_k =
-        ct_fft_f(samps, nsamps / 2, factors + 1, start + step, step * 2);
-    return E_k + factors[0] * O_k;
+    return std::complex<T>(
+        a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real());
 }
 
-//! Compute an FFT for a particular bin k using Cooley-Tukey
+/*!
+ * In-place iterative radix-2 FFT.
+ * \param x the samples, nsamps a power of 2
+ * \param twiddles exp(-2 pi j k / nsamps) for k < nsamps / 2
+ */
 template <typename T>
-std::complex<T> ct_fft_k(const std::complex<T>* samps, size_t nsamps, size_t k)
+void radix2_fft(std::complex<T>* x, size_t nsamps, const std::complex<T>* twiddles)
 {
-    // pre-compute the factors to use in Cooley-Tukey
-    std::vector<std::complex<T>> factors;
-    for (size_t N = nsamps; N != 0; N /= 2) {
-        factors.push_back(std::exp(std::complex<T>(0, T(-2 * pi * k / N))));
+    for (size_t i = 1, j = 0; i < nsamps; i++) {
+        size_t bit = nsamps >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+            std::swap(x[i], x[j]);
+    }
+    for (size_t half = 1; half < nsamps; half *= 2) {
+        const size_t stride = nsamps / (2 * half);
+        for (size_t k = 0; k < half; k++) {
+            const std::complex<T> w = twiddles[k * stride];
+            for (size_t i = k; i < nsamps; i += 2 * half) {
+                const std::complex<T> odd = cmul(w, x[i + half]);
+                x[i + half]               = x[i] - odd;
+                x[i] += odd;
+            }
+        }
     }
-    return ct_fft_f(samps, nsamps, &factors.front());
 }
 
 //! Helper class to build a DFT plot frame
@@ -197,10 +213,7 @@ log_pwr_dft_type log_pwr_dft(const std::complex<T>* samps, size_t nsamps)
         // double w_n = 0.54 //hamming window
         //    -0.46*std::cos(2*pi*n/(nsamps-1))
         //;
-        double w_n = 0.35875 // blackman-harris window
-                     - 0.48829 * std::cos(2 * pi * n / (nsamps - 1))
-                     + 0.14128 * std::cos(4 * pi * n / (nsamps - 1))
-                     - 0.01168 * std::cos(6 * pi * n / (nsamps - 1));
+        double w_n = blackman_harris(n, nsamps);
         // double w_n = 1 // flat top window
         //    -1.930*std::cos(2*pi*n/(nsamps-1))
         //    +1.290*std::cos(4*pi*n/(nsamps-1))
@@ -212,9 +225,13 @@ log_pwr_dft_type log_pwr_dft(const std::complex<T>* samps, size_t nsamps)
     }
 
     // compute the log-power dft
+    std::vector<std::complex<T>> twiddles(std::max<size_t>(1, nsamps / 2));
+    for (size_t k = 0; k < nsamps / 2; k++)
+        twiddles[k] = std::polar(T(1), T(-2 * pi * k / nsamps));
+    radix2_fft(&win_samps.front(), nsamps, &twiddles.front());
     log_pwr_dft_type log_pwr_dft;
     for (size_t k = 0; k < nsamps; k++) {
-        std::complex<T> dft_k = ct_fft_k(&win_samps.front(), nsamps, k);
+        const std::complex<T>& dft_k = win_samps[k];
         log_pwr_dft.push_back(
             float(+20 * std::log10(std::abs(dft_k)) - 20 * std::log10(T(nsamps))
                   - 10 * std::log10(win_pwr / nsamps) + 3));
@@ -223,6 +240,206 @@ log_pwr_dft_type log_pwr_dft(const std::complex<T>* samps, size_t nsamps)
     return log_pwr_dft;
 }
 
+/*!
+ * Power spectrum of fixed-length buffers in linear units, for the detection
+ * path. Windowed like log_pwr_dft() and scaled so that 10 log10 of a bin is
+ * the log_pwr_dft() bin, but without a logarithm per bin: the channel powers
+ * are averaged in linear power and only the per-channel results go to dB.
+ * The bins come out centered, DC in bin nsamps / 2, the reordering is done
+ * while taking the magnitudes.
+ *
+ * Window, twiddles and the work buffer are allocated up front. Not thread
+ * safe, every pipeline keeps its own.
+ */
+template <typename T> class pwr_dft
+{
+public:
+    //! \param nsamps the number of samples of every buffer, a power of 2
+    pwr_dft(size_t nsamps) : _nsamps(nsamps)
+    {
+        if (nsamps < 2 or (nsamps & (nsamps - 1)))
+            throw std::runtime_error("num samps is not a power of 2");
+        _twiddles.resize(nsamps / 2);
+        for (size_t k = 0; k < nsamps / 2; k++)
+            _twiddles[k] = std::polar(T(1), T(-2 * pi * k / nsamps));
+        _window.resize(nsamps);
+        double win_pwr = 0;
+        for (size_t n = 0; n < nsamps; n++) {
+            const double w_n = blackman_harris(n, nsamps);
+            _window[n]       = T(w_n);
+            win_pwr += w_n * w_n;
+        }
+        // the +3 dB of log_pwr_dft()
+        _scale = T(std::pow(10.0, 0.3) / (double(nsamps) * win_pwr));
+        _work.resize(nsamps);
+    }
+
+    size_t size(void) const
+    {
+        return _nsamps;
+    }
+
+    /*!
+     * Compute the power spectrum of a buffer.
+     * \param samps nsamps complex samples
+     * \param out nsamps bins of linear power, centered
+     */
+    void compute(const std::complex<T>* samps, float* out)
+    {
+        for (size_t n = 0; n < _nsamps; n++)
+            _work[n] = _window[n] * samps[n];
+        radix2_fft(&_work.front(), _nsamps, &_twiddles.front());
+        const size_t half = _nsamps / 2;
+        for (size_t k = 0; k < half; k++)
+            out[k + half] = float(std::norm(_work[k]) * _scale);
+        for (size_t k = half; k < _nsamps; k++)
+            out[k - half] = float(std::norm(_work[k]) * _scale);
+    }
+
+private:
+    size_t _nsamps;
+    T _scale;
+    std::vector<T> _window;
+    std::vector<std::complex<T>> _twiddles;
+    std::vector<std::complex<T>> _work;
+};
+
+/*!
+ * Zoom spectrum of a buffer: its DFT evaluated on an arbitrary grid of
+ * frequencies, here a sub-band of the buffer, using the chirp-Z transform
+ * (Bluestein's algorithm). The transform is a circular convolution with a
+ * chirp, done with two power of 2 FFTs of at least nsamps + num_bins - 1
+ * points, so a 2048 bin view of one channel costs about as much as a 4096
+ * point FFT and does not depend on the width of the band.
+ *
+ * The bins use the window and the dB scale of log_pwr_dft(), so they line up
+ * with the wideband spectrum. The frequency resolution is still set by the
+ * buffer, about 2 * rate / nsamps for the Blackman-Harris window, a grid
+ * finer than that interpolates between the resolvable frequencies.
+ *
+ * The band may change between calls, the chirps are only rebuilt when it
+ * does. Not thread safe, every pipeline keeps its own.
+ */
+template <typename T> class zoom_dft
+{
+public:
+    /*!
+     * \param nsamps the number of samples of every buffer, any length
+     * \param num_bins the number of bins of the zoom spectrum
+     */
+    zoom_dft(size_t nsamps, size_t num_bins)
+        : _nsamps(nsamps), _num_bins(num_bins), _fft_len(1), _rate(0), _start_freq(0), _stop_freq(0)
+    {
+        if (nsamps < 2 or num_bins == 0)
+            throw std::runtime_error("zoom dft needs at least 2 samples and one bin");
+        while (_fft_len < nsamps + num_bins - 1)
+            _fft_len *= 2;
+        _twiddles.resize(_fft_len / 2);
+        for (size_t k = 0; k < _fft_len / 2; k++)
+            _twiddles[k] = std::polar(T(1), T(-2 * pi * k / _fft_len));
+        _window.resize(nsamps);
+        double win_pwr = 0;
+        for (size_t n = 0; n < nsamps; n++) {
+            _window[n] = blackman_harris(n, nsamps);
+            win_pwr += _window[n] * _window[n];
+        }
+        _offset = float(-20 * std::log10(double(nsamps)) - 10 * std::log10(win_pwr / nsamps) + 3);
+        _chirp.resize(nsamps);
+        _filter.resize(_fft_len);
+        _work.resize(_fft_len);
+    }
+
+    /*!
+     * Choose the band, bin k is at start_freq + k * (stop_freq - start_freq) / num_bins.
+     * \param rate the sample rate of the buffers in Sps
+     * \param start_freq the lowest frequency relative to the buffer center in Hz
+     * \param stop_freq the highest frequency relative to the buffer center in Hz
+     */
+    void set_band(double rate, double start_freq, double stop_freq)
+    {
+        if (rate == _rate and start_freq == _start_freq and stop_freq == _stop_freq)
+            return;
+        if (rate <= 0 or stop_freq <= start_freq)
+            throw std::runtime_error("invalid zoom dft band");
+        _rate       = rate;
+        _start_freq = start_freq;
+        _stop_freq  = stop_freq;
+
+        // X(f0 + k df) = sum x(n) exp(-j 2 pi (f0 n + df n^2 / 2)) exp(j pi df (k - n)^2)
+        // up to a unit phase per bin, phases are taken in cycles modulo 1 to keep precision
+        const double f0 = start_freq / rate;
+        const double df = (stop_freq - start_freq) / rate / _num_bins;
+        for (size_t n = 0; n < _nsamps; n++) {
+            const double cycles = f0 * n + 0.5 * df * double(n) * double(n);
+            _chirp[n] = std::polar(T(_window[n]), T(-2 * pi * (cycles - std::floor(cycles))));
+        }
+        std::fill(_filter.begin(), _filter.end(), std::complex<T>(0));
+        for (size_t m = 0; m < std::max(_nsamps, _num_bins); m++) {
+            const double cycles     = 0.5 * df * double(m) * double(m);
+            const std::complex<T> h = std::polar(T(1) / T(_fft_len), T(2 * pi * (cycles - std::floor(cycles))));
+            if (m < _num_bins)
+                _filter[m] = h;
+            if (m > 0 and m < _nsamps)
+                _filter[_fft_len - m] = h;
+        }
+        radix2_fft(&_filter.front(), _fft_len, &_twiddles.front());
+    }
+
+    /*!
+     * Compute the zoom spectrum of a buffer, set_band() must have been called.
+     * \param samps nsamps complex samples
+     * \param out replaced with the bins in units of dB
+     */
+    void compute(const std::complex<T>* samps, log_pwr_dft_type& out)
+    {
+        if (_rate == 0)
+            throw std::runtime_error("zoom dft band is not set");
+        for (size_t n = 0; n < _nsamps; n++)
+            _work[n] = cmul(samps[n], _chirp[n]);
+        std::fill(_work.begin() + _nsamps, _work.end(), std::complex<T>(0));
+        radix2_fft(&_work.front(), _fft_len, &_twiddles.front());
+        // the inverse FFT is a forward FFT of the conjugate, conjugating the
+        // result does not change the magnitude
+        for (size_t i = 0; i < _fft_len; i++)
+            _work[i] = std::conj(cmul(_work[i], _filter[i]));
+        radix2_fft(&_work.front(), _fft_len, &_twiddles.front());
+        out.resize(_num_bins);
+        for (size_t k = 0; k < _num_bins; k++)
+            out[k] = float(10 * std::log10(std::norm(_work[k]) + T(1e-20))) + _offset;
+    }
+
+    size_t get_num_bins(void) const
+    {
+        return _num_bins;
+    }
+
+    //! The frequency of bin 0 relative to the buffer center in Hz
+    double get_start_freq(void) const
+    {
+        return _start_freq;
+    }
+
+    //! The spacing of the bins in Hz
+    double get_bin_width(void) const
+    {
+        return (_stop_freq - _start_freq) / _num_bins;
+    }
+
+private:
+    size_t _nsamps;
+    size_t _num_bins;
+    size_t _fft_len;
+    double _rate;
+    double _start_freq;
+    double _stop_freq;
+    float _offset;
+    std::vector<double> _window;
+    std::vector<std::complex<T>> _twiddles;
+    std::vector<std::complex<T>> _chirp;
+    std::vector<std::complex<T>> _filter;
+    std::vector<std::complex<T>> _work;
+};
+
 std::string dft_to_plot(const log_pwr_dft_type& dft_,
     size_t width,
     size_t height,
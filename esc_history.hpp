@@ -0,0 +1,216 @@
+//
+// ESC sensor node - quantized spectrogram history
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_HISTORY_HPP
+#define ESC_HISTORY_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace esc_history {
+
+//! A time and frequency range cut out of the history
+struct history_slice
+{
+    double first_freq;              //!< frequency of the first bin in Hz
+    double bin_width;               //!< bin spacing in Hz
+    size_t num_bins;                //!< bins per frame
+    std::vector<int64_t> time_us;   //!< frame timestamps, microseconds since the epoch
+    std::vector<float> offset;      //!< per-frame dB value of code 0
+    std::vector<float> scale;       //!< per-frame dB per code step
+    std::vector<uint8_t> codes;     //!< num_bins codes per frame, frames in time order
+
+    size_t get_num_frames(void) const
+    {
+        return time_us.size();
+    }
+
+    //! The dB value of bin n of frame i
+    float get_db(size_t i, size_t n) const
+    {
+        return offset[i] + scale[i] * codes[i * num_bins + n];
+    }
+};
+
+/*!
+ * Fixed-size ring of past spectrum frames stored as 8-bit codes.
+ *
+ * Every frame keeps its own offset and scale, so the codes span exactly the
+ * dynamic range of that frame (a quantization step of at most 1/255 of it).
+ * Frames added between two commits are combined with a per-bin max-hold,
+ * so short bursts survive storing at a lower rate than the frame rate.
+ * All memory is allocated up front, timestamps are increasing around the
+ * ring, so time ranges are found by binary search.
+ */
+class spectrogram_history
+{
+public:
+    /*!
+     * \param num_bins the bins per spectrum frame
+     * \param first_freq the frequency of bin 0 in Hz
+     * \param bin_width the bin spacing in Hz
+     * \param num_bytes the memory budget for the ring
+     */
+    spectrogram_history(size_t num_bins, double first_freq, double bin_width, size_t num_bytes)
+        : _num_bins(num_bins)
+        , _first_freq(first_freq)
+        , _bin_width(bin_width)
+        , _capacity(num_bytes / (num_bins + sizeof(int64_t) + 2 * sizeof(float)))
+        , _head(0)
+        , _count(0)
+        , _held(num_bins)
+        , _num_held(0)
+    {
+        if (_capacity == 0)
+            throw std::runtime_error("history budget is too small for a single frame");
+        _codes.resize(_capacity * num_bins);
+        _time_us.resize(_capacity);
+        _offset.resize(_capacity);
+        _scale.resize(_capacity);
+    }
+
+    //! The number of frames the ring holds when full
+    size_t get_capacity(void) const
+    {
+        return _capacity;
+    }
+
+    //! The number of frames stored
+    size_t size(void)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _count;
+    }
+
+    /*!
+     * Max-hold a spectrum frame into the next history frame.
+     * \param lin the spectrum in linear power, num_bins values
+     */
+    void add(const float* lin)
+    {
+        if (_num_held++ == 0) {
+            std::copy(lin, lin + _num_bins, _held.begin());
+            return;
+        }
+        for (size_t n = 0; n < _num_bins; n++)
+            _held[n] = std::max(_held[n], lin[n]);
+    }
+
+    /*!
+     * Quantize the held frame into the ring, overwriting the oldest frame
+     * when the ring is full. Does nothing when no frame was added.
+     * \param time_us the frame timestamp in microseconds since the epoch
+     */
+    void commit(int64_t time_us)
+    {
+        if (_num_held == 0)
+            return;
+        _num_held = 0;
+
+        // the max-hold commutes with the dB scale, so only stored frames are converted
+        for (size_t n = 0; n < _num_bins; n++)
+            _held[n] = 10 * std::log10(_held[n]);
+        float lo = _held[0], hi = _held[0];
+        for (size_t n = 1; n < _num_bins; n++) {
+            lo = std::min(lo, _held[n]);
+            hi = std::max(hi, _held[n]);
+        }
+        // -inf bins (exactly zero power) sit at code 0
+        lo = std::max(lo, hi - 255.0f);
+        const float scale     = (hi > lo) ? (hi - lo) / 255 : 1.0f;
+        const float inv_scale = 1 / scale;
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        uint8_t* codes = &_codes[_head * _num_bins];
+        for (size_t n = 0; n < _num_bins; n++) {
+            const float q = (std::max(_held[n], lo) - lo) * inv_scale + 0.5f;
+            codes[n]      = uint8_t(std::min(q, 255.0f));
+        }
+        _time_us[_head] = time_us;
+        _offset[_head]  = lo;
+        _scale[_head]   = scale;
+        _head           = (_head + 1) % _capacity;
+        _count          = std::min(_count + 1, _capacity);
+    }
+
+    /*!
+     * Cut a time and frequency range out of the history.
+     * \param start_us the earliest timestamp to include
+     * \param stop_us the latest timestamp to include
+     * \param start_freq the lowest frequency to include in Hz
+     * \param stop_freq the highest frequency to include in Hz
+     * \return the frames and bins inside both ranges
+     */
+    history_slice query(int64_t start_us, int64_t stop_us, double start_freq, double stop_freq)
+    {
+        history_slice slice;
+        const long first_bin = std::max(0L, long(std::ceil((start_freq - _first_freq) / _bin_width)));
+        const long last_bin  = std::min(long(_num_bins) - 1,
+            long(std::floor((stop_freq - _first_freq) / _bin_width)));
+        slice.first_freq = _first_freq + first_bin * _bin_width;
+        slice.bin_width  = _bin_width;
+        slice.num_bins   = (last_bin >= first_bin) ? size_t(last_bin - first_bin + 1) : 0;
+        if (slice.num_bins == 0)
+            return slice;
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        const size_t begin = lower_bound(start_us);
+        const size_t end   = lower_bound(stop_us + 1);
+        for (size_t i = begin; i < end; i++) {
+            const size_t slot = physical(i);
+            slice.time_us.push_back(_time_us[slot]);
+            slice.offset.push_back(_offset[slot]);
+            slice.scale.push_back(_scale[slot]);
+            const uint8_t* codes = &_codes[slot * _num_bins + first_bin];
+            slice.codes.insert(slice.codes.end(), codes, codes + slice.num_bins);
+        }
+        return slice;
+    }
+
+private:
+    //! Ring slot of the i-th oldest frame
+    size_t physical(size_t i) const
+    {
+        return (_head + _capacity - _count + i) % _capacity;
+    }
+
+    //! Index (oldest first) of the first frame at or after time_us
+    size_t lower_bound(int64_t time_us) const
+    {
+        size_t lo = 0, hi = _count;
+        while (lo < hi) {
+            const size_t mid = (lo + hi) / 2;
+            if (_time_us[physical(mid)] < time_us)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    size_t _num_bins;
+    double _first_freq;
+    double _bin_width;
+    size_t _capacity;
+    size_t _head;
+    size_t _count;
+    std::vector<uint8_t> _codes;
+    std::vector<int64_t> _time_us;
+    std::vector<float> _offset;
+    std::vector<float> _scale;
+    std::vector<float> _held;
+    size_t _num_held;
+    std::mutex _mutex;
+};
+
+} // namespace esc_history
+
+#endif /*ESC_HISTORY_HPP*/
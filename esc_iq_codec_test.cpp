@@ -0,0 +1,117 @@
+//
+// ESC sensor node - IQ codec test
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#include "esc_iq_codec.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <random>
+
+typedef std::vector<std::complex<float>> samples_type;
+
+static bool passed = true;
+
+static void check(bool cond, const std::string& what)
+{
+    if (not cond) {
+        std::cerr << "FAILED: " << what << std::endl;
+        passed = false;
+    }
+}
+
+//! A tone with complex noise 30 dB below it, a strong signal as captured
+static samples_type make_capture(size_t nsamps)
+{
+    std::mt19937 gen(1);
+    std::normal_distribution<float> noise(0.0f, 0.5f * std::sqrt(0.5f) * 0.0316f);
+    samples_type samps(nsamps);
+    for (size_t i = 0; i < nsamps; i++) {
+        const float phase = float(2 * std::acos(-1.0) * 0.0123 * i);
+        samps[i] = std::complex<float>(0.5f * std::cos(phase) + noise(gen),
+            0.5f * std::sin(phase) + noise(gen));
+    }
+    return samps;
+}
+
+//! Signal to quantization noise ratio of the decoded samples in dB
+static double snr_db(const samples_type& ref, const samples_type& dec)
+{
+    double sig = 0, err = 0;
+    for (size_t i = 0; i < ref.size(); i++) {
+        sig += std::norm(ref[i]);
+        err += std::norm(ref[i] - dec[i]);
+    }
+    return 10 * std::log10(sig / err);
+}
+
+/*
+Encodes and decodes a noisy tone at the bit widths with dedicated packing
+loops and a few going through the bit accumulator, checks the stream size and
+the SNR against the about 6 dB per bit the codec promises, checks that blocks
+with a non-finite peak decode as silence without affecting their neighbours
+and prints the encode rate
+*/
+int main(void)
+{
+    const size_t nsamps = 1 << 20;
+    const samples_type samps = make_capture(nsamps + 17); // a partial last block
+
+    // bits and the lowest acceptable SNR
+    const struct {
+        unsigned bits;
+        double min_snr;
+    } widths[] = {{4, 16}, {6, 28}, {8, 40}, {10, 52}, {12, 64}, {16, 88}};
+    for (const auto& width : widths) {
+        esc_iq_codec::bfp_codec codec(width.bits);
+        std::vector<uint8_t> stream;
+        samples_type decoded;
+
+        const auto start = std::chrono::steady_clock::now();
+        codec.encode(samps.data(), samps.size(), stream);
+        const double secs =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        codec.decode(stream.data(), stream.size(), decoded);
+
+        check(stream.size() == codec.get_encoded_size(samps.size()), "encoded size");
+        check(decoded.size() == samps.size(), "decoded sample count");
+        const double snr = snr_db(samps, decoded);
+        check(snr >= width.min_snr,
+            std::to_string(width.bits) + " bits SNR " + std::to_string(snr) + " dB");
+        std::cout << width.bits << " bits: SNR " << snr << " dB, "
+                  << double(samps.size() * sizeof(samps[0])) / stream.size()
+                  << "x smaller, encode " << samps.size() / secs / 1e6 << " Msps"
+                  << std::endl;
+    }
+
+    // non-finite samples must not reach frexp or the integer conversion
+    esc_iq_codec::bfp_codec codec(8);
+    const size_t block_len = codec.get_block_len();
+    samples_type bad(samps.begin(), samps.begin() + 4 * block_len);
+    bad[block_len + 3]     = std::complex<float>(std::numeric_limits<float>::infinity(), 0);
+    bad[2 * block_len + 5] = std::complex<float>(0, -std::numeric_limits<float>::infinity());
+    bad[3 * block_len + 7] = std::complex<float>(std::numeric_limits<float>::quiet_NaN(), 0);
+    std::vector<uint8_t> stream;
+    samples_type decoded;
+    codec.encode(bad.data(), bad.size(), stream);
+    codec.decode(stream.data(), stream.size(), decoded);
+    for (size_t i = 0; i < block_len; i++)
+        check(std::abs(decoded[i] - bad[i]) < 0.01f, "block next to non-finite ones");
+    for (size_t i = block_len; i < 4 * block_len; i++)
+        check(decoded[i] == std::complex<float>(0, 0), "non-finite block decodes as silence");
+
+    // a decoder with another width must refuse the stream
+    bool refused = false;
+    try {
+        esc_iq_codec::bfp_codec(12).decode(stream.data(), stream.size(), decoded);
+    } catch (const std::runtime_error&) {
+        refused = true;
+    }
+    check(refused, "bit width mismatch");
+
+    std::cout << (passed ? "passed" : "failed") << std::endl;
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
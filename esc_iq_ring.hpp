@@ -0,0 +1,271 @@
+//
+// ESC sensor node - lock-free pre-trigger IQ history ring
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_IQ_RING_HPP
+#define ESC_IQ_RING_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+
+namespace esc_iq_ring {
+
+typedef std::complex<float> sample_type;
+
+/*!
+ * The last samples of a continuous stream, written by one thread and read
+ * by another without locks.
+ *
+ * Samples are numbered from the start of the stream. The writer receives
+ * straight into the ring (begin_write(), then end_write() to publish) and
+ * the reader copies the newest frame out or freezes a window to use in
+ * place. The memory is mapped twice back to back, so every stretch of up
+ * to the capacity is contiguous however it wraps.
+ *
+ * A frozen window is never overwritten. Once the writer reaches it from
+ * behind, begin_write() returns no room and the writer drops what it
+ * receives (counted) until the window is released, so the ring should
+ * hold a good deal more than the windows taken from it.
+ */
+class iq_ring
+{
+public:
+    /*!
+     * \param bytes ring size, rounded up to whole pages
+     * \param max_chunk the most samples the writer asks for at once
+     * \param lock lock the ring in memory
+     */
+    iq_ring(size_t bytes, size_t max_chunk, bool lock)
+        : _max_chunk(max_chunk)
+        , _head(0)
+        , _frozen(not_frozen)
+        , _dropped(0)
+        , _overflows(0)
+        , _base(nullptr)
+    {
+        const size_t page = size_t(sysconf(_SC_PAGESIZE));
+        _bytes            = (bytes + page - 1) / page * page;
+        // whole samples per page, so the capacity is a whole number of samples
+        _capacity = _bytes / sizeof(sample_type);
+        if (_capacity < 4 * max_chunk)
+            throw std::runtime_error("IQ ring too small for the receive chunk");
+        map();
+        // fault every page in now, not in the receive path
+        std::memset(static_cast<void*>(_base), 0, _bytes);
+        if (lock and mlock(_base, _bytes) != 0)
+            std::cerr << "Cannot lock the IQ ring (" << (_bytes >> 20)
+                      << " MB), raise the memlock limit" << std::endl;
+    }
+
+    ~iq_ring(void)
+    {
+        munmap(_base, 2 * _bytes);
+    }
+
+    iq_ring(const iq_ring&) = delete;
+    iq_ring& operator=(const iq_ring&) = delete;
+
+    //! The number of samples the ring holds
+    size_t get_capacity(void) const
+    {
+        return _capacity;
+    }
+
+    /*!
+     * Writer: where to receive the next samples.
+     * \param n in the samples wanted (at most the max chunk), out the room there is
+     * \return the write position, nullptr if the frozen window leaves no room
+     */
+    sample_type* begin_write(size_t& n)
+    {
+        n                     = std::min(n, _max_chunk);
+        const uint64_t head   = _head.load(std::memory_order_relaxed);
+        const uint64_t frozen = _frozen.load(std::memory_order_seq_cst);
+        if (frozen != not_frozen) {
+            const uint64_t limit = frozen + _capacity;
+            n = limit > head ? size_t(std::min<uint64_t>(n, limit - head)) : 0;
+        }
+        return n == 0 ? nullptr : _base + head % _capacity;
+    }
+
+    //! Writer: publish n samples written at the begin_write() position
+    void end_write(size_t n)
+    {
+        _head.store(_head.load(std::memory_order_relaxed) + n, std::memory_order_seq_cst);
+    }
+
+    //! Writer: count samples received but not written because of a frozen window
+    void drop(size_t n)
+    {
+        _dropped.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    //! Writer: count a receive overflow
+    void overflow(void)
+    {
+        _overflows.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    //! The number of samples written so far, the index after the newest
+    uint64_t get_head(void) const
+    {
+        return _head.load(std::memory_order_seq_cst);
+    }
+
+    /*!
+     * Reader: wait until a sample has been written.
+     * \param index the sample index
+     * \param timeout the longest wait in seconds
+     * \return false on timeout
+     */
+    bool wait_for(uint64_t index, double timeout) const
+    {
+        const auto deadline = std::chrono::steady_clock::now()
+                              + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                  std::chrono::duration<double>(timeout));
+        while (get_head() <= index) {
+            if (std::chrono::steady_clock::now() >= deadline)
+                return false;
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        return true;
+    }
+
+    /*!
+     * Reader: copy the newest samples, waiting for them if needed.
+     * \param out where to copy len samples
+     * \param len the number of samples, at most a quarter of the capacity
+     * \param first the index of the first sample wanted at the earliest, newer ones are taken if there are
+     * \param timeout the longest wait in seconds
+     * \return the index after the last sample copied, 0 on timeout
+     */
+    uint64_t read_latest(sample_type* out, size_t len, uint64_t first, double timeout) const
+    {
+        if (len > _capacity / 4)
+            throw std::runtime_error("IQ ring read longer than a quarter of the ring");
+        if (not wait_for(first + len - 1, timeout))
+            return 0;
+        while (true) {
+            const uint64_t end = get_head();
+            std::memcpy(out, _base + (end - len) % _capacity, len * sizeof(sample_type));
+            // the copy holds if the writer, with a chunk in flight, has not come round to it
+            if (get_head() + _max_chunk <= end - len + _capacity)
+                return end;
+        }
+    }
+
+    /*!
+     * Reader: samples in place, for a reader that follows the stream closely.
+     * \param first the index of the first sample, already written
+     * \return the position of the sample, the samples after it are contiguous up to the capacity
+     */
+    const sample_type* at(uint64_t first) const
+    {
+        return _base + first % _capacity;
+    }
+
+    /*!
+     * Reader: whether samples used in place are still intact, ask after using them.
+     * \param first the index of the first sample used
+     * \return false if the writer may have overwritten it
+     */
+    bool holds(uint64_t first) const
+    {
+        return get_head() + _max_chunk <= first + _capacity;
+    }
+
+    /*!
+     * Reader: freeze a window so it can be used in place, one at a time.
+     * \param first the index of the first sample, written or not yet
+     * \param len the number of samples
+     * \return the window start, nullptr if it is already overwritten or too long
+     */
+    const sample_type* freeze(uint64_t first, size_t len)
+    {
+        if (len == 0 or len > _capacity - 2 * _max_chunk)
+            return nullptr;
+        _frozen.store(first, std::memory_order_seq_cst);
+        // a chunk the writer started before it saw the freeze may still land
+        if (get_head() + _max_chunk > first + _capacity) {
+            release();
+            return nullptr;
+        }
+        return _base + first % _capacity;
+    }
+
+    //! Reader: let the writer overwrite the frozen window
+    void release(void)
+    {
+        _frozen.store(not_frozen, std::memory_order_seq_cst);
+    }
+
+    //! Samples dropped because a frozen window was in the way
+    size_t get_dropped(void) const
+    {
+        return _dropped.load(std::memory_order_relaxed);
+    }
+
+    //! Receive overflows counted by the writer
+    size_t get_overflows(void) const
+    {
+        return _overflows.load(std::memory_order_relaxed);
+    }
+
+private:
+    static const uint64_t not_frozen = std::numeric_limits<uint64_t>::max();
+
+    //! Map the same memory twice back to back
+    void map(void)
+    {
+        const int fd = memfd_create("esc_iq_ring", 0);
+        if (fd < 0)
+            throw std::runtime_error(std::string("cannot create the IQ ring: ") + std::strerror(errno));
+        if (ftruncate(fd, off_t(_bytes)) != 0) {
+            close(fd);
+            throw std::runtime_error(std::string("cannot size the IQ ring: ") + std::strerror(errno));
+        }
+        void* area = mmap(nullptr, 2 * _bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (area == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error(std::string("cannot map the IQ ring: ") + std::strerror(errno));
+        }
+        char* start = static_cast<char*>(area);
+        if (mmap(start, _bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+            or mmap(start + _bytes, _bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0)
+                   == MAP_FAILED) {
+            munmap(area, 2 * _bytes);
+            close(fd);
+            throw std::runtime_error(std::string("cannot mirror the IQ ring: ") + std::strerror(errno));
+        }
+        close(fd);
+        _base = reinterpret_cast<sample_type*>(start);
+    }
+
+    size_t _max_chunk;
+    size_t _bytes;
+    size_t _capacity;
+    std::atomic<uint64_t> _head;
+    std::atomic<uint64_t> _frozen;
+    std::atomic<size_t> _dropped;
+    std::atomic<size_t> _overflows;
+    sample_type* _base;
+};
+
+} // namespace esc_iq_ring
+
+#endif /*ESC_IQ_RING_HPP*/
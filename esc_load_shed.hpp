@@ -0,0 +1,213 @@
+//
+// ESC sensor node - load shedding when a pipeline falls behind
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_LOAD_SHED_HPP
+#define ESC_LOAD_SHED_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+
+namespace esc_load_shed {
+
+//! The degradation ladder, every level keeps the cuts of the levels below it
+enum shed_level {
+    LEVEL_FULL = 0,      //!< full quality
+    LEVEL_SHORT_OBSERVE, //!< a detection is observed with one capture instead of for a second
+    LEVEL_DEFER_UPLOADS, //!< no zoom, IQ and history uploads go to the spool instead of the server
+    LEVEL_SLOW_CAPTURES, //!< IQ captures at most once a second
+    LEVEL_HALF_FRAMES,   //!< every second spectrum frame is skipped
+    LEVEL_QUARTER_FRAMES //!< three spectrum frames out of four are skipped
+};
+
+static const size_t num_levels = LEVEL_QUARTER_FRAMES + 1;
+
+//! A short name of a level, for the transition log
+inline const char* get_level_name(size_t level)
+{
+    static const char* names[] = {
+        "full quality", "short observation", "deferred uploads", "slow captures", "half frame rate", "quarter frame rate"};
+    return level < num_levels ? names[level] : "invalid";
+}
+
+//! Spectrum frames per frame period processed at a level, 1 in this many
+inline size_t get_frame_divisor(size_t level)
+{
+    return level >= LEVEL_QUARTER_FRAMES ? 4 : level >= LEVEL_HALF_FRAMES ? 2 : 1;
+}
+
+//! Seconds between IQ captures at a level
+inline double get_iq_holdoff(size_t level, double holdoff)
+{
+    return level >= LEVEL_SLOW_CAPTURES ? std::max(holdoff, 1.0) : holdoff;
+}
+
+//! Health of one pipeline over one evaluation interval, loads are fractions of the capacity
+struct health_sample
+{
+    size_t overflows; //!< receive overflows
+    size_t dropped;   //!< requests dropped by the full upload queue
+    double queue;     //!< upload queue depth over its maximum depth
+    double busy;      //!< time spent on frames and observations over the interval
+    double cpu;       //!< CPU time of the pipeline thread over the interval
+    double missed;    //!< frames missed because the pipeline ran late, over the frames due
+
+    health_sample(void) : overflows(0), dropped(0), queue(0), busy(0), cpu(0), missed(0)
+    {
+        /* NOP */
+    }
+};
+
+//! When to step down and back up the ladder
+struct shed_config
+{
+    double high;      //!< load that steps down one level
+    double low;       //!< load below which the pipeline counts as calm
+    size_t hold;      //!< calm intervals in a row before stepping back up one level
+    size_t max_level; //!< lowest rung the controller may reach
+
+    shed_config(void) : high(0.8), low(0.5), hold(5), max_level(num_levels - 1)
+    {
+        /* NOP */
+    }
+};
+
+/*!
+ * Steps one pipeline down and back up the degradation ladder.
+ *
+ * Every evaluation interval the pipeline hands in its health. The load is
+ * the worst of the upload queue fill, the busy time, the CPU time and the
+ * missed frames; a receive overflow or a dropped request counts as full
+ * load. A load at or above the high mark steps down one level at once, so
+ * a sustained overload reaches the level that copes within a few
+ * intervals. Stepping back up waits for hold calm intervals in a row
+ * (load below the low mark), the gap between the marks keeps the level
+ * from flapping. When the load comes back within a hold of stepping up,
+ * the next step up waits twice as long (up to 16 holds), so a load that
+ * only fits the lower level settles there instead of probing it forever.
+ */
+class load_controller
+{
+public:
+    load_controller(const shed_config& config)
+        : _config(config)
+        , _level(LEVEL_FULL)
+        , _calm(0)
+        , _hold(config.hold)
+        , _probation(false)
+        , _since_up(0)
+        , _load(0)
+        , _signal("none")
+        , _transitions(0)
+    {
+        if (config.low <= 0 or config.low >= config.high)
+            throw std::runtime_error("load shedding needs 0 < low mark < high mark");
+        if (config.max_level >= num_levels)
+            throw std::runtime_error("load shedding level out of range");
+    }
+
+    /*!
+     * Take the health of one interval and move along the ladder.
+     * \param health the health over the interval
+     * \return true if the level changed
+     */
+    bool update(const health_sample& health)
+    {
+        weigh(health);
+        if (_probation and ++_since_up > _hold) {
+            // the last step up held
+            _probation = false;
+            _hold      = _config.hold;
+        }
+        if (_load >= _config.high) {
+            _calm = 0;
+            if (_level >= _config.max_level)
+                return false;
+            if (_probation) {
+                _hold      = std::min(_hold * 2, _config.hold * max_backoff);
+                _probation = false;
+            }
+            _level++;
+            _transitions++;
+            return true;
+        }
+        if (_load >= _config.low) {
+            _calm = 0;
+            return false;
+        }
+        if (_level == LEVEL_FULL or ++_calm < _hold)
+            return false;
+        _calm      = 0;
+        _probation = true;
+        _since_up  = 0;
+        _level--;
+        _transitions++;
+        return true;
+    }
+
+    //! The current level, one of shed_level
+    size_t get_level(void) const
+    {
+        return _level;
+    }
+
+    //! The load of the last interval
+    double get_load(void) const
+    {
+        return _load;
+    }
+
+    //! The health signal that set the load of the last interval
+    const char* get_signal(void) const
+    {
+        return _signal;
+    }
+
+    //! The number of level changes so far
+    size_t get_transitions(void) const
+    {
+        return _transitions;
+    }
+
+private:
+    static const size_t max_backoff = 16;
+
+    void weigh(const health_sample& health)
+    {
+        _load   = 0;
+        _signal = "none";
+        consider(health.queue, "upload queue");
+        consider(health.busy, "busy time");
+        consider(health.cpu, "CPU time");
+        consider(health.missed, "missed frames");
+        if (health.dropped != 0)
+            consider(1, "dropped uploads");
+        if (health.overflows != 0)
+            consider(1, "receive overflows");
+    }
+
+    void consider(double load, const char* signal)
+    {
+        if (load > _load) {
+            _load   = load;
+            _signal = signal;
+        }
+    }
+
+    shed_config _config;
+    size_t _level;
+    size_t _calm;
+    size_t _hold;      // calm intervals before the next step up
+    bool _probation;   // stepped up less than a hold ago
+    size_t _since_up;
+    double _load;
+    const char* _signal;
+    size_t _transitions;
+};
+
+} // namespace esc_load_shed
+
+#endif /*ESC_LOAD_SHED_HPP*/
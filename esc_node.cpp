@@ -9,10 +9,31 @@
 // ESC sensor node
 
 #include "esc_dft.hpp" //implementation
+#include "esc_channel_plan.hpp"
+#include "esc_cfar.hpp"
+#include "esc_sweep.hpp"
+#include "esc_scheduler.hpp"
+#include "esc_history.hpp"
+#include "esc_classifier.hpp"
+#include "esc_iq_codec.hpp"
+#include "esc_spool.hpp"
+#include "esc_buffer_pool.hpp"
+#include "esc_thread.hpp"
+#include "esc_upload.hpp"
+#include "esc_sim.hpp"
+#include "esc_aggregator.hpp"
+#include "esc_load_shed.hpp"
+#include "esc_iq_ring.hpp"
+#include "esc_shm.hpp"
+#include "esc_pulse.hpp"
+#include "esc_tune.hpp"
+#include "esc_bin_stats.hpp"
+#include "esc_occupancy.hpp"
 #include <uhd/usrp/multi_usrp.hpp>
 #include <uhd/utils/safe_main.hpp>
 #include <uhd/utils/thread.hpp>
 #include <curses.h>
+#include <boost/algorithm/string.hpp>
 #include <boost/format.hpp>
 #include <boost/program_options.hpp>
 #include <chrono>
@@ -20,15 +41,25 @@
 #include <cstdlib>
 #include <iostream>
 #include <thread>
+#include <iomanip>
 #include <sstream>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
+#include <cstdio>
 #include <cstring>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
 #include <mutex>
+#include <pthread.h>
+#include <malloc.h>
+#include <csignal>
+#include <sys/resource.h>
 // For different N310 as ESC node, use different node numbers
 #define SENSOR_NODE 1
 #define FFT_AVERAGES 2
@@ -39,6 +70,8 @@ std::string client_key_path = "../certs/client_10.147.20.75-0.key";
 std::string ca_crt_path = "../certs/ca.crt";
 // Path to Open-SAS URL
 std::string opensas_url = "https://10.147.20.75:1443/sas-api/";
+// Seconds to wait for the server to accept a connection
+double connect_timeout = 2;
 
 #define FFT_ON_FPGA 0
 
@@ -54,9 +87,6 @@ std::string opensas_url = "https://10.147.20.75:1443/sas-api/";
 // based on the input shape the model will be trained to detect
 #define DETECTION_SAMPLE_SIZE 102400
 
-// the threshold for the detection
-#define DETECTION_THRESHOLD   -70
-
 #if SENSOR_NODE == 1
 #define SENSOR_ID "xG-OpenSense-Node1"
 #define SENSOR_LAT 38.88089743634038
@@ -84,46 +114,178 @@ using std::chrono::high_resolution_clock;
 
 // struct to hold the channel power data and location
 struct channel_data {
-    float channel_pwr[15];
+    std::vector<float> channel_pwr; // dB, from channel_lin
+    std::vector<float> channel_lin; // running average in linear power
+    std::vector<bool> detected;
+    std::vector<std::string> signal;
+    std::vector<float> confidence;
+    int64_t detect_time_us; // when the last detection was acted on
+    size_t rx_channel;
     double lat;
     double lon;
 };
 
-struct channel_data data;
+// everything one receive -> DSP -> detect pipeline owns, one per RX channel
+struct rx_pipeline {
+    uhd::usrp::multi_usrp::sptr usrp;
+    std::shared_ptr<esc_sim::sim_source> sim; // only set with --sim, stands in for usrp and rx_stream
+    size_t chan;
+    double freq;
+    double rate;
+    uhd::rx_streamer::sptr rx_stream;
+    std::shared_ptr<esc_channel_plan::channel_plan> plan;
+    std::shared_ptr<esc_cfar::cfar_detector> cfar;
+    std::shared_ptr<esc_sweep::sweep_scheduler> sweep; // only set in sweep mode
+    std::shared_ptr<esc_history::spectrogram_history> history;
+    std::shared_ptr<esc_classifier::signal_classifier> classifier; // only set with --classifier
+    std::shared_ptr<esc_iq_codec::bfp_codec> codec;                // only set with --iq-bits
+    std::shared_ptr<esc_dft::zoom_dft<float>> zoom;                // only set with --zoom-bins
+    std::shared_ptr<esc_shm::spectrum_publisher> shm;              // only set with --shm
+    std::shared_ptr<esc_pulse::train_tracker> pulses;              // only set with --pulse
+    std::shared_ptr<esc_tune::tuner> tuner;                        // every retune and rate change goes through it
+    std::shared_ptr<esc_bin_stats::bin_accumulator> bin_stats;     // only set with --bin-stats
+    std::shared_ptr<esc_occupancy::occupancy_tracker> occupancy;   // only set with --occupancy
+    channel_data data;
+};
+
+// settings shared by all pipelines
+struct pipeline_config {
+    size_t len;
+    double frame_rate;
+    double report_rate;
+    double iq_holdoff;
+    double history_rate;
+    double backfill;
+    float classify_confidence;
+    bool lock_memory;
+    bool observe;
+    bool load_shed;
+    esc_load_shed::shed_config shed;
+    double iq_ring_mb;   // 0 captures IQ by retuning after a detection instead
+    double pre_trigger;  // seconds of the IQ ring window before the triggering frame
+    double post_trigger; // seconds of the IQ ring window from the triggering frame on
+    esc_pulse::pulse_config pulse; // used when rx_pipeline::pulses is set
+    std::vector<size_t> ring_cpus; // one per pipeline, empty leaves the IQ ring writers unpinned
+    std::vector<size_t> pulse_cpus; // one per pipeline, empty leaves the pulse detectors unpinned
+    double bin_stats_window; // seconds per snapshot when rx_pipeline::bin_stats is set
+    esc_occupancy::occupancy_config occupancy; // used when rx_pipeline::occupancy is set
+    esc_thread::thread_config rx_thread; // every pipeline takes one of the CPUs, none leaves them unpinned
+};
+
+// a stretch of IQ samples to upload, the samples stay owned by the caller
+struct iq_capture {
+    const std::complex<float>* samples;
+    size_t len;
+    double rate;
+    double freq;     // center frequency
+    int64_t time_us; // time of the first sample
+};
+
+// samples the IQ ring writer receives at a time
+static const size_t ring_chunk = 65536;
+
+// DFT length that finds the frequency, so the channel, of a detected pulse
+static const size_t pulse_dft_len = 128;
+
+// sample rate of the captures taken by retuning to a detected channel
+static const double detect_rate = 10.24e6;
+
 size_t num_avgs = FFT_AVERAGES;
 
-std::mutex curl_mutex;
+// all pipelines share one upload thread
+esc_upload::upload_queue uploads;
+
+// set on SIGINT or SIGTERM, the pipelines and the aggregator stop and the node exits cleanly
+std::atomic<bool> stop_requested(false);
+
+void request_stop(int sig)
+{
+    stop_requested = true;
+    // a second signal kills the node if the clean exit hangs
+    signal(sig, SIG_DFL);
+}
+
+// set with --aggregator, power reports then go to the aggregator instead of OpenSAS
+std::shared_ptr<esc_aggregator::report_sender> aggregator;
+
+void run_pipeline(rx_pipeline& p, const pipeline_config& config, const po::variables_map& vm);
+
+void run_ring_writer(rx_pipeline& p, esc_iq_ring::iq_ring& ring, esc_thread::thread_config thread, std::atomic<bool>& running);
+
+void run_pulse_detector(rx_pipeline& p, esc_iq_ring::iq_ring& ring, const esc_pulse::pulse_config& config, esc_thread::thread_config thread, std::atomic<bool>& running);
+
+void post_power_data(const channel_data& data, std::string url);
+
+void post_fused_data(const esc_aggregator::fused_report& fused, std::string url);
+
+void run_aggregator(unsigned short port, double window, size_t min_votes);
+
+void post_iq_data(const channel_data& data, const std::complex<float>* buff, size_t len, uint8_t channel, std::string url);
 
-void post_power_data(channel_data data, std::string url);
+void post_iq_data_nocurl(const channel_data& data, const iq_capture& capture, uint8_t channel, std::string url, bool defer);
 
-void post_iq_data(std::vector<std::complex<float>>& buff, size_t len, uint8_t channel, std::string url);
+void post_iq_data_bfp(const channel_data& data, esc_iq_codec::bfp_codec& codec, const iq_capture& capture, uint8_t channel, std::string url, bool defer);
 
-void post_iq_data_nocurl(std::vector<std::complex<float>>& buff, size_t len, uint8_t channel, std::string url);
+void post_history_data(const channel_data& data, const esc_history::history_slice& slice, uint8_t channel, std::string url, bool defer);
 
-void post_json(std::string json_str, std::string url);
+void post_zoom_data(const channel_data& data, const esc_dft::log_pwr_dft_type& zoom, double first_freq, double bin_width, uint8_t channel, std::string url);
 
-int compute_average_on_bins(float *dft, size_t len);
+void post_pulse_data(const channel_data& data, const std::vector<esc_pulse::pulse_train>& trains, std::string url);
 
-void set_center_frequency(uint32_t freq, uhd::usrp::multi_usrp::sptr usrp, po::variables_map vm);
+void post_bin_stats_data(const channel_data& data, const esc_bin_stats::stats_snapshot& stats, std::string url);
 
-double get_center_freq(int channel);
+void post_occupancy_data(const channel_data& data, const esc_occupancy::occupancy_report& report, const esc_occupancy::occupancy_config& config, std::string url);
+
+void queue_upload(const std::string& json_str, const std::string& url, bool defer);
+
+bool upload_json(const std::string& json_str, const std::string& url);
+
+std::string base64_encode(const uint8_t* data, size_t len);
+
+//Wall clock time in microseconds since the epoch, for report timestamps
+int64_t unix_time_us(void);
+
+bool post_json(std::string json_str, std::string url);
+
+int compute_average_on_bins(const esc_channel_plan::channel_plan& plan, esc_cfar::cfar_detector& cfar, channel_data& data, const float *dft, size_t len);
+
+void set_center_frequency(double freq, const rx_pipeline& p);
+
+//Split a comma separated option into its values
+std::vector<std::string> split_list(const std::string& list);
 
 int UHD_SAFE_MAIN(int argc, char* argv[])
 {
-    //initialize channel power data
-    data.lat = SENSOR_LAT;
-    data.lon = SENSOR_LON;
-
-    //init channel power data
-    for (int i = 0; i < 15; i++) {
-        data.channel_pwr[i] = -100;
-    }
     // variables to be set by po
-    std::string args, ant, subdev, ref;
-    size_t len;
-    double rate, freq, gain, bw, frame_rate, step;
+    std::string ant, subdev, ref, channel_list, freq_list;
+    std::vector<std::string> args_list;
+    size_t len, num_chans, edge_bins, zoom_bins;
+    double rate, freq, gain, bw, frame_rate, report_rate, iq_holdoff, step, chan_freq, chan_width;
+    double history_mb, history_rate, backfill, iq_ring_mb, pre_trigger, post_trigger;
+    std::string cfar_mode, sweep_order, classifier_path;
+    float classify_confidence;
+    unsigned iq_bits;
+    std::string spool_path;
+    double spool_mb;
+    esc_upload::replay_config replay_config;
+    std::string config_path, rx_cpus, upload_cpus, aggregator_address, shm_prefix;
+    size_t shm_slots;
+    unsigned short aggregate_port;
+    double aggregate_window;
+    size_t aggregate_votes;
+    esc_thread::thread_config rx_thread, upload_thread;
+    esc_cfar::cfar_config cfar_config;
+    esc_sweep::sweep_config sweep_config;
+    esc_sim::sim_config sim_config;
+    esc_tune::tune_config tune_config;
     float ref_lvl, dyn_rng;
-    bool show_controls, observe;
+    bool show_controls, observe, lock_memory, load_shed, pulse, bin_stats, occupancy;
+    esc_load_shed::shed_config shed_config;
+    esc_pulse::pulse_config pulse_config;
+    std::string ring_cpus, pulse_cpus;
+    esc_bin_stats::stats_config bin_stats_config;
+    std::string bin_stats_percentiles;
+    esc_occupancy::occupancy_config occupancy_config;
 
     // //initialize required variables
     // rate = 10416667;       //125e6/12
@@ -136,160 +298,778 @@ int UHD_SAFE_MAIN(int argc, char* argv[])
 
     desc.add_options()
         ("help", "help message")
-        ("args", po::value<std::string>(&args)->default_value(""), "multi uhd device address args")
+        ("config", po::value<std::string>(&config_path), "file with option = value lines, options on the command line take precedence")
+        ("args", po::value<std::vector<std::string>>(&args_list)->default_value(std::vector<std::string>(1, ""), ""), "multi uhd device address args, repeat for several devices")
+        ("channels", po::value<std::string>(&channel_list)->default_value("0"), "which RX channel(s) to use on each device (e.g. \"0\" or \"0,1,2,3\")")
         // hardware parameters
         ("rate", po::value<double>(&rate), "rate of incoming samples (sps)")
         ("freq", po::value<double>(&freq), "RF center frequency in Hz")
+        ("freqs", po::value<std::string>(&freq_list), "comma separated RF center frequencies in Hz, one per RX channel, overrides --freq")
         ("gain", po::value<double>(&gain), "gain for the RF chain")
         ("ant", po::value<std::string>(&ant), "antenna selection")
         ("subdev", po::value<std::string>(&subdev), "subdevice specification")
         ("bw", po::value<double>(&bw), "analog frontend filter bandwidth in Hz")
         ("observe", po::value<bool>(&observe)->default_value(false), "Keeps observing on detected channel for 10 seconds")
+        ("tune-lead", po::value<double>(&tune_config.lead)->default_value(tune_config.lead), "seconds ahead of the device time a retune is timed, time enough to get the commands to the device")
+        ("tune-settle", po::value<double>(&tune_config.settle)->default_value(tune_config.settle), "seconds from a retune taking effect until samples are taken, the LO settling time")
+        // timing parameters
+        ("frame-rate", po::value<double>(&frame_rate)->default_value(25), "spectrum frames per second on each RX channel, 0 runs as fast as possible")
+        ("report-rate", po::value<double>(&report_rate)->default_value(4), "power reports per second on each RX channel")
+        ("iq-holdoff", po::value<double>(&iq_holdoff)->default_value(50e-3), "minimum time between IQ captures in seconds")
+        // thread parameters
+        ("rx-priority", po::value<int>(&rx_thread.priority)->default_value(0), "SCHED_FIFO priority (1-99) of the receive/DSP threads, 0 for the normal scheduler")
+        ("rx-cpus", po::value<std::string>(&rx_cpus), "CPUs of the receive/DSP threads (e.g. \"2,3\" or \"2-5\"), one per RX channel in order, defaults to the isolated CPUs, without any the threads are not pinned")
+        ("upload-priority", po::value<int>(&upload_thread.priority)->default_value(0), "SCHED_FIFO priority (1-99) of the upload thread, 0 for the normal scheduler")
+        ("upload-cpus", po::value<std::string>(&upload_cpus), "CPUs the upload thread may run on")
+        ("lock-memory", po::value<bool>(&lock_memory)->default_value(true), "lock the receive and DSP buffers in memory and keep the heap from returning memory")
+        // load shedding parameters
+        ("load-shed", po::value<bool>(&load_shed)->default_value(true), "step down to cheaper processing while a pipeline falls behind, and back once it keeps up")
+        ("shed-high", po::value<double>(&shed_config.high)->default_value(shed_config.high), "load (fraction of capacity) that steps down one level")
+        ("shed-low", po::value<double>(&shed_config.low)->default_value(shed_config.low), "load below which a second counts as calm")
+        ("shed-hold", po::value<size_t>(&shed_config.hold)->default_value(shed_config.hold), "calm seconds in a row before stepping back up one level")
+        // history parameters
+        ("history-mb", po::value<double>(&history_mb)->default_value(4), "memory for the spectrogram history of each RX channel in MB")
+        ("history-rate", po::value<double>(&history_rate)->default_value(4), "history frames per second, the spectra in between are max-held")
+        ("backfill", po::value<double>(&backfill)->default_value(10), "seconds of history uploaded with a detection, 0 disables it")
+        ("bin-stats", po::value<bool>(&bin_stats)->default_value(false), "keep max-hold, min-hold, mean and percentiles of every bin and report them once per window")
+        ("bin-stats-window", po::value<double>(&bin_stats_config.window)->default_value(bin_stats_config.window), "seconds of frames per bin statistics report")
+        ("bin-stats-floor", po::value<float>(&bin_stats_config.floor_db)->default_value(bin_stats_config.floor_db), "lowest level in dB of the per-bin histograms the percentiles come from")
+        ("bin-stats-step", po::value<float>(&bin_stats_config.step_db)->default_value(bin_stats_config.step_db), "dB between the 256 levels of the per-bin histograms")
+        ("bin-stats-percentiles", po::value<std::string>(&bin_stats_percentiles)->default_value("10,50,90"), "comma separated percentiles of every bin to report")
+        // occupancy parameters
+        ("occupancy", po::value<bool>(&occupancy)->default_value(false), "report the busy time, dwell times and last activity of every channel instead of the periodic power reports")
+        ("occupancy-period", po::value<double>(&occupancy_config.period)->default_value(occupancy_config.period), "seconds between occupancy reports")
+        ("occupancy-dwell", po::value<double>(&occupancy_config.dwell_base)->default_value(occupancy_config.dwell_base), "upper edge in seconds of the first dwell time bucket, every next bucket doubles it")
+        ("occupancy-buckets", po::value<size_t>(&occupancy_config.num_buckets)->default_value(occupancy_config.num_buckets), "dwell time buckets, the last one takes every longer interval")
+        // classifier parameters
+        ("classifier", po::value<std::string>(&classifier_path), "int8 classifier model file, without it every capture is uploaded as unknown")
+        ("classify-confidence", po::value<float>(&classify_confidence)->default_value(0.9f), "IQ is only uploaded when the classifier confidence is below this")
+        // IQ upload parameters
+        ("iq-bits", po::value<unsigned>(&iq_bits)->default_value(0), "upload IQ block floating point compressed with 4 to 16 bits per I/Q, 0 sends floats")
+        // zoom spectrum parameters
+        ("zoom-bins", po::value<size_t>(&zoom_bins)->default_value(0), "bins of the zoom spectrum of a detected channel computed from the wideband frame, 0 disables it")
+        // IQ ring parameters
+        ("iq-ring-mb", po::value<double>(&iq_ring_mb)->default_value(0), "stream each RX channel continuously into an IQ ring of this many MB and upload the wideband window around a detection, 0 retunes to capture after it")
+        ("pre-trigger", po::value<double>(&pre_trigger)->default_value(1e-3), "seconds of the IQ ring window before the frame that triggered")
+        ("post-trigger", po::value<double>(&post_trigger)->default_value(4e-3), "seconds of the IQ ring window from the frame that triggered on")
+        ("ring-cpus", po::value<std::string>(&ring_cpus), "CPUs of the IQ ring writer threads, one per RX channel in order, defaults to free CPUs when the pipelines are pinned")
+        // pulse detector parameters
+        ("pulse", po::value<bool>(&pulse)->default_value(false), "run a time-domain pulse detector on every sample of the IQ ring, pulse trains are reported and raise detections")
+        ("pulse-threshold", po::value<double>(&pulse_config.threshold_db)->default_value(pulse_config.threshold_db), "envelope over the noise floor in dB that starts a pulse")
+        ("pulse-min-width", po::value<double>(&pulse_config.min_width)->default_value(pulse_config.min_width), "shortest pulse in seconds")
+        ("pulse-max-width", po::value<double>(&pulse_config.max_width)->default_value(pulse_config.max_width), "longest pulse in seconds, longer ones are continuous signals")
+        ("pulse-smooth", po::value<size_t>(&pulse_config.smooth)->default_value(pulse_config.smooth), "samples of the pulse envelope moving average")
+        ("pulse-count", po::value<size_t>(&pulse_config.min_pulses)->default_value(pulse_config.min_pulses), "pulses within --pulse-window that make a pulse train")
+        ("pulse-window", po::value<double>(&pulse_config.train_window)->default_value(pulse_config.train_window), "seconds of pulses a pulse train is made of")
+        ("pulse-cpus", po::value<std::string>(&pulse_cpus), "CPUs of the pulse detector threads, one per RX channel in order, defaults to free CPUs when the pipelines are pinned")
+        // shared memory parameters
+        ("shm", po::value<std::string>(&shm_prefix)->implicit_value("esc_spectrum"), "publish every spectrum frame to local readers in POSIX shared memory /<name><RX channel>, see esc_shm.hpp")
+        ("shm-slots", po::value<size_t>(&shm_slots)->default_value(64), "frames the shared memory ring of each RX channel holds")
+        // upload parameters
+        ("opensas-url", po::value<std::string>(&opensas_url)->default_value(opensas_url), "base URL of the OpenSAS API")
+        ("client-cert", po::value<std::string>(&client_crt_path)->default_value(client_crt_path), "client certificate for OpenSAS")
+        ("client-key", po::value<std::string>(&client_key_path)->default_value(client_key_path), "client key for OpenSAS")
+        ("ca-cert", po::value<std::string>(&ca_crt_path)->default_value(ca_crt_path), "CA certificate that signed the OpenSAS server certificate")
+        ("aggregator", po::value<std::string>(&aggregator_address), "send power reports to an aggregator at host:port over UDP instead of OpenSAS")
+        ("connect-timeout", po::value<double>(&connect_timeout)->default_value(connect_timeout), "seconds to wait for the server to accept a connection")
+        ("spool", po::value<std::string>(&spool_path), "file that keeps reports while the server is unreachable, replayed when it is back")
+        ("spool-mb", po::value<double>(&spool_mb)->default_value(256), "size of the spool file in MB")
+        ("replay-rate", po::value<double>(&replay_config.rate)->default_value(replay_config.rate), "spooled requests replayed per second")
+        ("replay-batch", po::value<size_t>(&replay_config.batch)->default_value(replay_config.batch), "spooled reports sent as one JSON array request, 1 replays them one by one")
+        ("retry-interval", po::value<double>(&replay_config.retry_interval)->default_value(replay_config.retry_interval), "seconds between connection attempts while the server is unreachable")
+        // aggregator mode
+        ("aggregate", po::value<unsigned short>(&aggregate_port), "run as the aggregator of other sensors on this UDP port instead of sensing")
+        ("aggregate-window", po::value<double>(&aggregate_window)->default_value(0.25), "seconds of reports fused into one, about the report period of the sensors")
+        ("aggregate-votes", po::value<size_t>(&aggregate_votes)->default_value(1), "sensors that must detect a channel for the fused report to detect it")
         // display parameters
         ("num-bins", po::value<size_t>(&len)->default_value(512), "the number of bins in the DFT")
         ("num-avgs", po::value<size_t>(&num_avgs)->default_value(FFT_AVERAGES), "the number of averages in the DFT")
+        // channel plan parameters
+        ("chan-freq", po::value<double>(&chan_freq)->default_value(3555e6), "center frequency of the first channel in Hz")
+        ("chan-width", po::value<double>(&chan_width)->default_value(10e6), "width and spacing of the channels in Hz")
+        ("num-chans", po::value<size_t>(&num_chans)->default_value(15), "the number of channels in the plan")
+        ("edge-bins", po::value<size_t>(&edge_bins)->default_value(10), "bins excluded at each edge of the spectrum (filter rolloff)")
+        // detector parameters
+        ("cfar-mode", po::value<std::string>(&cfar_mode)->default_value("ca"), "CFAR reference: ca (cell averaging) or os (ordered statistic)")
+        ("cfar-guard", po::value<size_t>(&cfar_config.guard_cells)->default_value(cfar_config.guard_cells), "CFAR guard cells on each side")
+        ("cfar-train", po::value<size_t>(&cfar_config.train_cells)->default_value(cfar_config.train_cells), "CFAR training cells on each side")
+        ("cfar-pfa", po::value<double>(&cfar_config.pfa)->default_value(cfar_config.pfa), "CFAR per-bin probability of false alarm")
+        ("cfar-occupancy", po::value<float>(&cfar_config.on_occupancy)->default_value(cfar_config.on_occupancy), "fraction of channel bins over threshold to count a hit")
+        ("cfar-on-frames", po::value<size_t>(&cfar_config.on_frames)->default_value(cfar_config.on_frames), "consecutive hits before a channel is declared busy")
+        ("cfar-off-frames", po::value<size_t>(&cfar_config.off_frames)->default_value(cfar_config.off_frames), "consecutive misses before a channel is declared idle")
+        // sweep parameters
+        ("sweep-start", po::value<double>(&sweep_config.start_freq), "sweep mode: lowest frequency to cover in Hz")
+        ("sweep-stop", po::value<double>(&sweep_config.stop_freq), "sweep mode: highest frequency to cover in Hz")
+        ("sweep-overlap", po::value<double>(&sweep_config.overlap)->default_value(sweep_config.overlap), "fraction of the usable bins shared by adjacent sweep steps")
+        ("sweep-dwell", po::value<size_t>(&sweep_config.dwell_frames)->default_value(sweep_config.dwell_frames), "spectrum frames stitched per sweep step")
+        ("sweep-settle", po::value<size_t>(&sweep_config.settle_frames)->default_value(sweep_config.settle_frames), "frames dropped after every sweep retune")
+        ("sweep-order", po::value<std::string>(&sweep_order)->default_value("auto"), "sweep step order: auto, linear or serpentine")
+        ("retune-time", po::value<double>(&sweep_config.retune_time)->default_value(sweep_config.retune_time), "initial estimate of the retune time in seconds")
+        // simulation parameters
+        ("sim", po::value<std::string>(&sim_config.path)->implicit_value(""), "run without a radio on a simulated source: an fc32 file, or a synthetic signal without a file")
+        ("sim-realtime", po::value<bool>(&sim_config.realtime)->default_value(sim_config.realtime), "deliver simulated samples at the sample rate, false runs as fast as the pipeline can")
+        ("sim-noise", po::value<double>(&sim_config.noise_db)->default_value(sim_config.noise_db), "synthetic noise power in dBFS")
+        ("sim-signal", po::value<double>(&sim_config.signal_db)->default_value(sim_config.signal_db), "synthetic signal power in dBFS")
+        ("sim-offset", po::value<double>(&sim_config.offset)->default_value(sim_config.offset), "synthetic signal center relative to the RX center in Hz")
+        ("sim-bw", po::value<double>(&sim_config.bandwidth)->default_value(sim_config.bandwidth), "synthetic signal bandwidth in Hz")
+        ("sim-burst", po::value<double>(&sim_config.burst_width)->default_value(sim_config.burst_width), "seconds the synthetic signal is on per period, 0 keeps it on")
+        ("sim-period", po::value<double>(&sim_config.burst_period)->default_value(sim_config.burst_period), "seconds between synthetic signal bursts")
+        ("sim-control-latency", po::value<double>(&sim_config.control_latency)->default_value(sim_config.control_latency), "seconds every simulated tuning control or readback takes")
+        ("sim-lo-settle", po::value<double>(&sim_config.lo_settle)->default_value(sim_config.lo_settle), "seconds the simulated LO takes to lock after a retune")
     ;
     // clang-format on
     po::variables_map vm;
     po::store(po::parse_command_line(argc, argv, desc), vm);
     po::notify(vm);
+    if (vm.count("config")) {
+        po::store(po::parse_config_file<char>(config_path.c_str(), desc), vm);
+        po::notify(vm);
+    }
 
     // print the help message
-    if (vm.count("help") or not vm.count("rate")) {
+    if (vm.count("help") or (not vm.count("rate") and not vm.count("aggregate"))) {
         std::cout << boost::format("UHD RX ASCII Art DFT %s") % desc << std::endl;
         return EXIT_FAILURE;
     }
 
-    // create a usrp device
-    std::cout << std::endl;
-    std::cout << boost::format("Creating the usrp device with: %s...") % args
-              << std::endl;
-    uhd::usrp::multi_usrp::sptr usrp = uhd::usrp::multi_usrp::make(args);
-
-    // Lock mboard clocks
-    if (vm.count("ref")) {
-        usrp->set_clock_source(ref);
+    // sweep mode tunes to the sweep steps instead of a center frequency
+    const bool sweep = vm.count("sweep-start") and vm.count("sweep-stop");
+    if (sweep) {
+        sweep_config.order = esc_sweep::parse_order(sweep_order);
+        if (not vm.count("freq"))
+            freq = sweep_config.start_freq;
     }
 
-    // always select the subdevice first, the channel mapping affects the other settings
-    if (vm.count("subdev"))
-        usrp->set_rx_subdev_spec(subdev);
-
-    std::cout << boost::format("Using Device: %s") % usrp->get_pp_string() << std::endl;
+    // the CPUs threads fall back to when they are not pinned, before any thread pins itself
+    esc_thread::get_process_cpus();
+    // receive threads default to the isolated cores, when the kernel has any
+    rx_thread.cpus     = vm.count("rx-cpus") ? esc_thread::parse_cpu_list(rx_cpus) : esc_thread::get_isolated_cpus();
+    upload_thread.cpus = esc_thread::parse_cpu_list(upload_cpus);
+    if (rx_thread.priority < 0 or rx_thread.priority > 99 or upload_thread.priority < 0 or upload_thread.priority > 99) {
+        std::cerr << "Thread priorities must be between 0 and 99" << std::endl;
+        return EXIT_FAILURE;
+    }
 
-    // set the sample rate
-    if (not vm.count("rate")) {
-        std::cerr << "Please specify the sample rate with --rate" << std::endl;
+    // the aggregator does not sense, it fuses the reports of other sensors
+    const bool aggregate = vm.count("aggregate");
+    if (shed_config.low <= 0 or shed_config.low >= shed_config.high) {
+        std::cerr << "Load shedding needs 0 < --shed-low < --shed-high" << std::endl;
         return EXIT_FAILURE;
     }
-    std::cout << boost::format("Setting RX Rate: %f Msps...") % (rate / 1e6) << std::endl;
-    usrp->set_rx_rate(rate);
-    std::cout << boost::format("Actual RX Rate: %f Msps...") % (usrp->get_rx_rate() / 1e6)
-              << std::endl
-              << std::endl;
+    if (len < 2 or (len & (len - 1))) {
+        std::cerr << "--num-bins must be a power of 2" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (pulse and (iq_ring_mb <= 0 or sweep)) {
+        std::cerr << "The pulse detector needs the IQ ring (--iq-ring-mb) and does not sweep" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (pulse and (pulse_config.threshold_db <= 0 or pulse_config.min_width >= pulse_config.max_width
+                      or pulse_config.train_window <= 0 or pulse_config.min_pulses < 2)) {
+        std::cerr << "The pulse detector needs --pulse-threshold > 0, --pulse-min-width < --pulse-max-width, --pulse-window > 0 and --pulse-count >= 2" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (bin_stats) {
+        const std::vector<std::string> percentiles = split_list(bin_stats_percentiles);
+        bin_stats_config.percentiles.clear();
+        for (size_t i = 0; i < percentiles.size(); i++)
+            bin_stats_config.percentiles.push_back(std::stod(percentiles[i]));
+    }
+    if (bin_stats and (bin_stats_config.window <= 0 or bin_stats_config.step_db <= 0)) {
+        std::cerr << "Bin statistics need --bin-stats-window > 0 and --bin-stats-step > 0" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (occupancy and (occupancy_config.period <= 0 or occupancy_config.dwell_base < 1e-6
+                          or occupancy_config.num_buckets == 0 or occupancy_config.num_buckets > 32)) {
+        std::cerr << "Occupancy reports need --occupancy-period > 0, --occupancy-dwell >= 1e-6 and 1 to 32 --occupancy-buckets" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (vm.count("shm") and (shm_prefix.empty() or shm_slots == 0)) {
+        std::cerr << "Shared memory publication needs a --shm name and --shm-slots > 0" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (iq_ring_mb < 0 or pre_trigger < 0 or post_trigger <= 0) {
+        std::cerr << "The IQ ring needs --iq-ring-mb >= 0, --pre-trigger >= 0 and --post-trigger > 0" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (aggregate and aggregate_window <= 0) {
+        std::cerr << "The aggregation window must be positive" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (vm.count("aggregator"))
+        aggregator = std::make_shared<esc_aggregator::report_sender>(aggregator_address);
 
     // set the center frequency
-    if (not vm.count("freq")) {
+    if (not aggregate and not sweep and not vm.count("freq") and not vm.count("freqs")) {
         std::cerr << "Please specify the center frequency with --freq" << std::endl;
         return EXIT_FAILURE;
     }
-    std::cout << boost::format("Setting RX Freq: %f MHz...") % (freq / 1e6) << std::endl;
-    uhd::tune_request_t tune_request(freq);
-    if (vm.count("int-n"))
-        tune_request.args = uhd::device_addr_t("mode_n=integer");
-    usrp->set_rx_freq(tune_request);
-    std::cout << boost::format("Actual RX Freq: %f MHz...") % (usrp->get_rx_freq() / 1e6)
-              << std::endl
-              << std::endl;
 
-    // set the rf gain
-    if (vm.count("gain")) {
-        std::cout << boost::format("Setting RX Gain: %f dB...") % gain << std::endl;
-        usrp->set_rx_gain(gain);
-        std::cout << boost::format("Actual RX Gain: %f dB...") % usrp->get_rx_gain()
-                  << std::endl
+    // the off threshold sits at half the on threshold for hysteresis
+    cfar_config.mode          = esc_cfar::parse_mode(cfar_mode);
+    cfar_config.off_occupancy = cfar_config.on_occupancy / 2;
+
+    const std::vector<std::string> channel_strings = split_list(channel_list);
+    const std::vector<std::string> freq_strings    = split_list(freq_list);
+    // the simulated source stands in for one device
+    const bool sim             = vm.count("sim");
+    const size_t num_pipelines = (sim ? 1 : args_list.size()) * channel_strings.size();
+    if (vm.count("freqs") and freq_strings.size() != num_pipelines) {
+        std::cerr << boost::format("--freqs needs one frequency per RX channel (%d)") % num_pipelines
                   << std::endl;
-    } else {
-        gain = usrp->get_rx_gain();
+        return EXIT_FAILURE;
     }
 
-    // set the analog frontend filter bandwidth
-    if (vm.count("bw")) {
-        std::cout << boost::format("Setting RX Bandwidth: %f MHz...") % (bw / 1e6)
-                  << std::endl;
-        usrp->set_rx_bandwidth(bw);
-        std::cout << boost::format("Actual RX Bandwidth: %f MHz...")
-                         % (usrp->get_rx_bandwidth() / 1e6)
-                  << std::endl
+    std::vector<rx_pipeline> pipelines;
+    if (sim and not vm.count("rate")) {
+        std::cerr << "Please specify the sample rate of the simulated source with --rate" << std::endl;
+        return EXIT_FAILURE;
+    }
+    for (size_t c = 0; sim and not aggregate and c < channel_strings.size(); c++) {
+        rx_pipeline p;
+        p.chan      = std::stoul(channel_strings[c]);
+        p.freq      = vm.count("freqs") ? std::stod(freq_strings[pipelines.size()]) : freq;
+        p.rate      = rate;
+        p.sim       = std::make_shared<esc_sim::sim_source>(sim_config, pipelines.size(), p.rate, p.freq);
+        p.rx_stream = p.sim;
+        pipelines.push_back(p);
+    }
+    for (size_t dev = 0; not sim and not aggregate and dev < args_list.size(); dev++) {
+        // create a usrp device
+        std::cout << std::endl;
+        std::cout << boost::format("Creating the usrp device with: %s...") % args_list[dev]
                   << std::endl;
-    } else {
-        bw = usrp->get_rx_bandwidth();
+        uhd::usrp::multi_usrp::sptr usrp = uhd::usrp::multi_usrp::make(args_list[dev]);
+
+        // Lock mboard clocks
+        if (vm.count("ref")) {
+            usrp->set_clock_source(ref);
+        }
+
+        // always select the subdevice first, the channel mapping affects the other settings
+        if (vm.count("subdev"))
+            usrp->set_rx_subdev_spec(subdev);
+
+        std::cout << boost::format("Using Device: %s") % usrp->get_pp_string() << std::endl;
+
+        for (size_t c = 0; c < channel_strings.size(); c++) {
+            rx_pipeline p;
+            p.usrp = usrp;
+            p.chan = std::stoul(channel_strings[c]);
+            if (p.chan >= usrp->get_rx_num_channels()) {
+                std::cerr << boost::format("Invalid RX channel %d for device %s") % p.chan
+                                 % args_list[dev]
+                          << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            // set the sample rate
+            std::cout << boost::format("Setting RX Rate: %f Msps...") % (rate / 1e6) << std::endl;
+            usrp->set_rx_rate(rate, p.chan);
+            std::cout << boost::format("Actual RX Rate: %f Msps...") % (usrp->get_rx_rate(p.chan) / 1e6)
+                      << std::endl
+                      << std::endl;
+
+            // set the center frequency
+            const double rx_freq = vm.count("freqs") ? std::stod(freq_strings[pipelines.size()]) : freq;
+            std::cout << boost::format("Setting RX Freq: %f MHz...") % (rx_freq / 1e6) << std::endl;
+            uhd::tune_request_t tune_request(rx_freq);
+            if (vm.count("int-n"))
+                tune_request.args = uhd::device_addr_t("mode_n=integer");
+            usrp->set_rx_freq(tune_request, p.chan);
+            std::cout << boost::format("Actual RX Freq: %f MHz...") % (usrp->get_rx_freq(p.chan) / 1e6)
+                      << std::endl
+                      << std::endl;
+
+            // set the rf gain
+            if (vm.count("gain")) {
+                std::cout << boost::format("Setting RX Gain: %f dB...") % gain << std::endl;
+                usrp->set_rx_gain(gain, p.chan);
+                std::cout << boost::format("Actual RX Gain: %f dB...") % usrp->get_rx_gain(p.chan)
+                          << std::endl
+                          << std::endl;
+            }
+
+            // set the analog frontend filter bandwidth
+            if (vm.count("bw")) {
+                std::cout << boost::format("Setting RX Bandwidth: %f MHz...") % (bw / 1e6)
+                          << std::endl;
+                usrp->set_rx_bandwidth(bw, p.chan);
+                std::cout << boost::format("Actual RX Bandwidth: %f MHz...")
+                                 % (usrp->get_rx_bandwidth(p.chan) / 1e6)
+                          << std::endl
+                          << std::endl;
+            }
+
+            // set the antenna
+            if (vm.count("ant"))
+                usrp->set_rx_antenna(ant, p.chan);
+
+            p.freq = usrp->get_rx_freq(p.chan);
+            p.rate = usrp->get_rx_rate(p.chan);
+            pipelines.push_back(p);
+        }
     }
 
-    // set the antenna
-    if (vm.count("ant"))
-        usrp->set_rx_antenna(ant);
+    if (not pipelines.empty() and not sim)
+        std::this_thread::sleep_for(std::chrono::seconds(1)); // allow for some setup time
+
+    for (size_t k = 0; k < pipelines.size(); k++) {
+        rx_pipeline& p = pipelines[k];
+
+        // a simulated source has no sensors and is its own streamer
+        if (not p.sim) {
+            // Check Ref and LO Lock detect
+            std::vector<std::string> sensor_names;
+            sensor_names = p.usrp->get_rx_sensor_names(p.chan);
+            if (std::find(sensor_names.begin(), sensor_names.end(), "lo_locked")
+                != sensor_names.end()) {
+                uhd::sensor_value_t lo_locked = p.usrp->get_rx_sensor("lo_locked", p.chan);
+                std::cout << boost::format("Checking RX: %s ...") % lo_locked.to_pp_string()
+                          << std::endl;
+                UHD_ASSERT_THROW(lo_locked.to_bool());
+            }
+            sensor_names = p.usrp->get_mboard_sensor_names(0);
+            if ((ref == "mimo")
+                and (std::find(sensor_names.begin(), sensor_names.end(), "mimo_locked")
+                        != sensor_names.end())) {
+                uhd::sensor_value_t mimo_locked = p.usrp->get_mboard_sensor("mimo_locked", 0);
+                std::cout << boost::format("Checking RX: %s ...") % mimo_locked.to_pp_string()
+                          << std::endl;
+                UHD_ASSERT_THROW(mimo_locked.to_bool());
+            }
+            if ((ref == "external")
+                and (std::find(sensor_names.begin(), sensor_names.end(), "ref_locked")
+                        != sensor_names.end())) {
+                uhd::sensor_value_t ref_locked = p.usrp->get_mboard_sensor("ref_locked", 0);
+                std::cout << boost::format("Checking RX: %s ...") % ref_locked.to_pp_string()
+                          << std::endl;
+                UHD_ASSERT_THROW(ref_locked.to_bool());
+            }
 
-    std::this_thread::sleep_for(std::chrono::seconds(1)); // allow for some setup time
+            // create a receive streamer for this channel only
+            uhd::stream_args_t stream_args("fc32"); // complex floats
+            stream_args.channels = std::vector<size_t>(1, p.chan);
+            p.rx_stream = p.usrp->get_rx_stream(stream_args);
+        }
 
-    // Check Ref and LO Lock detect
-    std::vector<std::string> sensor_names;
-    sensor_names = usrp->get_rx_sensor_names(0);
-    if (std::find(sensor_names.begin(), sensor_names.end(), "lo_locked")
-        != sensor_names.end()) {
-        uhd::sensor_value_t lo_locked = usrp->get_rx_sensor("lo_locked", 0);
-        std::cout << boost::format("Checking RX: %s ...") % lo_locked.to_pp_string()
-                  << std::endl;
-        UHD_ASSERT_THROW(lo_locked.to_bool());
-    }
-    sensor_names = usrp->get_mboard_sensor_names(0);
-    if ((ref == "mimo")
-        and (std::find(sensor_names.begin(), sensor_names.end(), "mimo_locked")
-                != sensor_names.end())) {
-        uhd::sensor_value_t mimo_locked = usrp->get_mboard_sensor("mimo_locked", 0);
-        std::cout << boost::format("Checking RX: %s ...") % mimo_locked.to_pp_string()
+        // retunes are timed commands, from tune results cached below
+        tune_config.int_n = vm.count("int-n");
+        std::shared_ptr<esc_tune::tune_backend> tune_backend;
+        if (p.sim)
+            tune_backend = std::make_shared<esc_tune::sim_backend>(p.sim);
+        else
+            tune_backend = std::make_shared<esc_tune::usrp_backend>(p.usrp, p.chan, p.rx_stream);
+        p.tuner = std::make_shared<esc_tune::tuner>(tune_backend, tune_config);
+
+        if (sweep) {
+            // the channel plan maps onto the stitched composite spectrum
+            p.sweep = std::make_shared<esc_sweep::sweep_scheduler>(p.rate, len, edge_bins, sweep_config);
+            p.plan = std::make_shared<esc_channel_plan::channel_plan>(p.sweep->get_composite_center(),
+                p.sweep->get_composite_rate(),
+                p.sweep->get_num_composite_bins(),
+                esc_channel_plan::make_uniform_channels(chan_freq, chan_width, num_chans));
+            p.freq = p.sweep->get_current_freq();
+            std::cout << boost::format("RX %d (channel %d) sweeping %f - %f MHz in %d steps:") % k % p.chan
+                             % (sweep_config.start_freq / 1e6) % (sweep_config.stop_freq / 1e6)
+                             % p.sweep->get_num_steps()
+                      << std::endl;
+            for (size_t i = 0; i < p.sweep->get_tour().size(); i++) {
+                std::cout << boost::format("Step %d: %f MHz") % p.sweep->get_tour()[i]
+                                 % (p.sweep->get_step_freq(p.sweep->get_tour()[i]) / 1e6)
+                          << std::endl;
+            }
+            std::cout << boost::format("Sweep cycle time: %f ms") % (p.sweep->get_cycle_time() * 1e3)
+                      << std::endl;
+        } else {
+            // map the channel plan onto the DFT bins, using the actual rate and frequency
+            p.plan = std::make_shared<esc_channel_plan::channel_plan>(p.freq,
+                p.rate,
+                len,
+                esc_channel_plan::make_uniform_channels(chan_freq, chan_width, num_chans),
+                edge_bins);
+            std::cout << boost::format("RX %d (channel %d at %f MHz):") % k % p.chan % (p.freq / 1e6)
+                      << std::endl;
+        }
+        for (size_t ch = 0; ch < p.plan->size(); ch++) {
+            std::cout << boost::format("Channel %d: %f MHz %s") % ch
+                             % (p.plan->get_center_freq(ch) / 1e6)
+                             % (p.plan->is_covered(ch) ? "" : "(not covered)");
+            if (p.sweep and p.plan->is_covered(ch)) {
+                std::cout << boost::format("revisit %f ms")
+                                 % (p.sweep->get_revisit_time(p.plan->get_center_freq(ch)) * 1e3);
+            }
+            std::cout << std::endl;
+        }
+
+        // tune once to every frequency the pipeline may retune to: the sweep
+        // steps, and the channels when captures are taken by retuning
+        std::vector<double> tune_freqs(1, p.freq);
+        for (size_t i = 0; p.sweep and i < p.sweep->get_num_steps(); i++)
+            tune_freqs.push_back(p.sweep->get_step_freq(i));
+        for (size_t ch = 0; iq_ring_mb == 0 and ch < p.plan->size(); ch++)
+            tune_freqs.push_back(p.plan->get_center_freq(ch));
+        std::vector<double> tune_rates(1, p.rate);
+        if (iq_ring_mb == 0)
+            tune_rates.push_back(detect_rate);
+        p.tuner->prepare(tune_freqs, tune_rates);
+        p.tuner->retune(p.freq, p.rate);
+        std::cout << boost::format("RX %d tune cache: %d frequencies, %d rates, retunes %f ms ahead, settling %f ms")
+                         % k % tune_freqs.size() % tune_rates.size() % (tune_config.lead * 1e3)
+                         % (tune_config.settle * 1e3)
                   << std::endl;
-        UHD_ASSERT_THROW(mimo_locked.to_bool());
-    }
-    if ((ref == "external")
-        and (std::find(sensor_names.begin(), sensor_names.end(), "ref_locked")
-                != sensor_names.end())) {
-        uhd::sensor_value_t ref_locked = usrp->get_mboard_sensor("ref_locked", 0);
-        std::cout << boost::format("Checking RX: %s ...") % ref_locked.to_pp_string()
+        p.cfar = std::make_shared<esc_cfar::cfar_detector>(*p.plan, cfar_config);
+        p.history = std::make_shared<esc_history::spectrogram_history>(p.plan->get_num_bins(),
+            p.plan->get_bin_freq(0),
+            p.plan->get_samp_rate() / p.plan->get_num_bins(),
+            size_t(history_mb * 1024 * 1024));
+        std::cout << boost::format("History: %d frames, %f s") % p.history->get_capacity()
+                         % (history_rate > 0 ? p.history->get_capacity() / history_rate : 0.0)
                   << std::endl;
-        UHD_ASSERT_THROW(ref_locked.to_bool());
+        if (vm.count("classifier"))
+            p.classifier = std::make_shared<esc_classifier::signal_classifier>(classifier_path);
+        if (iq_bits != 0)
+            p.codec = std::make_shared<esc_iq_codec::bfp_codec>(iq_bits);
+        if (zoom_bins != 0)
+            p.zoom = std::make_shared<esc_dft::zoom_dft<float>>(len, zoom_bins);
+        if (vm.count("shm")) {
+            std::vector<esc_shm::channel_entry> channels(p.plan->size());
+            for (size_t ch = 0; ch < p.plan->size(); ch++) {
+                channels[ch].center_freq = p.plan->get_center_freq(ch);
+                channels[ch].bandwidth   = p.plan->get_bandwidth(ch);
+            }
+            const std::string shm_name = esc_shm::get_object_name(shm_prefix, k);
+            p.shm = std::make_shared<esc_shm::spectrum_publisher>(shm_name,
+                shm_slots,
+                SENSOR_ID,
+                k,
+                p.plan->get_bin_freq(0),
+                p.plan->get_samp_rate() / p.plan->get_num_bins(),
+                p.plan->get_num_bins(),
+                channels);
+            std::cout << boost::format("RX %d spectra: shared memory %s, %d frames") % k % shm_name % shm_slots
+                      << std::endl;
+        }
+        if (pulse)
+            p.pulses = std::make_shared<esc_pulse::train_tracker>(pulse_config, p.rate, p.plan->size());
+        if (bin_stats) {
+            p.bin_stats = std::make_shared<esc_bin_stats::bin_accumulator>(p.plan->get_num_bins(),
+                p.plan->get_bin_freq(0),
+                p.plan->get_samp_rate() / p.plan->get_num_bins(),
+                bin_stats_config);
+        }
+        if (occupancy)
+            p.occupancy = std::make_shared<esc_occupancy::occupancy_tracker>(p.plan->size(), occupancy_config);
+
+        //initialize channel power data
+        p.data.rx_channel = k;
+        p.data.lat        = SENSOR_LAT;
+        p.data.lon        = SENSOR_LON;
+        p.data.detect_time_us = 0;
+        p.data.channel_pwr.assign(p.plan->size(), -100);
+        p.data.channel_lin.assign(p.plan->size(), 1e-10f);
+        p.data.detected.assign(p.plan->size(), false);
+        p.data.signal.assign(p.plan->size(), "unknown");
+        p.data.confidence.assign(p.plan->size(), 0);
     }
 
-    // create a receive streamer
-    uhd::stream_args_t stream_args("fc32"); // complex floats
-    uhd::rx_streamer::sptr rx_stream = usrp->get_rx_stream(stream_args);
-
-    // allocate recv buffer and metatdata
-    uhd::rx_metadata_t md;
-    std::vector<std::complex<float>> buff(len);
-    std::vector<std::complex<float>> detect_buff(DETECTION_SAMPLE_SIZE);
-
     //------------------------------------------------------------------
     //-- Initialize
     //------------------------------------------------------------------
     //initscr(); // curses init
 
+    // a server that closes the connection makes writes fail with EPIPE instead of killing the node
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+
+    // large report strings come from the heap and stay there, instead of a fresh mmap (and page faults) every time
+    if (lock_memory) {
+        mallopt(M_MMAP_THRESHOLD, 256 * 1024 * 1024);
+        mallopt(M_TRIM_THRESHOLD, -1);
+        // and the scratch outside the buffer pools is locked with everything else, when the limit allows
+        const std::string not_locked = esc_buffer_pool::lock_process();
+        if (not_locked.empty())
+            std::cout << "Memory: process locked" << std::endl;
+        else
+            std::cerr << "Memory: only the buffer pools are locked, " << not_locked << std::endl;
+    }
+
+    std::shared_ptr<esc_spool::spool> spool;
+    if (vm.count("spool")) {
+        spool = std::make_shared<esc_spool::spool>(spool_path, size_t(spool_mb * 1024 * 1024));
+        std::cout << boost::format("Spool: %d requests waiting for replay") % spool->size() << std::endl;
+        uploads.set_spool(spool.get(), replay_config);
+    }
+    uploads.start(upload_json, [upload_thread] {
+        std::cout << esc_thread::apply_thread_config("esc_upload", upload_thread) << std::endl;
+    });
+
+    pipeline_config config;
+    config.len         = len;
+    config.frame_rate  = frame_rate;
+    config.report_rate = report_rate;
+    config.iq_holdoff  = iq_holdoff;
+    config.history_rate = history_rate;
+    config.backfill    = backfill;
+    config.classify_confidence = classify_confidence;
+    config.lock_memory = lock_memory;
+    config.rx_thread   = rx_thread;
+    config.observe     = observe;
+    config.load_shed   = load_shed;
+    config.iq_ring_mb  = iq_ring_mb;
+    config.pre_trigger = pre_trigger;
+    config.post_trigger = post_trigger;
+    config.shed        = shed_config;
+    config.pulse       = pulse_config;
+    config.pulse_cpus  = esc_thread::parse_cpu_list(pulse_cpus);
+    // an IQ ring writer receives at the full rate, it gets a CPU of its own next to pinned pipelines
+    std::vector<size_t> pinned_cpus;
+    for (size_t k = 0; k < pipelines.size() and not rx_thread.cpus.empty(); k++)
+        pinned_cpus.push_back(rx_thread.cpus[k % rx_thread.cpus.size()]);
+    config.ring_cpus = esc_thread::parse_cpu_list(ring_cpus);
+    if (iq_ring_mb > 0 and config.ring_cpus.empty() and not pinned_cpus.empty()) {
+        config.ring_cpus = esc_thread::pick_free_cpus(pinned_cpus, pipelines.size());
+        if (config.ring_cpus.empty())
+            std::cerr << "Not enough free CPUs for the IQ ring writers, they are not pinned" << std::endl;
+    }
+    // so does a pulse detector, on a CPU no pipeline or ring writer takes
+    if (pulse and config.pulse_cpus.empty() and not pinned_cpus.empty()) {
+        pinned_cpus.insert(pinned_cpus.end(), config.ring_cpus.begin(), config.ring_cpus.end());
+        config.pulse_cpus = esc_thread::pick_free_cpus(pinned_cpus, pipelines.size());
+        if (config.pulse_cpus.empty())
+            std::cerr << "Not enough free CPUs for the pulse detectors, they are not pinned" << std::endl;
+    }
+    config.bin_stats_window = bin_stats_config.window;
+    config.occupancy   = occupancy_config;
+    // a pipeline without a frame rate has no frame periods to skip
+    if (frame_rate == 0)
+        config.shed.max_level = esc_load_shed::LEVEL_DEFER_UPLOADS;
+
+    if (aggregate)
+        run_aggregator(aggregate_port, aggregate_window, aggregate_votes);
+
+    // one thread per pipeline, each pins itself before touching its buffers
+    std::vector<std::thread> threads;
+    for (size_t k = 0; k < pipelines.size(); k++) {
+        threads.push_back(std::thread(run_pipeline,
+            std::ref(pipelines[k]),
+            std::cref(config),
+            std::cref(vm)));
+    }
+    for (size_t k = 0; k < threads.size(); k++) {
+        threads[k].join();
+    }
+
+    //------------------------------------------------------------------
+    //-- Cleanup
+    //------------------------------------------------------------------
+    uploads.stop();
+    endwin(); // curses done
+
+    // finished
+    std::cout << std::endl << "Done!" << std::endl << std::endl;
+
+    return EXIT_SUCCESS;
+}
+
+/*
+Receive -> DSP -> detect loop of one RX channel, runs on its own thread
+*/
+void run_pipeline(rx_pipeline& p, const pipeline_config& config, const po::variables_map& vm){
+    // pinned to one of --rx-cpus or the isolated cores, without either the scheduler places it
+    esc_thread::thread_config thread = config.rx_thread;
+    if (not thread.cpus.empty())
+        thread.cpus = std::vector<size_t>(1, thread.cpus[p.data.rx_channel % thread.cpus.size()]);
+    std::cout << esc_thread::apply_thread_config("esc_rx" + std::to_string(p.data.rx_channel), thread)
+              << std::endl;
+
+    // allocate recv buffers and DSP scratch from pools built (and pre-faulted) on this thread
+    uhd::rx_metadata_t md;
+    esc_buffer_pool::buffer_pool rx_pool(config.len * sizeof(std::complex<float>), 1, config.lock_memory);
+    esc_buffer_pool::buffer_pool detect_pool(DETECTION_SAMPLE_SIZE * sizeof(std::complex<float>), 1, config.lock_memory);
+    esc_buffer_pool::buffer_pool scratch_pool(config.len * sizeof(float), 1, config.lock_memory);
+    esc_buffer_pool::buffer_handle rx_slot     = rx_pool.acquire();
+    esc_buffer_pool::buffer_handle detect_slot = detect_pool.acquire();
+    esc_buffer_pool::buffer_handle dft_slot    = scratch_pool.acquire();
+    std::complex<float>* buff        = rx_slot.as<std::complex<float>>();
+    std::complex<float>* detect_buff = detect_slot.as<std::complex<float>>();
+    float* dft                       = dft_slot.as<float>();
+    esc_dft::pwr_dft<float> pwr_dft(config.len);
+    // dB copy of the linear spectrum, only for shared memory
+    std::vector<float> spectrum_db(p.plan->get_num_bins());
+    const size_t buff_len            = config.len;
+    const size_t detect_len          = DETECTION_SAMPLE_SIZE;
+    std::cout << boost::format("RX %d buffers: %s pages, %s") % p.data.rx_channel
+                     % (rx_pool.is_huge() ? "huge" : "normal")
+                     % (rx_pool.is_locked() ? "locked" : "not locked")
+              << std::endl;
+
+    // with an IQ ring a writer thread streams continuously into it and the frames are taken from it
+    std::shared_ptr<esc_iq_ring::iq_ring> ring;
+    std::atomic<bool> ring_running(false);
+    std::thread ring_writer;
+    uint64_t frame_end = 0; // ring index after the last frame
+    if (config.iq_ring_mb > 0) {
+        ring = std::make_shared<esc_iq_ring::iq_ring>(
+            size_t(config.iq_ring_mb * 1024 * 1024), ring_chunk, config.lock_memory);
+        // the writer is the receive stage, on a CPU of its own and ahead of the DSP work
+        esc_thread::thread_config writer_thread = thread;
+        writer_thread.cpus.clear();
+        if (not config.ring_cpus.empty())
+            writer_thread.cpus.push_back(config.ring_cpus[p.data.rx_channel % config.ring_cpus.size()]);
+        if (writer_thread.priority > 0)
+            writer_thread.priority = std::min(writer_thread.priority + 1, 99);
+        ring_running = true;
+        ring_writer  = std::thread(run_ring_writer, std::ref(p), std::ref(*ring), writer_thread, std::ref(ring_running));
+        std::cout << boost::format("RX %d IQ ring: %d samples, %f ms") % p.data.rx_channel
+                         % ring->get_capacity() % (ring->get_capacity() / p.rate * 1e3)
+                  << std::endl;
+    }
+    // the pulse detector keeps up with the full rate only on a core of its own
+    std::atomic<bool> pulse_running(false);
+    std::thread pulse_detector;
+    std::vector<esc_pulse::pulse_train> trains;
+    if (p.pulses) {
+        esc_thread::thread_config detector_thread = thread;
+        detector_thread.cpus.clear();
+        if (not config.pulse_cpus.empty())
+            detector_thread.cpus.push_back(config.pulse_cpus[p.data.rx_channel % config.pulse_cpus.size()]);
+        pulse_running  = true;
+        pulse_detector = std::thread(run_pulse_detector, std::ref(p), std::ref(*ring), std::cref(config.pulse),
+            detector_thread, std::ref(pulse_running));
+    }
+    int64_t frame_time_us = 0;
+
     //Create issue stream command asking for buf samples
     uhd::stream_cmd_t stream_cmd_normal(uhd::stream_cmd_t::STREAM_MODE_NUM_SAMPS_AND_MORE);
-    stream_cmd_normal.num_samps = size_t(buff.size());
+    stream_cmd_normal.num_samps = buff_len;
     stream_cmd_normal.stream_now = true;
     stream_cmd_normal.time_spec  = uhd::time_spec_t();
 
     //Create issue stream command asking for buf samples
     uhd::stream_cmd_t stream_cmd_detect(uhd::stream_cmd_t::STREAM_MODE_NUM_SAMPS_AND_MORE);
-    stream_cmd_detect.num_samps = size_t(detect_buff.size());
+    stream_cmd_detect.num_samps = detect_len;
     stream_cmd_detect.stream_now = true;
     stream_cmd_detect.time_spec  = uhd::time_spec_t();
 
-    auto next_refresh = high_resolution_clock::now();
-    auto data_sent_time = high_resolution_clock::now();
-    auto iq_data_sent_time = high_resolution_clock::now();
     auto observe_time = high_resolution_clock::now();
+    esc_dft::log_pwr_dft_type zoom_spectrum;
+
+    // the scheduler owns the periodic work, the loop sleeps until its next deadline
+    esc_scheduler::deadline_scheduler scheduler;
+    bool frame_due = false;
+    bool iq_ready  = true;
+    #if STATS
+    long last_faults = 0;
+    #endif
+    const size_t frame_task = scheduler.add_periodic("frame", esc_scheduler::rate_to_period(config.frame_rate), [&] {
+        frame_due = true;
+    });
+    scheduler.add_periodic("report", esc_scheduler::rate_to_period(config.report_rate), [&] {
+        #if DEBUG
+        //Now send the data to the server
+        printf("Sending power meas");
+        #endif
+        // occupancy reports stand in for the power snapshots, the aggregator still needs them
+        if (not p.occupancy or aggregator)
+            post_power_data(p.data, opensas_url + "measurements");
+        if (p.pulses) {
+            p.pulses->get_trains(ring->get_head(), trains);
+            if (not trains.empty())
+                post_pulse_data(p.data, trains, opensas_url + "pulses");
+        }
+        #if STATS
+        // minor faults of this thread since the last report, zero once the buffers are warm
+        struct rusage usage;
+        getrusage(RUSAGE_THREAD, &usage);
+        std::cout << "RX " << p.data.rx_channel << " page faults: " << usage.ru_minflt - last_faults << std::endl;
+        last_faults = usage.ru_minflt;
+        #endif
+    }, false);
+    const size_t iq_holdoff_task = scheduler.add_oneshot("iq holdoff", [&] {
+        iq_ready = true;
+    });
+    scheduler.add_periodic("history", esc_scheduler::rate_to_period(config.history_rate), [&] {
+        p.history->commit(unix_time_us());
+    }, false);
+    esc_occupancy::occupancy_report occupancy_report;
+    if (p.occupancy) {
+        scheduler.add_periodic("occupancy", esc_scheduler::rate_to_period(1 / config.occupancy.period), [&] {
+            if (p.occupancy->report(occupancy_report))
+                post_occupancy_data(p.data, occupancy_report, config.occupancy, opensas_url + "occupancy");
+        }, false);
+    }
+    esc_bin_stats::stats_snapshot bin_snapshot;
+    if (p.bin_stats) {
+        scheduler.add_periodic("bin stats", esc_scheduler::rate_to_period(1 / config.bin_stats_window), [&] {
+            #if STATS
+            auto snapshot_time = high_resolution_clock::now();
+            #endif
+            if (not p.bin_stats->snapshot(bin_snapshot))
+                return;
+            #if STATS
+            std::cout << "Bin stats snapshot time: " << std::chrono::duration_cast<std::chrono::microseconds>(high_resolution_clock::now() - snapshot_time).count() << " us" << std::endl;
+            #endif
+            post_bin_stats_data(p.data, bin_snapshot, opensas_url + "spectrum_stats");
+        }, false);
+    }
+
+    // load shedding, the health of every second moves the pipeline along the degradation ladder
+    esc_load_shed::load_controller shed(config.shed);
+    size_t frame_count   = 0;
+    size_t overflows     = 0;
+    size_t last_overruns = 0;
+    size_t last_dropped  = uploads.get_dropped();
+    size_t last_ring_lost = 0;
+    double busy_time     = 0; // seconds spent on frames since the last evaluation
+    double last_cpu_time = 0;
+    auto frame_start     = high_resolution_clock::now();
+    bool in_frame        = false;
+    auto last_evaluation = high_resolution_clock::now();
+    if (config.load_shed) {
+        scheduler.add_periodic("load", esc_scheduler::rate_to_period(1), [&] {
+            const auto now        = high_resolution_clock::now();
+            const double interval = std::chrono::duration<double>(now - last_evaluation).count();
+            last_evaluation       = now;
+            struct rusage usage;
+            getrusage(RUSAGE_THREAD, &usage);
+            const double cpu_time = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+                                    + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+            const size_t overruns = scheduler.get_overruns(frame_task);
+
+            esc_load_shed::health_sample health;
+            health.overflows = overflows;
+            if (ring) {
+                // ring overflows and samples dropped behind a frozen window, only their change matters
+                const size_t lost = ring->get_overflows() + ring->get_dropped();
+                health.overflows += lost - last_ring_lost;
+                last_ring_lost    = lost;
+            }
+            health.dropped   = uploads.get_dropped() - last_dropped;
+            health.queue     = double(uploads.get_depth()) / uploads.get_max_depth();
+            // without a frame rate the loop runs flat out, its busy and CPU time say nothing
+            if (config.frame_rate > 0) {
+                health.busy   = busy_time / interval;
+                health.cpu    = (cpu_time - last_cpu_time) / interval;
+                health.missed = std::min(1.0, (overruns - last_overruns) / (interval * config.frame_rate));
+            }
+            overflows      = 0;
+            last_dropped  += health.dropped;
+            busy_time      = 0;
+            last_cpu_time  = cpu_time;
+            last_overruns  = overruns;
+
+            const size_t level = shed.get_level();
+            if (shed.update(health)) {
+                std::cout << boost::format("RX %d load %.2f (%s): %s -> %s") % p.data.rx_channel
+                                 % shed.get_load() % shed.get_signal()
+                                 % esc_load_shed::get_level_name(level)
+                                 % esc_load_shed::get_level_name(shed.get_level())
+                          << std::endl;
+            }
+        }, false);
+    }
 
 #if STATS
     auto detection_stats_time = high_resolution_clock::now();
@@ -302,25 +1082,51 @@ int UHD_SAFE_MAIN(int argc, char* argv[])
     //-- Main loop
     //------------------------------------------------------------------
     
-    int i = 0;
-    bool new_data_available = false;
-
-    //Wait 20 us before starting to stream
-    while (high_resolution_clock::now() < next_refresh + std::chrono::microseconds(20)) {
-        continue;
-    }
-    //Verify the waiting time was correct
-    auto duration = high_resolution_clock::now() - next_refresh;
-    std::cout << "Verifying timing (20us): " << duration.count() / 1000 << " us" << std::endl;
-    
-    while (true) {
-        //Tell USRP to only stream x amount of samples until asked again.
-        rx_stream->issue_stream_cmd(stream_cmd_normal);
-
-        // read a buffer's worth of samples every iteration
-        size_t num_rx_samps = rx_stream->recv(&buff.front(), buff.size(), md);
-        if (num_rx_samps != buff.size())
+    while (not stop_requested) {
+        if (in_frame) {
+            busy_time += std::chrono::duration<double>(high_resolution_clock::now() - frame_start).count();
+            in_frame = false;
+        }
+        scheduler.wait();
+        scheduler.run_due();
+        if (not frame_due)
+            continue;
+        frame_due = false;
+        // shed frames by leaving frame periods out, the frame task keeps its cadence
+        if (frame_count++ % esc_load_shed::get_frame_divisor(shed.get_level()) != 0)
             continue;
+        frame_start = high_resolution_clock::now();
+        in_frame    = true;
+
+        size_t num_rx_samps = 0;
+        if (ring) {
+            // the newest frame in the ring, never one that overlaps the last
+            const uint64_t end = ring->read_latest(buff, buff_len, frame_end, 1.0);
+            if (end != 0) {
+                frame_end     = end;
+                frame_time_us = unix_time_us();
+                num_rx_samps  = buff_len;
+            }
+        } else {
+            //Tell USRP to only stream x amount of samples until asked again, once a retune has settled
+            const double held = p.tuner->issue_stream_cmd(stream_cmd_normal);
+            frame_time_us     = unix_time_us() + int64_t(held * 1e6);
+
+            // read until the buffer is full, only a stream timeout gives up on it
+            while (num_rx_samps < buff_len) {
+                num_rx_samps += p.rx_stream->recv(&buff[num_rx_samps], buff_len - num_rx_samps, md, 1.0);
+                if (md.error_code == uhd::rx_metadata_t::ERROR_CODE_TIMEOUT)
+                    break;
+                if (md.error_code == uhd::rx_metadata_t::ERROR_CODE_OVERFLOW)
+                    overflows++;
+                if (md.error_code != uhd::rx_metadata_t::ERROR_CODE_NONE)
+                    std::cerr << "RX " << p.data.rx_channel << ": " << md.strerror() << std::endl;
+            }
+        }
+        if (num_rx_samps != buff_len) {
+            std::cerr << "RX " << p.data.rx_channel << ": timeout while streaming" << std::endl;
+            continue;
+        }
 
         #if DEBUG
         // Print the first 10 IQ samples
@@ -331,26 +1137,12 @@ int UHD_SAFE_MAIN(int argc, char* argv[])
         }
         #endif
 
-        // // check and update the display refresh condition
-        if (high_resolution_clock::now() < next_refresh) {
-            continue;
-        }
-        next_refresh = high_resolution_clock::now()
-                       + std::chrono::microseconds(int64_t(1e6 / frame_rate));
-
         #if STATS_FFT
         fft_stats_time = high_resolution_clock::now();
         #endif
-        // calculate the dft
-        esc_dft::log_pwr_dft_type lpdft(
-            esc_dft::log_pwr_dft(&buff.front(), num_rx_samps));
-
-        // re-order the dft so dc in in the center
-        const size_t len = lpdft.size() - 1 + lpdft.size() % 2; // make it odd
-        esc_dft::log_pwr_dft_type dft(len);
-        for (size_t n = 0; n < len; n++) {
-            dft[n] = lpdft[(n + len / 2) % len];
-        }
+        // the centered power spectrum in linear units, channel powers only go to dB per channel
+        const size_t len = num_rx_samps;
+        pwr_dft.compute(buff, dft);
         #if STATS_FFT
         auto fft_stats_duration = (high_resolution_clock::now() - fft_stats_time);
         std::cout << "FFT time: "  << fft_stats_duration.count() / 1000 << " us" << std::endl;
@@ -375,249 +1167,450 @@ int UHD_SAFE_MAIN(int argc, char* argv[])
         //     set_center_frequency(freq, usrp, vm);
         // }
         // check if any channels are above the threshold
+        const float* spectrum  = dft;
+        size_t spectrum_len    = len;
+        const double buff_freq = p.freq; // the sweep moves p.freq on
+
+        if (p.sweep) {
+            // stitch this step, move on once the dwell is complete and
+            // detect on the composite spectrum once per sweep cycle
+            if (not p.sweep->add_frame(dft))
+                continue;
+            const double step_freq = p.freq;
+            const bool cycle_done  = p.sweep->advance();
+            p.freq = p.sweep->get_current_freq();
+            if (p.freq != step_freq) {
+                auto retune_time = high_resolution_clock::now();
+                set_center_frequency(p.freq, p);
+                p.sweep->record_retune(p.freq - step_freq,
+                    std::chrono::duration<double>(high_resolution_clock::now() - retune_time).count());
+            }
+            if (not cycle_done)
+                continue;
+            #if STATS
+            std::cout << "Sweep cycle time: "  << int64_t(p.sweep->get_cycle_time() * 1e6) << " us" << std::endl;
+            #endif
+            spectrum     = p.sweep->get_composite_linear().data();
+            spectrum_len = p.sweep->get_num_composite_bins();
+        }
 
-        int detect_channel = compute_average_on_bins(dft.data(), len);
+        p.history->add(spectrum);
+        if (p.bin_stats)
+            p.bin_stats->add(spectrum, frame_time_us);
+
+        int detect_channel = compute_average_on_bins(*p.plan, *p.cfar, p.data, spectrum, spectrum_len);
+
+        // pulse trains detect channels whose short pulses the spectrum frames miss
+        uint64_t pulse_trigger = 0;
+        if (p.pulses) {
+            p.pulses->get_trains(ring->get_head(), trains);
+            for (size_t i = 0; i < trains.size(); i++)
+                p.data.detected[trains[i].channel] = true;
+            if (detect_channel < 0 and not trains.empty()) {
+                detect_channel = int(trains.front().channel);
+                pulse_trigger  = trains.front().last;
+            }
+        }
+
+        if (p.occupancy)
+            p.occupancy->update(p.data.detected, frame_time_us);
+
+        if (p.shm) {
+            for (size_t n = 0; n < spectrum_len; n++)
+                spectrum_db[n] = 10 * std::log10(spectrum[n]);
+            p.shm->publish(unix_time_us(), spectrum_db.data(), p.data.channel_pwr, p.data.detected, detect_channel);
+        }
 
         #if DEBUG
         //print detect channel
         std::cout << "Detect channel: " << detect_channel << std::endl;
         #endif
 
-        if(detect_channel < 0){
-            if(high_resolution_clock::now() > data_sent_time){
-                data_sent_time  = high_resolution_clock::now()
-                        + std::chrono::microseconds(int64_t(250e3));
-                #if DEBUG
-                //Now send the data to the server
-                printf("Sending power meas");
-                #endif
-                post_power_data(data, opensas_url + "measurements");
-            }
-        }
-        else{
+        if(detect_channel >= 0){
             auto detection_stats_duration = (high_resolution_clock::now() - detection_stats_time);
            
             //while observe time is not reached, keep looking for signals
-            if(high_resolution_clock::now() > iq_data_sent_time){
+            if(iq_ready){
                 
+                p.data.detect_time_us = unix_time_us();
+                const bool defer_uploads = shed.get_level() >= esc_load_shed::LEVEL_DEFER_UPLOADS;
                 size_t num_rx_detect_samps = 0;
-                //Change center frequency to the detected channel
-                #if STATS
-                detection_stats_time = high_resolution_clock::now();
-                #endif
-                set_center_frequency(get_center_freq(detect_channel), usrp, vm);
-                #if STATS
-                detection_stats_duration = (high_resolution_clock::now() - detection_stats_time);
-                std::cout << "Freq shift time ch" << detect_channel << ": "  << detection_stats_duration.count() / 1000 << " us" << std::endl;
-                #endif
-                //Change sample rate to 10.24 MHz to capture 1 ms of data for the detected channel
-                
-                std::cout << boost::format("Setting RX Rate: %f Msps...") % (10.24e6 / 1e6) << std::endl;
-                #if STATS
-                detection_stats_time = high_resolution_clock::now();
-                #endif
-                usrp->set_rx_rate(10.24e6);
-                #if STATS
-                detection_stats_duration = (high_resolution_clock::now() - detection_stats_time);
-                std::cout << "Srate change time: "  << detection_stats_duration.count() / 1000 << " us" << std::endl;
-                #endif
-                std::cout << boost::format("Actual RX Rate: %f Msps...") % (usrp->get_rx_rate() / 1e6)
-                        << std::endl
-                        << std::endl;
-                 // Set observe time to 100 ms ahead of current time
-                observe_time = high_resolution_clock::now();
-                auto observe_duration = (high_resolution_clock::now() - observe_time);
-                while((observe_duration.count() /1000) < 1000e3){
+                //Upload what the detected channel looked like before the detection
+                if (config.backfill > 0) {
+                    const int64_t now_us = unix_time_us();
+                    const double chan_freq = p.plan->get_center_freq(detect_channel);
+                    const double chan_bw   = p.plan->get_bandwidth(detect_channel);
+                    post_history_data(p.data,
+                        p.history->query(now_us - int64_t(config.backfill * 1e6), now_us,
+                            chan_freq - chan_bw / 2, chan_freq + chan_bw / 2),
+                        detect_channel, opensas_url + "history", defer_uploads);
+                }
+                //Look closer at the detected channel in the wideband frame, when the frame covers it
+                if (p.zoom and not defer_uploads) {
+                    const double chan_start = p.plan->get_center_freq(detect_channel)
+                                              - p.plan->get_bandwidth(detect_channel) / 2;
+                    const double chan_stop  = chan_start + p.plan->get_bandwidth(detect_channel);
+                    if (chan_start >= buff_freq - p.rate / 2 and chan_stop <= buff_freq + p.rate / 2) {
+                        #if STATS
+                        detection_stats_time = high_resolution_clock::now();
+                        #endif
+                        p.zoom->set_band(p.rate, chan_start - buff_freq, chan_stop - buff_freq);
+                        p.zoom->compute(buff, zoom_spectrum);
+                        #if STATS
+                        detection_stats_duration = (high_resolution_clock::now() - detection_stats_time);
+                        std::cout << "Zoom time: "  << detection_stats_duration.count() / 1000 << " us" << std::endl;
+                        #endif
+                        post_zoom_data(p.data, zoom_spectrum, chan_start, p.zoom->get_bin_width(),
+                            detect_channel, opensas_url + "zoom");
+                    }
+                }
+                if (ring) {
+                    //The evidence is the wideband stream around the frame or the pulse that triggered, no retune needed
+                    const uint64_t trigger = pulse_trigger ? pulse_trigger : frame_end - buff_len;
+                    const uint64_t pre     = std::min(trigger, uint64_t(config.pre_trigger * p.rate));
+                    const size_t window_len = size_t(pre + config.post_trigger * p.rate);
                     #if STATS
                     detection_stats_time = high_resolution_clock::now();
                     #endif
-                    num_rx_detect_samps = 0;
-                    rx_stream->issue_stream_cmd(stream_cmd_detect);
-                    while (num_rx_detect_samps < detect_buff.size()) {
-                        // Wait for the next buffer of samples
-                        num_rx_detect_samps += rx_stream->recv(&detect_buff.front(), detect_buff.size(), md);
-                        // Print the number of samples received
-                        std::cout << "Received " << num_rx_detect_samps << " samples" << std::endl;
-                        if (num_rx_samps != detect_buff.size())
-                            continue;
+                    const std::complex<float>* window = ring->freeze(trigger - pre, window_len);
+                    if (window and ring->wait_for(trigger - pre + window_len - 1, 1.0)) {
+                        #if STATS
+                        detection_stats_duration = (high_resolution_clock::now() - detection_stats_time);
+                        std::cout << "Trigger window time: "  << detection_stats_duration.count() / 1000 << " us" << std::endl;
+                        #endif
+                        const iq_capture capture = {window, window_len, p.rate, buff_freq,
+                            frame_time_us - int64_t((double(frame_end) - double(trigger - pre)) / p.rate * 1e6)};
+                        bool upload_iq = true;
+                        if (p.classifier) {
+                            #if STATS
+                            detection_stats_time = high_resolution_clock::now();
+                            #endif
+                            esc_classifier::classification result = p.classifier->classify(
+                                capture.samples, capture.len, capture.rate);
+                            p.data.signal[detect_channel]     = result.label;
+                            p.data.confidence[detect_channel] = result.confidence;
+                            upload_iq = result.confidence < config.classify_confidence;
+                            #if STATS
+                            detection_stats_duration = (high_resolution_clock::now() - detection_stats_time);
+                            std::cout << "Classify time: "  << detection_stats_duration.count() / 1000 << " us" << std::endl;
+                            #endif
+                        }
+                        post_power_data(p.data, opensas_url + "measurements");
+                        if (upload_iq and p.codec)
+                            post_iq_data_bfp(p.data, *p.codec, capture, detect_channel, opensas_url + "samples", defer_uploads);
+                        else if (upload_iq)
+                            post_iq_data_nocurl(p.data, capture, detect_channel, opensas_url + "samples", defer_uploads);
+                    } else {
+                        std::cerr << "RX " << p.data.rx_channel << ": trigger window lost, the IQ ring is too small" << std::endl;
                     }
+                    if (window)
+                        ring->release();
+                } else {
+                    //Change center frequency to the detected channel and the sample rate to 10.24 MHz to capture 1 ms of data,
+                    //one batch of timed commands that also starts the first capture once the LO has settled
+                    std::cout << boost::format("Setting RX Rate: %f Msps...") % (detect_rate / 1e6) << std::endl;
+                    #if STATS
+                    detection_stats_time = high_resolution_clock::now();
+                    #endif
+                    const uhd::time_spec_t detect_start = p.tuner->retune(
+                        p.plan->get_center_freq(detect_channel), detect_rate, &stream_cmd_detect);
+                    int64_t capture_time_us = unix_time_us() + int64_t(p.tuner->time_until(detect_start) * 1e6);
                     #if STATS
                     detection_stats_duration = (high_resolution_clock::now() - detection_stats_time);
-                    std::cout << "Samples recv time: "  << detection_stats_duration.count() / 1000 << " us" << std::endl;
+                    std::cout << "Freq shift time ch" << detect_channel << ": "  << detection_stats_duration.count() / 1000 << " us" << std::endl;
+                    std::cout << "Tune settle time: " << int64_t(p.tuner->measure_settle() * 1e6) << " us" << std::endl;
                     #endif
-                    //Calculate FFT on 512 samples in detect_buff
-                    // calculate the dft
-                    // esc_dft::log_pwr_dft_type detect_dft(
-                    //     esc_dft::log_pwr_dft(&detect_buff.front(), 512));
-                    post_power_data(data, opensas_url + "measurements");
-
-                    //Check if the average of all bins is above the threshold
-                    //Compute average on all bins without using compute_average_on_bins function
-                    // int64_t average = 0;
-                    // for(int i = 0; i < detect_dft.size(); i++){
-                    //     average = (average + detect_dft[i])/2;
-                    // }
-                    // std::cout << "Detected average: " << average << std::endl;
-                    //If average is above threshold, send the data to the server
-                    // if(average > DETECTION_THRESHOLD){
+                    std::cout << boost::format("Actual RX Rate: %f Msps...") % (p.tuner->get_rate() / 1e6)
+                            << std::endl
+                            << std::endl;
+                     // Set observe time to 100 ms ahead of current time
+                    observe_time = high_resolution_clock::now();
+                    auto observe_duration = (high_resolution_clock::now() - observe_time);
+                    bool detect_issued = true; // the retune issued the first capture
+                    while((observe_duration.count() /1000) < 1000e3){
                         #if STATS
                         detection_stats_time = high_resolution_clock::now();
                         #endif
-                        post_iq_data_nocurl(detect_buff, detect_buff.size(), detect_channel, opensas_url + "samples");
+                        num_rx_detect_samps = 0;
+                        if (not detect_issued) {
+                            capture_time_us = unix_time_us();
+                            p.tuner->issue_stream_cmd(stream_cmd_detect);
+                        }
+                        detect_issued = false;
+                        while (num_rx_detect_samps < detect_len) {
+                            // Wait for the next buffer of samples, behind the ones already received
+                            num_rx_detect_samps += p.rx_stream->recv(
+                                detect_buff + num_rx_detect_samps, detect_len - num_rx_detect_samps, md, 1.0);
+                            // Print the number of samples received
+                            std::cout << "Received " << num_rx_detect_samps << " samples" << std::endl;
+                            // a late command, a timeout or an overflow ends this capture, the next one is issued again
+                            if (md.error_code != uhd::rx_metadata_t::ERROR_CODE_NONE) {
+                                std::cerr << "RX " << p.data.rx_channel << ": " << md.strerror() << std::endl;
+                                break;
+                            }
+                        }
+                        if (num_rx_detect_samps != detect_len) {
+                            observe_duration = (high_resolution_clock::now() - observe_time);
+                            continue;
+                        }
                         #if STATS
                         detection_stats_duration = (high_resolution_clock::now() - detection_stats_time);
-                        std::cout << "Https req time: "  << detection_stats_duration.count() / 1000 << " us" << std::endl;
+                        std::cout << "Samples recv time: "  << detection_stats_duration.count() / 1000 << " us" << std::endl;
                         #endif
-                    // }
-                    observe_duration = (high_resolution_clock::now() - observe_time);
-                    //Print observe duration
-                    std::cout << "Observe duration: " << observe_duration.count() / 1000 << " us" << std::endl;
-                }
+                        //Calculate FFT on 512 samples in detect_buff
+                        // calculate the dft
+                        // esc_dft::log_pwr_dft_type detect_dft(
+                        //     esc_dft::log_pwr_dft(&detect_buff.front(), 512));
+
+                        //Classify the capture on the node, raw IQ is only needed when the classifier is unsure
+                        bool upload_iq = true;
+                        if (p.classifier) {
+                            #if STATS
+                            detection_stats_time = high_resolution_clock::now();
+                            #endif
+                            esc_classifier::classification result = p.classifier->classify(
+                                detect_buff, detect_len, p.tuner->get_rate());
+                            p.data.signal[detect_channel]     = result.label;
+                            p.data.confidence[detect_channel] = result.confidence;
+                            upload_iq = result.confidence < config.classify_confidence;
+                            #if STATS
+                            detection_stats_duration = (high_resolution_clock::now() - detection_stats_time);
+                            std::cout << "Classify time: "  << detection_stats_duration.count() / 1000 << " us" << std::endl;
+                            #endif
+                        }
+                        post_power_data(p.data, opensas_url + "measurements");
+
+                        //Check if the average of all bins is above the threshold
+                        //Compute average on all bins without using compute_average_on_bins function
+                        // int64_t average = 0;
+                        // for(int i = 0; i < detect_dft.size(); i++){
+                        //     average = (average + detect_dft[i])/2;
+                        // }
+                        // std::cout << "Detected average: " << average << std::endl;
+                        //If average is above threshold, send the data to the server
+                        // if(average > threshold){
+                        const iq_capture capture = {detect_buff, detect_len, p.tuner->get_rate(),
+                            p.plan->get_center_freq(detect_channel), capture_time_us};
+                        if (upload_iq and p.codec)
+                            post_iq_data_bfp(p.data, *p.codec, capture, detect_channel, opensas_url + "samples", defer_uploads);
+                        else if (upload_iq)
+                            post_iq_data_nocurl(p.data, capture, detect_channel, opensas_url + "samples", defer_uploads);
+                        // }
+                        //Under load one capture is enough, the scan has to go on
+                        if (shed.get_level() >= esc_load_shed::LEVEL_SHORT_OBSERVE)
+                            break;
+                        observe_duration = (high_resolution_clock::now() - observe_time);
+                        //Print observe duration
+                        std::cout << "Observe duration: " << observe_duration.count() / 1000 << " us" << std::endl;
+                    }
 
-                //Change sample rate back to 122.88 MHz
-                std::cout << boost::format("Setting RX Rate: %f Msps...") % (122.88e6 / 1e6) << std::endl;
-                usrp->set_rx_rate(122.88e6);
-                std::cout << boost::format("Actual RX Rate: %f Msps...") % (usrp->get_rx_rate() / 1e6)
-                        << std::endl
-                        << std::endl;
-                if(!observe)
-                    iq_data_sent_time  = high_resolution_clock::now()
-                        + std::chrono::microseconds(int64_t(50e3));
-                #if STATS
-                detection_stats_time = high_resolution_clock::now();
-                #endif
-                set_center_frequency(3650e6, usrp, vm);
-                #if STATS
-                detection_stats_duration = (high_resolution_clock::now() - detection_stats_time);
-                std::cout << "Freq return time: "  << detection_stats_duration.count() / 1000 << " us" << std::endl;
-                #endif
+                    //Change sample rate and center frequency back to the scan, the next frame waits for them to settle
+                    std::cout << boost::format("Setting RX Rate: %f Msps...") % (p.rate / 1e6) << std::endl;
+                    #if STATS
+                    detection_stats_time = high_resolution_clock::now();
+                    #endif
+                    set_center_frequency(p.freq, p);
+                    std::cout << boost::format("Actual RX Rate: %f Msps...") % (p.tuner->get_rate() / 1e6)
+                            << std::endl
+                            << std::endl;
+                    if (p.sweep)
+                        p.sweep->restart_step();
+                    #if STATS
+                    detection_stats_duration = (high_resolution_clock::now() - detection_stats_time);
+                    std::cout << "Freq return time: "  << detection_stats_duration.count() / 1000 << " us" << std::endl;
+                    #endif
+                }
+                if(!config.observe){
+                    iq_ready = false;
+                    scheduler.arm(iq_holdoff_task, esc_scheduler::clock_type::now()
+                        + std::chrono::duration_cast<esc_scheduler::clock_type::duration>(
+                            std::chrono::duration<double>(esc_load_shed::get_iq_holdoff(shed.get_level(), config.iq_holdoff))));
+                }
                 
             }
         }
     }
 
-    //------------------------------------------------------------------
-    //-- Cleanup
-    //------------------------------------------------------------------
-    rx_stream->issue_stream_cmd(uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS);
-    endwin(); // curses done
 
-    // finished
-    std::cout << std::endl << "Done!" << std::endl << std::endl;
+    if (p.pulses) {
+        pulse_running = false;
+        pulse_detector.join();
+    }
+    if (ring) {
+        ring_running = false;
+        ring_writer.join();
+    }
+    p.rx_stream->issue_stream_cmd(uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS);
+}
 
-    return EXIT_SUCCESS;
+/*
+Streams one RX channel continuously into its IQ ring, runs on its own thread next to the pipeline,
+what arrives while a frozen window is in the way is received into scratch and dropped
+*/
+void run_ring_writer(rx_pipeline& p, esc_iq_ring::iq_ring& ring, esc_thread::thread_config thread, std::atomic<bool>& running){
+    std::cout << esc_thread::apply_thread_config("esc_ring" + std::to_string(p.data.rx_channel), thread)
+              << std::endl;
+    std::vector<std::complex<float>> scratch(ring_chunk);
+    uhd::rx_metadata_t md;
+    uhd::stream_cmd_t stream_cmd(uhd::stream_cmd_t::STREAM_MODE_START_CONTINUOUS);
+    stream_cmd.stream_now = true;
+    stream_cmd.time_spec  = uhd::time_spec_t();
+    p.rx_stream->issue_stream_cmd(stream_cmd);
+
+    while (running) {
+        size_t room = ring_chunk;
+        std::complex<float>* dest = ring.begin_write(room);
+        const size_t num_rx_samps = dest ? p.rx_stream->recv(dest, room, md, 0.1)
+                                         : p.rx_stream->recv(&scratch.front(), scratch.size(), md, 0.1);
+        if (md.error_code == uhd::rx_metadata_t::ERROR_CODE_OVERFLOW)
+            ring.overflow();
+        else if (md.error_code != uhd::rx_metadata_t::ERROR_CODE_NONE
+                 and md.error_code != uhd::rx_metadata_t::ERROR_CODE_TIMEOUT)
+            std::cerr << "RX " << p.data.rx_channel << ": " << md.strerror() << std::endl;
+        if (dest)
+            ring.end_write(num_rx_samps);
+        else
+            ring.drop(num_rx_samps);
+    }
+    p.rx_stream->issue_stream_cmd(uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS);
 }
 
 /*
-Computes average on fft points - start_point - end_point_offset bins excluding start_point bins at the beginning and end_point_offset bins at the end, returns -1 if no bins are above threshold,
-else returns the index of channel with power above threshold 
+Runs the pulse detector on every sample of the IQ ring, on its own thread close behind the writer.
+Every pulse is placed in a channel by the peak of a short DFT around it and added to the pulse trains
 */
-int compute_average_on_bins(float *dft, size_t len){
-    // Calculate number of averages we want to take
-    int num_averages = 15;
-    int channel_offset = 5;
-    int skip_steps = 1;
-    int start_point = 10;
-    int end_point_offset = 10;
-    int detect_channel = -1;
-    float max = -100;
-    // Calculate average of first 34 elements
-    int step = 41;
-    float temp_avg = 0;
-
-    for (int i = channel_offset; i < num_averages-1; i++) {
-        double sum = 0;
-        for (int j = ((i - channel_offset + skip_steps)  * step) + start_point; j < (i + 1 - channel_offset + skip_steps) * step + start_point; j++) {
-            sum = sum + dft[j];
+void run_pulse_detector(rx_pipeline& p, esc_iq_ring::iq_ring& ring, const esc_pulse::pulse_config& config, esc_thread::thread_config thread, std::atomic<bool>& running){
+    std::cout << esc_thread::apply_thread_config("esc_pulse" + std::to_string(p.data.rx_channel), thread)
+              << std::endl;
+    esc_pulse::envelope_detector detector(config, p.rate);
+    esc_dft::pwr_dft<float> pulse_dft(pulse_dft_len);
+    std::vector<float> pulse_spectrum(pulse_dft_len);
+    std::vector<esc_pulse::pulse> pulses;
+    std::vector<int> channels;
+    uint64_t next = ring.get_head();
+
+    while (running) {
+        if (not ring.wait_for(next, 0.1))
+            continue;
+        const uint64_t head = ring.get_head();
+        // half a ring behind the writer is too close to losing samples, skip to the newest
+        if (head - next > ring.get_capacity() / 2) {
+            std::cerr << boost::format("RX %d pulse detector behind, %d samples skipped") % p.data.rx_channel
+                             % (head - ring_chunk - next)
+                      << std::endl;
+            next = head - ring_chunk;
         }
-        temp_avg = sum / step;
-        // Use FFT_AVERAGES to determine the number of averages to take
-        data.channel_pwr[i] = (data.channel_pwr[i] * (num_avgs - 1) + temp_avg) / num_avgs;
-        #if DEBUG
-        std::cout << " Ch = " << i;
-        std::cout << " " << data.channel_pwr[i];
-        #endif
-        // Check if the average is above the threshold
-        if(data.channel_pwr[i] > DETECTION_THRESHOLD){
-            // Check if the average is greater than the max
-            if(data.channel_pwr[i] > max){
-                // Update the max and the channel
-                max = data.channel_pwr[i];
-                detect_channel = i;
+        const size_t n = size_t(std::min<uint64_t>(head - next, ring_chunk));
+        pulses.clear();
+        detector.process(ring.at(next), n, next, pulses);
+        channels.assign(pulses.size(), -1);
+        for (size_t i = 0; i < pulses.size(); i++) {
+            // the DFT centered on the pulse, within what has been written
+            const uint64_t center = pulses[i].start + pulses[i].width / 2;
+            const uint64_t first  = std::min(std::max(center, uint64_t(pulse_dft_len / 2)) - pulse_dft_len / 2,
+                next + n - pulse_dft_len);
+            pulse_dft.compute(ring.at(first), &pulse_spectrum.front());
+            const size_t peak = std::max_element(pulse_spectrum.begin(), pulse_spectrum.end()) - pulse_spectrum.begin();
+            channels[i] = p.plan->find_channel(p.freq + (double(peak) - double(pulse_dft_len / 2)) * p.rate / pulse_dft_len);
+        }
+        // pulses found in samples the writer came round to are not trusted
+        if (ring.holds(next)) {
+            for (size_t i = 0; i < pulses.size(); i++) {
+                if (channels[i] >= 0)
+                    p.pulses->add(size_t(channels[i]), pulses[i]);
             }
         }
+        next += n;
     }
+}
+
+/*
+Averages the dft bins (linear power) of every covered channel of the plan into data.channel_lin, converts
+those to dB in data.channel_pwr and runs the CFAR detector on the dft, returns -1 if no channel is busy,
+else returns the index of the strongest busy channel
+*/
+int compute_average_on_bins(const esc_channel_plan::channel_plan& plan, esc_cfar::cfar_detector& cfar, channel_data& data, const float *dft, size_t len){
+    if (len != plan.get_num_bins())
+        throw std::runtime_error("dft size does not match the channel plan");
 
-    // Calculate average of last "step" elements, excluding the last element
-    double sum = 0;
-    for (int i = len-(step * (skip_steps+1))-end_point_offset; i < len-(step * (skip_steps)) - end_point_offset; i++) {
-        sum += dft[i];
+    for (size_t i = 0; i < plan.size(); i++) {
+        if (not plan.is_covered(i))
+            continue;
+        float temp_avg = plan.reduce_channel(dft, i);
+        // Use FFT_AVERAGES to determine the number of averages to take
+        data.channel_lin[i] = (data.channel_lin[i] * (num_avgs - 1) + temp_avg) / num_avgs;
+        data.channel_pwr[i] = 10 * std::log10(data.channel_lin[i]);
     }
-    temp_avg = sum / step;
-    // Use FFT_AVERAGES to determine the number of averages to take
-    data.channel_pwr[num_averages-1] = (data.channel_pwr[num_averages-1] * (num_avgs - 1) + temp_avg) / num_avgs;
 
-    // Check if the last element is above the threshold
-    if(data.channel_pwr[num_averages-1] > DETECTION_THRESHOLD){
-        if(data.channel_pwr[num_averages-1] > max){
-            max = data.channel_pwr[num_averages-1];
-            detect_channel = num_averages-1;
+    cfar.process_linear(dft);
+    for (size_t i = 0; i < plan.size(); i++) {
+        data.detected[i] = cfar.is_detected(i);
+        if (not data.detected[i]) {
+            data.signal[i]     = "unknown";
+            data.confidence[i] = 0;
         }
+        #if DEBUG
+        std::cout << " Ch = " << i;
+        std::cout << " " << data.channel_pwr[i];
+        std::cout << " (" << cfar.get_excess(i) << " dB, " << cfar.get_occupancy(i) << ")";
+        #endif
     }
     #if DEBUG
-    std::cout << " Ch = " << 14;
-    std::cout << " " << data.channel_pwr[num_averages-1];
     std::cout << "\n";
     #endif
-    return detect_channel;
+    return cfar.get_strongest_channel();
 }
 
-/**
- * Calculates the center frequency in MHz for a given channel number.
- * 
- * @param channel The channel number, between 0 and 14 (inclusive).
- * @return The center frequency in MHz.
- */
-double get_center_freq(int channel) {
-    const double channelWidth = 10.0e6; // The width of each channel in MHz.
-    const double baseFreq = 3550.0e6; // The frequency of the first channel in MHz.
-    
-    // Calculate the center frequency of the specified channel using the formula:
-    // centerFreq = baseFreq + (channel * channelWidth) + (channelWidth / 2.0)
-    double centerFreq = baseFreq + (channel * channelWidth) + (channelWidth / 2.0);
-    
-    // Return the center frequency to the caller.
-    return centerFreq;
+//Function to retune to a center frequency at the scanning rate, as timed commands from the tune cache
+void set_center_frequency(double freq, const rx_pipeline& p){
+    p.tuner->retune(freq, p.rate);
+    std::cout << boost::format("RX Freq: %f MHz...\n") % (p.tuner->get_freq() / 1e6);
 }
 
-//Function to set the center frequency via the UHD driver
-void set_center_frequency(uint32_t freq, uhd::usrp::multi_usrp::sptr usrp, po::variables_map vm){
-    uhd::tune_request_t tune_request(freq);
-    if (vm.count("int-n"))
-        tune_request.args = uhd::device_addr_t("mode_n=integer");
-    usrp->set_rx_freq(tune_request);
-    std::cout << boost::format("RX Freq: %f MHz...\n") % (usrp->get_rx_freq() / 1e6);
+std::vector<std::string> split_list(const std::string& list){
+    std::vector<std::string> values;
+    if (list.empty())
+        return values;
+    boost::split(values, list, boost::is_any_of("\"',"));
+    values.erase(std::remove(values.begin(), values.end(), ""), values.end());
+    return values;
 }
 
-//Function to send HTTPS post request for all the power values
-void post_power_data(channel_data data, std::string url) {
+//Function to send HTTPS post request for all the power values, or to hand them to the aggregator
+void post_power_data(const channel_data& data, std::string url) {
+    if (aggregator) {
+        esc_aggregator::sensor_report report;
+        report.sensor_id   = SENSOR_ID;
+        report.rx_channel  = data.rx_channel;
+        report.lat         = data.lat;
+        report.lon         = data.lon;
+        report.time_us     = unix_time_us();
+        report.channel_pwr = data.channel_pwr;
+        report.detected    = data.detected;
+        report.signal      = data.signal;
+        report.confidence  = data.confidence;
+        if (not aggregator->send(report))
+            perror("ERROR sending report to the aggregator");
+        return;
+    }
+
     // Construct the JSON payload
     std::stringstream json_ss;
     json_ss << "{";
     json_ss << "\"sensor_id\":\"" << SENSOR_ID << "\"," ;
     json_ss << "\"lat\":" << data.lat << ",";
     json_ss << "\"lon\":" << data.lon << ",";
+    json_ss << "\"rx_channel\":" << data.rx_channel << ",";
+    json_ss << "\"time_us\":" << unix_time_us() << ",";
     json_ss << "\"channels\":[";
-    for (int i = 0; i < 14; i++) {
-        if(data.channel_pwr[i] > DETECTION_THRESHOLD)
-            json_ss << "{\"id\":" << i << ",\"power\":" << data.channel_pwr[i] << ",\"detected\":true,\"signal\":\"unknown\"},";
+    for (size_t i = 0; i < data.channel_pwr.size(); i++) {
+        if (i != 0)
+            json_ss << ",";
+        if(data.detected[i])
+            json_ss << "{\"id\":" << i << ",\"power\":" << data.channel_pwr[i] << ",\"detected\":true,\"signal\":\"" << data.signal[i] << "\",\"confidence\":" << data.confidence[i] << "}";
         else
-            json_ss << "{\"id\":" << i << ",\"power\":" << data.channel_pwr[i] << ",\"detected\":false,\"signal\":\"unknown\"},";
+            json_ss << "{\"id\":" << i << ",\"power\":" << data.channel_pwr[i] << ",\"detected\":false,\"signal\":\"unknown\"}";
     }
-    if(data.channel_pwr[14] > DETECTION_THRESHOLD)
-        json_ss << "{\"id\":14,\"power\":" << data.channel_pwr[14] << ",\"detected\":true,\"signal\":\"unknown\"}";
-    else
-        json_ss << "{\"id\":14,\"power\":" << data.channel_pwr[14] << ",\"detected\":false,\"signal\":\"unknown\"}";
     json_ss << "]}";
 
     std::string json_str = json_ss.str();
@@ -625,26 +1618,29 @@ void post_power_data(channel_data data, std::string url) {
     // Construct the curl command
     std::string command = "curl -X POST -H 'Content-Type: application/json' --data '" + json_str + "' --cert " + client_crt_path + " --key " + client_key_path + " --cacert " + ca_crt_path + " " + url;
 
-    post_json(json_str, url);
+    uploads.push(json_str, url);
 }
 
 /* 
 Function to send HTTPS post request for the IQ samples for further processing if a 
 power level is above a threshold.
 */
- void post_iq_data(std::vector<std::complex<float>>& buff, size_t len, uint8_t channel, std::string url){
+ void post_iq_data(const channel_data& data, const std::complex<float>* buff, size_t len, uint8_t channel, std::string url){
     std::stringstream json_ss;
     json_ss << "{";
     json_ss << "\"sensor_info\": {";
     json_ss << "\"sensor_id\":\"" << SENSOR_ID << "\"," ;
     json_ss << "\"lat\":" << data.lat << ",";
     json_ss << "\"lon\":" << data.lon << "},";
+    json_ss << "\"rx_channel\":" << data.rx_channel << ",";
     json_ss << "\"detected_channel\":" << (int)channel << ",";
+    json_ss << "\"detect_time_us\":" << data.detect_time_us << ",";
+    json_ss << "\"time_us\":" << unix_time_us() << ",";
     json_ss << "\"iq_samples\":[";
     for (int i = 0; i < len - 1; i++) {
-        json_ss << "[" << buff.at(i).real() << "," << buff.at(i).imag() << "],";
+        json_ss << "[" << buff[i].real() << "," << buff[i].imag() << "],";
     }
-    json_ss << "[" << buff.at(len - 1).real() << "," << buff.at(len - 1).imag() << "]";
+    json_ss << "[" << buff[len - 1].real() << "," << buff[len - 1].imag() << "]";
     json_ss << "]}";
 
     std::string json_str = json_ss.str();
@@ -670,19 +1666,29 @@ power level is above a threshold.
 /* 
 
  */
-void post_iq_data_nocurl(std::vector<std::complex<float>>& buff, size_t len, uint8_t channel, std::string url) {
+void post_iq_data_nocurl(const channel_data& data, const iq_capture& capture, uint8_t channel, std::string url, bool defer) {
+    const std::complex<float>* buff = capture.samples;
+    const size_t len                = capture.len;
     std::stringstream json_ss;
     json_ss << "{";
     json_ss << "\"sensor_info\": {";
     json_ss << "\"sensor_id\":\"" << SENSOR_ID << "\"," ;
     json_ss << "\"lat\":" << data.lat << ",";
     json_ss << "\"lon\":" << data.lon << "},";
+    json_ss << "\"rx_channel\":" << data.rx_channel << ",";
     json_ss << "\"detected_channel\":" << (int)channel << ",";
+    json_ss << "\"detect_time_us\":" << data.detect_time_us << ",";
+    json_ss << "\"time_us\":" << unix_time_us() << ",";
+    json_ss << std::setprecision(12);
+    json_ss << "\"center_freq\":" << capture.freq << ",";
+    json_ss << "\"sample_rate\":" << capture.rate << ",";
+    json_ss << std::setprecision(6);
+    json_ss << "\"capture_time_us\":" << capture.time_us << ",";
     json_ss << "\"iq_samples\":[";
-    for (int i = 0; i < len - 1; i++) {
-        json_ss << "[" << buff.at(i).real() << "," << buff.at(i).imag() << "],";
+    for (size_t i = 0; i < len - 1; i++) {
+        json_ss << "[" << buff[i].real() << "," << buff[i].imag() << "],";
     }
-    json_ss << "[" << buff.at(len - 1).real() << "," << buff.at(len - 1).imag() << "]";
+    json_ss << "[" << buff[len - 1].real() << "," << buff[len - 1].imag() << "]";
     json_ss << "]}";
 
     std::string json_str = json_ss.str();
@@ -695,10 +1701,327 @@ void post_iq_data_nocurl(std::vector<std::complex<float>>& buff, size_t len, uin
     //Print the JSON string
     // std::cout << json_str << std::endl;
 
-    post_json(json_str, url);
+    queue_upload(json_str, url, defer);
+}
+
+/*
+Function to send HTTPS post request for the IQ samples compressed with the block floating point codec,
+the stream layout is described in esc_iq_codec.hpp
+*/
+void post_iq_data_bfp(const channel_data& data, esc_iq_codec::bfp_codec& codec, const iq_capture& capture, uint8_t channel, std::string url, bool defer) {
+    #if STATS
+    auto codec_stats_time = high_resolution_clock::now();
+    #endif
+    std::vector<uint8_t> encoded;
+    codec.encode(capture.samples, capture.len, encoded);
+    #if STATS
+    auto codec_stats_duration = (high_resolution_clock::now() - codec_stats_time);
+    std::cout << "IQ encode time: "  << codec_stats_duration.count() / 1000 << " us" << std::endl;
+    #endif
+
+    std::stringstream json_ss;
+    json_ss << "{";
+    json_ss << "\"sensor_info\": {";
+    json_ss << "\"sensor_id\":\"" << SENSOR_ID << "\"," ;
+    json_ss << "\"lat\":" << data.lat << ",";
+    json_ss << "\"lon\":" << data.lon << "},";
+    json_ss << "\"rx_channel\":" << data.rx_channel << ",";
+    json_ss << "\"detected_channel\":" << (int)channel << ",";
+    json_ss << "\"detect_time_us\":" << data.detect_time_us << ",";
+    json_ss << "\"time_us\":" << unix_time_us() << ",";
+    json_ss << std::setprecision(12);
+    json_ss << "\"center_freq\":" << capture.freq << ",";
+    json_ss << "\"sample_rate\":" << capture.rate << ",";
+    json_ss << std::setprecision(6);
+    json_ss << "\"capture_time_us\":" << capture.time_us << ",";
+    json_ss << "\"iq_encoding\":\"bfp\",";
+    json_ss << "\"iq_bits\":" << codec.get_bits() << ",";
+    json_ss << "\"iq_block_len\":" << codec.get_block_len() << ",";
+    json_ss << "\"iq_data\":\"" << base64_encode(&encoded.front(), encoded.size()) << "\"";
+    json_ss << "}";
+
+    queue_upload(json_ss.str(), url, defer);
+}
+
+/*
+Function to send HTTPS post request for the spectrogram history of a detected channel, the
+quantized bins of every frame are sent base64 encoded with the frame offset and scale (dB = offset + scale * code)
+*/
+void post_history_data(const channel_data& data, const esc_history::history_slice& slice, uint8_t channel, std::string url, bool defer) {
+    if (slice.get_num_frames() == 0)
+        return;
+
+    std::stringstream json_ss;
+    json_ss << "{";
+    json_ss << "\"sensor_info\": {";
+    json_ss << "\"sensor_id\":\"" << SENSOR_ID << "\"," ;
+    json_ss << "\"lat\":" << data.lat << ",";
+    json_ss << "\"lon\":" << data.lon << "},";
+    json_ss << "\"rx_channel\":" << data.rx_channel << ",";
+    json_ss << "\"detected_channel\":" << (int)channel << ",";
+    json_ss << "\"detect_time_us\":" << data.detect_time_us << ",";
+    json_ss << std::setprecision(12);
+    json_ss << "\"first_freq\":" << slice.first_freq << ",";
+    json_ss << "\"bin_width\":" << slice.bin_width << ",";
+    json_ss << std::setprecision(6);
+    json_ss << "\"num_bins\":" << slice.num_bins << ",";
+    json_ss << "\"frames\":[";
+    for (size_t i = 0; i < slice.get_num_frames(); i++) {
+        if (i != 0)
+            json_ss << ",";
+        json_ss << "{\"time_us\":" << slice.time_us[i] << ",\"offset\":" << slice.offset[i]
+                << ",\"scale\":" << slice.scale[i] << ",\"codes\":\""
+                << base64_encode(&slice.codes[i * slice.num_bins], slice.num_bins) << "\"}";
+    }
+    json_ss << "]}";
+
+    queue_upload(json_ss.str(), url, defer);
 }
 
-void post_json(std::string json_str, std::string url) {
+/*
+Function to send HTTPS post request for the zoom spectrum of a detected channel,
+bin k is at first_freq + k * bin_width in Hz
+*/
+void post_zoom_data(const channel_data& data, const esc_dft::log_pwr_dft_type& zoom, double first_freq, double bin_width, uint8_t channel, std::string url) {
+    std::stringstream json_ss;
+    json_ss << "{";
+    json_ss << "\"sensor_info\": {";
+    json_ss << "\"sensor_id\":\"" << SENSOR_ID << "\"," ;
+    json_ss << "\"lat\":" << data.lat << ",";
+    json_ss << "\"lon\":" << data.lon << "},";
+    json_ss << "\"rx_channel\":" << data.rx_channel << ",";
+    json_ss << "\"detected_channel\":" << (int)channel << ",";
+    json_ss << "\"detect_time_us\":" << data.detect_time_us << ",";
+    json_ss << "\"time_us\":" << unix_time_us() << ",";
+    json_ss << std::setprecision(12);
+    json_ss << "\"first_freq\":" << first_freq << ",";
+    json_ss << "\"bin_width\":" << bin_width << ",";
+    json_ss << std::setprecision(4);
+    json_ss << "\"bins\":[";
+    for (size_t i = 0; i < zoom.size(); i++) {
+        if (i != 0)
+            json_ss << ",";
+        json_ss << zoom[i];
+    }
+    json_ss << "]}";
+
+    uploads.push(json_ss.str(), url);
+}
+
+/*
+Function to send HTTPS post request for the pulse trains of the channels
+*/
+void post_pulse_data(const channel_data& data, const std::vector<esc_pulse::pulse_train>& trains, std::string url) {
+    std::stringstream json_ss;
+    json_ss << "{";
+    json_ss << "\"sensor_id\":\"" << SENSOR_ID << "\"," ;
+    json_ss << "\"lat\":" << data.lat << ",";
+    json_ss << "\"lon\":" << data.lon << ",";
+    json_ss << "\"rx_channel\":" << data.rx_channel << ",";
+    json_ss << "\"time_us\":" << unix_time_us() << ",";
+    json_ss << "\"trains\":[";
+    for (size_t i = 0; i < trains.size(); i++) {
+        if (i != 0)
+            json_ss << ",";
+        json_ss << "{\"id\":" << trains[i].channel << ",\"pulses\":" << trains[i].count
+                << ",\"pri_us\":" << trains[i].pri * 1e6 << ",\"width_us\":" << trains[i].width * 1e6
+                << ",\"peak\":" << trains[i].peak_db << "}";
+    }
+    json_ss << "]}";
+
+    uploads.push(json_ss.str(), url);
+}
+
+/*
+Function to send HTTPS post request for the per-bin statistics of a window, every statistic is sent as
+base64 encoded 8-bit codes of its bins with an offset and scale (dB = offset + scale * code)
+*/
+void post_bin_stats_data(const channel_data& data, const esc_bin_stats::stats_snapshot& stats, std::string url) {
+    std::vector<uint8_t> codes;
+    float offset, scale;
+    std::stringstream json_ss;
+    json_ss << "{";
+    json_ss << "\"sensor_id\":\"" << SENSOR_ID << "\"," ;
+    json_ss << "\"lat\":" << data.lat << ",";
+    json_ss << "\"lon\":" << data.lon << ",";
+    json_ss << "\"rx_channel\":" << data.rx_channel << ",";
+    json_ss << "\"start_us\":" << stats.start_us << ",";
+    json_ss << "\"stop_us\":" << stats.stop_us << ",";
+    json_ss << "\"frames\":" << stats.frames << ",";
+    json_ss << std::setprecision(12);
+    json_ss << "\"first_freq\":" << stats.first_freq << ",";
+    json_ss << "\"bin_width\":" << stats.bin_width << ",";
+    json_ss << std::setprecision(6);
+    json_ss << "\"num_bins\":" << stats.num_bins << ",";
+    json_ss << "\"stats\":[";
+    for (size_t i = 0; i < 3 + stats.percentiles.size(); i++) {
+        const float* db = i == 0 ? stats.max_db.data()
+                          : i == 1 ? stats.min_db.data()
+                          : i == 2 ? stats.mean_db.data()
+                                   : &stats.percentile_db[(i - 3) * stats.num_bins];
+        esc_bin_stats::quantize(db, stats.num_bins, codes, offset, scale);
+        if (i != 0)
+            json_ss << ",";
+        json_ss << "{\"name\":\"";
+        if (i < 3)
+            json_ss << (i == 0 ? "max" : i == 1 ? "min" : "mean");
+        else
+            json_ss << "p" << stats.percentiles[i - 3];
+        json_ss << "\",\"offset\":" << offset << ",\"scale\":" << scale << ",\"codes\":\""
+                << base64_encode(codes.data(), codes.size()) << "\"}";
+    }
+    json_ss << "]}";
+
+    uploads.push(json_ss.str(), url);
+}
+
+/*
+Function to send HTTPS post request for the occupancy of the channels over a report period, only the
+channels busy at some point of it are listed: duty cycle, busy at the end, last activity and the counts
+of busy and idle intervals per dwell bucket (bucket k up to dwell_base_us << k, trailing zeros left out)
+*/
+void post_occupancy_data(const channel_data& data, const esc_occupancy::occupancy_report& report, const esc_occupancy::occupancy_config& config, std::string url) {
+    std::stringstream json_ss;
+    json_ss << "{";
+    json_ss << "\"sensor_id\":\"" << SENSOR_ID << "\"," ;
+    json_ss << "\"lat\":" << data.lat << ",";
+    json_ss << "\"lon\":" << data.lon << ",";
+    json_ss << "\"rx_channel\":" << data.rx_channel << ",";
+    json_ss << "\"start_us\":" << report.start_us << ",";
+    json_ss << "\"stop_us\":" << report.stop_us << ",";
+    json_ss << "\"num_channels\":" << report.channels.size() << ",";
+    json_ss << "\"dwell_base_us\":" << int64_t(config.dwell_base * 1e6) << ",";
+    json_ss << std::setprecision(4);
+    json_ss << "\"channels\":[";
+    bool first = true;
+    for (size_t i = 0; i < report.channels.size(); i++) {
+        const esc_occupancy::channel_occupancy& occ = report.channels[i];
+        if (occ.duty == 0 and not occ.busy)
+            continue;
+        json_ss << (first ? "" : ",");
+        first = false;
+        json_ss << "{\"id\":" << occ.channel << ",\"duty\":" << occ.duty << ",\"busy\":" << (occ.busy ? "true" : "false")
+                << ",\"last_us\":" << occ.last_active_us;
+        for (int k = 0; k < 2; k++) {
+            const std::vector<uint32_t>& dwell = k == 0 ? occ.on : occ.off;
+            size_t len = dwell.size();
+            while (len > 0 and dwell[len - 1] == 0)
+                len--;
+            json_ss << (k == 0 ? ",\"on\":[" : ",\"off\":[");
+            for (size_t b = 0; b < len; b++)
+                json_ss << (b ? "," : "") << dwell[b];
+            json_ss << "]";
+        }
+        json_ss << "}";
+    }
+    json_ss << "]}";
+
+    uploads.push(json_ss.str(), url);
+}
+
+/*
+Function to send HTTPS post request for a report fused from several sensors, power is the strongest
+and mean_power the mean report of the sensors covering a channel, votes the sensors that detect it
+*/
+void post_fused_data(const esc_aggregator::fused_report& fused, std::string url) {
+    std::stringstream json_ss;
+    json_ss << "{";
+    json_ss << "\"sensor_id\":\"" << SENSOR_ID << "\"," ;
+    json_ss << "\"time_us\":" << fused.time_us << ",";
+    json_ss << "\"sensors\":[";
+    for (size_t i = 0; i < fused.sensors.size(); i++)
+        json_ss << (i ? "," : "") << "\"" << fused.sensors[i] << "\"";
+    json_ss << "],";
+    json_ss << "\"channels\":[";
+    for (size_t i = 0; i < fused.channels.size(); i++) {
+        const esc_aggregator::fused_channel& ch = fused.channels[i];
+        if (i != 0)
+            json_ss << ",";
+        json_ss << "{\"id\":" << i << ",\"power\":" << ch.max_power << ",\"mean_power\":" << ch.mean_power
+                << ",\"sensors\":" << ch.num_sensors << ",\"votes\":" << ch.votes
+                << ",\"detected\":" << (ch.detected ? "true" : "false") << ",\"signal\":\"" << ch.signal
+                << "\",\"confidence\":" << ch.confidence << "}";
+    }
+    json_ss << "]}";
+
+    uploads.push(json_ss.str(), url);
+}
+
+/*
+Receives the power reports of other sensors, fuses them per time window and uploads one report
+stream instead of one per sensor, runs on the main thread and never returns
+*/
+void run_aggregator(unsigned short port, double window, size_t min_votes){
+    esc_aggregator::report_receiver receiver(port);
+    // late reports get as long as the window itself
+    esc_aggregator::report_fuser fuser(int64_t(window * 1e6), int64_t(window * 1e6), min_votes);
+    std::cout << boost::format("Aggregating reports on UDP port %d, %f s windows, %d votes to detect")
+                     % port % window % min_votes
+              << std::endl;
+
+    esc_aggregator::sensor_report report;
+    std::vector<esc_aggregator::fused_report> fused;
+    size_t last_late = 0;
+    while (not stop_requested) {
+        // wake for the next report or when the oldest window is due
+        const int64_t deadline = fuser.get_next_deadline();
+        const int64_t wait_us  = deadline < 0 ? 1000000 : std::max<int64_t>(0, deadline - unix_time_us());
+        if (receiver.receive(report, int(std::min<int64_t>(wait_us, 1000000) / 1000 + 1)))
+            fuser.add(report);
+
+        fused.clear();
+        fuser.flush(unix_time_us(), fused);
+        for (size_t i = 0; i < fused.size(); i++) {
+            #if DEBUG
+            std::cout << "Fused " << fused[i].sensors.size() << " sensors at " << fused[i].time_us << std::endl;
+            #endif
+            post_fused_data(fused[i], opensas_url + "measurements");
+        }
+        if (fuser.get_num_late() != last_late) {
+            last_late = fuser.get_num_late();
+            std::cerr << "Aggregator: " << last_late << " late reports dropped, check the sensor clocks" << std::endl;
+        }
+    }
+}
+
+//Queues an upload, a deferred one waits in the spool for the replay (and is dropped without a spool)
+void queue_upload(const std::string& json_str, const std::string& url, bool defer) {
+    if (defer)
+        uploads.defer(json_str, url);
+    else
+        uploads.push(json_str, url);
+}
+
+//Runs on the upload thread, sends one queued request
+bool upload_json(const std::string& json_str, const std::string& url) {
+    #if STATS
+    auto upload_stats_time = high_resolution_clock::now();
+    #endif
+    const bool delivered = post_json(json_str, url);
+    #if STATS
+    auto upload_stats_duration = (high_resolution_clock::now() - upload_stats_time);
+    std::cout << "Https req time: "  << upload_stats_duration.count() / 1000 << " us" << std::endl;
+    #endif
+    return delivered;
+}
+
+int64_t unix_time_us(void) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::string base64_encode(const uint8_t* data, size_t len) {
+    std::string encoded(4 * ((len + 2) / 3), '\0');
+    if (len > 0)
+        EVP_EncodeBlock(reinterpret_cast<unsigned char*>(&encoded[0]), data, int(len));
+    return encoded;
+}
+
+/*
+Sends one HTTPS POST request, returns false if the server could not be reached or had an internal
+error, so the request is worth retrying. A request the server rejects (4xx) is logged and not retried.
+*/
+bool post_json(std::string json_str, std::string url) {
 
     char url_new[url.length() + 1];
     strcpy(url_new, url.c_str());
@@ -714,6 +2037,10 @@ void post_json(std::string json_str, std::string url) {
 
     // Find the path component
     char *path = strtok(NULL, "");
+    if (hostname == NULL or port == NULL or path == NULL) {
+        std::cerr << "ERROR: invalid url " << url << std::endl;
+        return true;
+    }
     std::string path_str(path);
 
     #if DEBUG
@@ -723,84 +2050,116 @@ void post_json(std::string json_str, std::string url) {
     std::cout << "Port: " << port << std::endl;
     std::cout << "Path: " << path_str << std::endl;
     #endif
-    
+
+    // everything below is released at done, whichever way we get there
+    bool delivered = false;
+    SSL_CTX *ssl_ctx = NULL;
+    SSL *ssl = NULL;
+    int sockfd = -1;
+    struct timeval timeout;
+    struct sockaddr_in serv_addr;
+    struct pollfd pfd;
+    int sock_flags, sock_error = 0;
+    socklen_t sock_error_len = sizeof(sock_error);
+    std::string post_req;
+    char buffer[1024];
+    int bytes_read, status = 0;
+
     // Initialize OpenSSL
     SSL_library_init();
-    SSL_CTX *ssl_ctx = SSL_CTX_new(TLS_client_method());
+    ssl_ctx = SSL_CTX_new(TLS_client_method());
+    if (ssl_ctx == NULL) {
+        std::cerr << "ERROR creating SSL context" << std::endl;
+        goto done;
+    }
 
     // Load the client certificate and key
     if (SSL_CTX_use_certificate_file(ssl_ctx, client_crt_path.c_str(), SSL_FILETYPE_PEM) <= 0) {
         perror("ERROR loading client certificate");
-        return;
+        goto done;
     }
     if (SSL_CTX_use_PrivateKey_file(ssl_ctx, client_key_path.c_str(), SSL_FILETYPE_PEM) <= 0) {
         perror("ERROR loading client private key");
-        return;
+        goto done;
     }
 
     // Load the CA certificate
     if (SSL_CTX_load_verify_locations(ssl_ctx, ca_crt_path.c_str(), nullptr) <= 0) {
         perror("ERROR loading CA certificate");
-        return;
+        goto done;
     }
 
     // Create a socket
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) {
         perror("ERROR opening socket");
-        return;
+        goto done;
     }
 
     // Set a timeout for the socket
-    struct timeval timeout;
     timeout.tv_sec = 5;  // 5 seconds timeout
     timeout.tv_usec = 0;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout)) < 0) {
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout)) < 0
+        or setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout, sizeof(timeout)) < 0) {
         perror("ERROR setting socket options");
-        return;
+        goto done;
     }
 
     // Set the server address
-    struct sockaddr_in serv_addr;
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_port = htons(atoi(port));
     if (inet_pton(AF_INET, hostname, &serv_addr.sin_addr) <= 0) {
         perror("ERROR invalid address");
-        return;
+        goto done;
     }
 
-    // Connect to the server
+    // Connect to the server, non-blocking so an unreachable server costs at most connect_timeout
+    sock_flags = fcntl(sockfd, F_GETFL, 0);
+    fcntl(sockfd, F_SETFL, sock_flags | O_NONBLOCK);
     if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("ERROR connecting");
-        return;
+        if (errno != EINPROGRESS) {
+            perror("ERROR connecting");
+            goto done;
+        }
+        pfd.fd = sockfd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, int(connect_timeout * 1000)) <= 0) {
+            std::cerr << "ERROR: Timeout while connecting" << std::endl;
+            goto done;
+        }
+        if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &sock_error, &sock_error_len) < 0 or sock_error != 0) {
+            errno = sock_error;
+            perror("ERROR connecting");
+            goto done;
+        }
     }
+    fcntl(sockfd, F_SETFL, sock_flags);
 
     // Create an SSL object and attach it to the socket
-    SSL *ssl = SSL_new(ssl_ctx);
+    ssl = SSL_new(ssl_ctx);
     SSL_set_fd(ssl, sockfd);
 
     // Establish the SSL connection
     if (SSL_connect(ssl) != 1) {
         perror("ERROR establishing SSL connection");
-        return;
+        goto done;
     }
 
     // Send the HTTP POST request
-    std::string post_req = "POST /" + path_str + " HTTP/1.1\r\n";
+    post_req = "POST /" + path_str + " HTTP/1.1\r\n";
     post_req += "Host: " + url + "\r\n";
     post_req += "Content-Type: application/json\r\n";
     post_req += "Content-Length: " + std::to_string(json_str.size()) + "\r\n";
     post_req += "\r\n";
     post_req += json_str;
-    if (SSL_write(ssl, post_req.c_str(), post_req.size()) < 0) {
+    if (SSL_write(ssl, post_req.c_str(), post_req.size()) <= 0) {
         perror("ERROR writing to socket");
-        return;
+        goto done;
     }
 
     // Read the response from the server
-    char buffer[1024];
-    int bytes_read = SSL_read(ssl, buffer, sizeof(buffer));
+    bytes_read = SSL_read(ssl, buffer, sizeof(buffer) - 1);
 
     // Check if any data was received
     if (bytes_read <= 0) {
@@ -811,16 +2170,26 @@ void post_json(std::string json_str, std::string url) {
         } else {
             perror("ERROR reading from socket");
         }
+        goto done;
+    }
+
+    // Check the status line, only server errors are worth a retry
+    buffer[bytes_read] = '\0';
+    if (sscanf(buffer, "HTTP/%*s %d", &status) != 1)
+        std::cerr << "ERROR: Malformed response" << std::endl;
+    else if (status >= 400 and status < 500)
+        std::cerr << "ERROR: Server rejected the request with " << status << std::endl;
+    delivered = status != 0 and status < 500;
+
+done:
+    // Close the SSL connection and the socket
+    if (ssl != NULL) {
         SSL_shutdown(ssl);
         SSL_free(ssl);
+    }
+    if (ssl_ctx != NULL)
         SSL_CTX_free(ssl_ctx);
+    if (sockfd >= 0)
         close(sockfd);
-        return;
-    }
-
-    // Close the SSL connection and the socket
-    SSL_shutdown(ssl);
-    SSL_free(ssl);
-    SSL_CTX_free(ssl_ctx);
-    close(sockfd);
+    return delivered;
 }
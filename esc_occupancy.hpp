@@ -0,0 +1,178 @@
+//
+// ESC sensor node - incremental channel occupancy statistics
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_OCCUPANCY_HPP
+#define ESC_OCCUPANCY_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+namespace esc_occupancy {
+
+//! Occupancy accounting settings
+struct occupancy_config
+{
+    double period;      //!< seconds between occupancy reports
+    double dwell_base;  //!< upper edge of the first dwell time bucket in seconds, each next bucket doubles it
+    size_t num_buckets; //!< dwell time buckets, the last one takes every longer interval
+
+    occupancy_config(void)
+        : period(10)
+        , dwell_base(10e-3)
+        , num_buckets(12)
+    {
+        /* NOP */
+    }
+};
+
+//! The occupancy of one channel over a report period
+struct channel_occupancy
+{
+    size_t channel;            //!< channel of the plan
+    double duty;               //!< fraction of the observed time the channel was busy
+    bool busy;                 //!< busy at the end of the period
+    int64_t last_active_us;    //!< last time the channel was seen busy, 0 if never
+    std::vector<uint32_t> on;  //!< busy intervals that ended in the period, per dwell bucket
+    std::vector<uint32_t> off; //!< idle intervals that ended in the period, per dwell bucket
+};
+
+//! The occupancy of every channel over a report period
+struct occupancy_report
+{
+    int64_t start_us;                        //!< start of the period, microseconds since the epoch
+    int64_t stop_us;                         //!< end of the period
+    std::vector<channel_occupancy> channels; //!< every channel of the plan
+};
+
+/*!
+ * Busy time, busy and idle dwell times and the last activity of every
+ * channel, kept up to date from the busy state of each processed frame.
+ *
+ * A frame counts for the time since the previous one, in the state the
+ * channel is in at that frame. A change of state closes the interval in
+ * the previous state and counts its length in a dwell histogram with
+ * buckets doubling from dwell_base. Every update is a fixed amount of
+ * work per channel, whatever the length of the period, and nothing is
+ * allocated after the first report. Not thread safe, fed and read by the
+ * pipeline thread.
+ */
+class occupancy_tracker
+{
+public:
+    /*!
+     * \param num_channels the channels of the plan
+     * \param config the dwell time buckets
+     */
+    occupancy_tracker(size_t num_channels, const occupancy_config& config)
+        : _base_us(int64_t(config.dwell_base * 1e6))
+        , _num_buckets(config.num_buckets)
+        , _busy(num_channels, false)
+        , _since_us(num_channels, 0)
+        , _last_active_us(num_channels, 0)
+        , _busy_us(num_channels, 0)
+        , _on(num_channels * config.num_buckets, 0)
+        , _off(num_channels * config.num_buckets, 0)
+        , _last_us(0)
+        , _start_us(0)
+    {
+        if (_base_us <= 0 or config.num_buckets == 0)
+            throw std::runtime_error("occupancy dwell buckets need a positive base and at least one bucket");
+    }
+
+    /*!
+     * Account for a processed frame.
+     * \param busy the busy state of every channel
+     * \param time_us the frame timestamp in microseconds since the epoch
+     */
+    void update(const std::vector<bool>& busy, int64_t time_us)
+    {
+        if (_last_us == 0) {
+            // the first frame starts every interval
+            for (size_t ch = 0; ch < _busy.size(); ch++) {
+                _busy[ch]     = busy[ch];
+                _since_us[ch] = time_us;
+                if (busy[ch])
+                    _last_active_us[ch] = time_us;
+            }
+            _last_us = _start_us = time_us;
+            return;
+        }
+        const int64_t dt = std::max<int64_t>(0, time_us - _last_us);
+        _last_us         = time_us;
+        for (size_t ch = 0; ch < _busy.size(); ch++) {
+            if (busy[ch]) {
+                _busy_us[ch] += dt;
+                _last_active_us[ch] = time_us;
+            }
+            if (busy[ch] != _busy[ch]) {
+                std::vector<uint32_t>& dwell = _busy[ch] ? _on : _off;
+                dwell[ch * _num_buckets + bucket(time_us - _since_us[ch])]++;
+                _busy[ch]     = busy[ch];
+                _since_us[ch] = time_us;
+            }
+        }
+    }
+
+    /*!
+     * Take the occupancy since the last report and start a new period.
+     * \param out replaced with the occupancy, its storage is reused
+     * \return false, and nothing taken, if no time was observed
+     */
+    bool report(occupancy_report& out)
+    {
+        const int64_t observed = _last_us - _start_us;
+        if (observed <= 0)
+            return false;
+        out.start_us = _start_us;
+        out.stop_us  = _last_us;
+        out.channels.resize(_busy.size());
+        for (size_t ch = 0; ch < _busy.size(); ch++) {
+            channel_occupancy& occ = out.channels[ch];
+            occ.channel            = ch;
+            occ.duty               = double(_busy_us[ch]) / observed;
+            occ.busy               = _busy[ch];
+            occ.last_active_us     = _last_active_us[ch];
+            occ.on.assign(_on.begin() + ch * _num_buckets, _on.begin() + (ch + 1) * _num_buckets);
+            occ.off.assign(_off.begin() + ch * _num_buckets, _off.begin() + (ch + 1) * _num_buckets);
+        }
+        std::fill(_busy_us.begin(), _busy_us.end(), 0);
+        std::fill(_on.begin(), _on.end(), 0);
+        std::fill(_off.begin(), _off.end(), 0);
+        _start_us = _last_us;
+        return true;
+    }
+
+private:
+    //! Dwell bucket of an interval, intervals up to base are in bucket 0, up to 2 base in 1 and so on
+    size_t bucket(int64_t duration_us) const
+    {
+        size_t b     = 0;
+        int64_t edge = _base_us;
+        while (duration_us > edge and b + 1 < _num_buckets) {
+            edge <<= 1;
+            b++;
+        }
+        return b;
+    }
+
+    int64_t _base_us;
+    size_t _num_buckets;
+    std::vector<bool> _busy;
+    std::vector<int64_t> _since_us;       // start of the current interval
+    std::vector<int64_t> _last_active_us;
+    std::vector<int64_t> _busy_us;        // busy time in the period
+    std::vector<uint32_t> _on;            // num_buckets per channel
+    std::vector<uint32_t> _off;
+    int64_t _last_us;                     // time of the last frame
+    int64_t _start_us;                    // start of the period
+};
+
+} // namespace esc_occupancy
+
+#endif /*ESC_OCCUPANCY_HPP*/
@@ -0,0 +1,335 @@
+//
+// ESC sensor node - streaming time-domain pulse detector
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_PULSE_HPP
+#define ESC_PULSE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace esc_pulse {
+
+//! Pulse detector settings
+struct pulse_config
+{
+    double threshold_db; //!< envelope over the noise floor that starts a pulse, it ends at half of that in dB
+    double min_width;    //!< shortest pulse in seconds, shorter ones are noise
+    double max_width;    //!< longest pulse in seconds, longer ones are continuous signals
+    size_t smooth;       //!< envelope moving average in samples
+    size_t min_pulses;   //!< pulses in the train window that make a pulse train
+    double train_window; //!< seconds of pulses a train is made of
+
+    pulse_config(void)
+        : threshold_db(12)
+        , min_width(0.2e-6)
+        , max_width(100e-6)
+        , smooth(8)
+        , min_pulses(4)
+        , train_window(1)
+    {
+        /* NOP */
+    }
+};
+
+//! One detected pulse
+struct pulse
+{
+    uint64_t start; //!< sample index of the leading edge
+    size_t width;   //!< samples between the leading and the trailing edge
+    float peak;     //!< highest envelope power, linear
+};
+
+/*!
+ * Leading edge pulse detector running on every sample of a stream.
+ *
+ * The samples go through |x|^2 and a moving average of smooth samples, the
+ * envelope. A pulse starts when the envelope rises threshold_db over the
+ * noise floor and ends when it falls under half of that (in dB), so the
+ * edges have hysteresis. Pulses between min_width and max_width are kept,
+ * longer ones are continuous signals and ignored.
+ *
+ * The noise floor is the lowest mean power of 1024 sample blocks over the
+ * last 64 blocks, tracked slowly: sparse pulses do not lift it, a
+ * continuous signal does, so pulses are then detected over that signal.
+ *
+ * The stream is handled in blocks of 1024 samples. A block whose power
+ * stays under the start threshold, and with no pulse open, only costs the
+ * |x|^2, sum and max passes, which the compiler vectorizes; the edge
+ * tracking runs sample by sample only in blocks that cross the threshold.
+ * Not thread safe, every stream keeps its own.
+ */
+class envelope_detector
+{
+public:
+    /*!
+     * \param config the detector settings
+     * \param rate the sample rate in Sps
+     */
+    envelope_detector(const pulse_config& config, double rate)
+        : _smooth(std::max<size_t>(1, config.smooth))
+        , _min_width(size_t(std::ceil(config.min_width * rate)))
+        , _max_width(size_t(config.max_width * rate))
+        , _on_factor(float(std::pow(10.0, config.threshold_db / 10)))
+        , _off_factor(float(std::pow(10.0, config.threshold_db / 20)))
+        , _floor(0)
+        , _block_min(0)
+        , _blocks(0)
+        , _in_pulse(false)
+        , _long(false)
+        , _start(0)
+        , _peak(0)
+        , _hist_max(0)
+    {
+        if (config.threshold_db <= 0 or rate <= 0 or config.max_width <= config.min_width)
+            throw std::runtime_error("pulse detector needs a positive threshold and min width < max width");
+        _buf.assign(_smooth + block_len, 0.0f);
+    }
+
+    /*!
+     * Run the detector on the next samples of the stream.
+     * \param samps the samples
+     * \param n the number of samples
+     * \param index the stream index of the first sample
+     * \param out pulses that ended in these samples are appended
+     */
+    void process(const std::complex<float>* samps, size_t n, uint64_t index, std::vector<pulse>& out)
+    {
+        for (size_t done = 0; done < n; done += block_len) {
+            const size_t m = std::min(size_t(block_len), n - done);
+            process_block(samps + done, m, index + done, out);
+        }
+    }
+
+    //! The noise floor, linear power per sample
+    float get_floor(void) const
+    {
+        return _floor;
+    }
+
+private:
+    static const size_t block_len    = 1024;
+    static const size_t floor_blocks = 64;
+    static constexpr float floor_rate = 0.25f;
+
+    void process_block(const std::complex<float>* samps, size_t m, uint64_t index, std::vector<pulse>& out)
+    {
+        // |x|^2 behind the last smooth powers of the previous block
+        const float* iq = reinterpret_cast<const float*>(samps);
+        float* pwr      = &_buf[_smooth];
+        for (size_t i = 0; i < m; i++)
+            pwr[i] = iq[2 * i] * iq[2 * i] + iq[2 * i + 1] * iq[2 * i + 1];
+        float sum, max;
+        sum_max(pwr, m, sum, max);
+
+        if (_blocks == 0 and _floor == 0)
+            _floor = sum / m; // first block, a start for the floor
+        const float on  = _floor * _on_factor;
+        const float off = _floor * _off_factor;
+        // the envelope is a mean, it cannot exceed the largest power in its window
+        if (_in_pulse or max > on or _hist_max > on)
+            track_edges(pwr, m, index, on, off, out);
+
+        // the quietest block of the floor period sets the floor
+        if (m == block_len) {
+            const float mean = sum / m;
+            _block_min       = (_blocks == 0) ? mean : std::min(_block_min, mean);
+            if (++_blocks == floor_blocks) {
+                _floor += floor_rate * (_block_min - _floor);
+                _blocks = 0;
+            }
+        }
+
+        // keep the last smooth powers for the envelope of the next block
+        std::copy(_buf.begin() + m, _buf.begin() + m + _smooth, _buf.begin());
+        _hist_max = *std::max_element(_buf.begin(), _buf.begin() + _smooth);
+    }
+
+    //! Sum and maximum with independent partial results so the compiler can vectorize them
+    static void sum_max(const float* x, size_t n, float& sum, float& max)
+    {
+        float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+        float m0 = 0, m1 = 0, m2 = 0, m3 = 0;
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            s0 += x[i + 0];
+            s1 += x[i + 1];
+            s2 += x[i + 2];
+            s3 += x[i + 3];
+            m0 = x[i + 0] > m0 ? x[i + 0] : m0;
+            m1 = x[i + 1] > m1 ? x[i + 1] : m1;
+            m2 = x[i + 2] > m2 ? x[i + 2] : m2;
+            m3 = x[i + 3] > m3 ? x[i + 3] : m3;
+        }
+        for (; i < n; i++) {
+            s0 += x[i];
+            m0 = x[i] > m0 ? x[i] : m0;
+        }
+        sum = (s0 + s1) + (s2 + s3);
+        max = std::max(std::max(m0, m1), std::max(m2, m3));
+    }
+
+    //! Follow the envelope sample by sample, pwr has the previous smooth powers in front of it
+    void track_edges(const float* pwr, size_t m, uint64_t index, float on, float off, std::vector<pulse>& out)
+    {
+        const float scale = 1.0f / _smooth;
+        const float* win  = pwr - _smooth;
+        float acc         = 0;
+        for (size_t k = 1; k <= _smooth; k++)
+            acc += win[k];
+        for (size_t i = 0; i < m; i++) {
+            // acc is the sum of the smooth powers ending at sample i
+            if (i != 0)
+                acc += pwr[i] - win[i];
+            const float env = acc * scale;
+            // the envelope lags the samples by half its length
+            const uint64_t at = std::max<uint64_t>(index + i, _smooth / 2) - _smooth / 2;
+            if (not _in_pulse) {
+                if (env > on) {
+                    _in_pulse = true;
+                    _long     = false;
+                    _start    = at;
+                    _peak     = env;
+                }
+                continue;
+            }
+            _peak = std::max(_peak, env);
+            if (at - _start > _max_width)
+                _long = true;
+            if (env < off) {
+                const size_t width = size_t(at - _start);
+                if (not _long and width >= _min_width)
+                    out.push_back(pulse{_start, width, _peak});
+                _in_pulse = false;
+            }
+        }
+    }
+
+    size_t _smooth;
+    size_t _min_width;
+    size_t _max_width;
+    float _on_factor;
+    float _off_factor;
+    float _floor;
+    float _block_min;
+    size_t _blocks;
+    bool _in_pulse;
+    bool _long;
+    uint64_t _start;
+    float _peak;
+    float _hist_max;
+    std::vector<float> _buf;
+};
+
+//! A pulse train seen on one channel over the train window
+struct pulse_train
+{
+    size_t channel;  //!< channel of the plan
+    size_t count;    //!< pulses in the train window
+    double pri;      //!< median pulse repetition interval in seconds
+    double width;    //!< median pulse width in seconds
+    float peak_db;   //!< strongest pulse in dB
+    uint64_t last;   //!< sample index of the latest pulse
+};
+
+/*!
+ * Collects the pulses of every channel and finds the pulse trains in them.
+ * Pulses are added by the detector thread and the trains read by the
+ * pipeline, both under a lock, at pulse rate at most.
+ */
+class train_tracker
+{
+public:
+    /*!
+     * \param config the detector settings
+     * \param rate the sample rate in Sps
+     * \param num_channels the channels of the plan
+     */
+    train_tracker(const pulse_config& config, double rate, size_t num_channels)
+        : _rate(rate)
+        , _window(uint64_t(config.train_window * rate))
+        , _min_pulses(std::max<size_t>(2, config.min_pulses))
+        , _pulses(num_channels)
+    {
+        /* NOP */
+    }
+
+    //! Add a pulse seen on a channel
+    void add(size_t channel, const pulse& p)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::deque<pulse>& pulses = _pulses.at(channel);
+        pulses.push_back(p);
+        expire(pulses, p.start);
+    }
+
+    /*!
+     * The pulse trains at a point of the stream, strongest first.
+     * \param now the stream index, pulses older than the train window are left out
+     * \param out replaced with the trains
+     */
+    void get_trains(uint64_t now, std::vector<pulse_train>& out)
+    {
+        out.clear();
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (size_t ch = 0; ch < _pulses.size(); ch++) {
+            std::deque<pulse>& pulses = _pulses[ch];
+            expire(pulses, now);
+            if (pulses.size() < _min_pulses)
+                continue;
+            _scratch.clear();
+            for (size_t i = 1; i < pulses.size(); i++)
+                _scratch.push_back(double(pulses[i].start - pulses[i - 1].start));
+            pulse_train train;
+            train.channel = ch;
+            train.count   = pulses.size();
+            train.pri     = median(_scratch) / _rate;
+            _scratch.clear();
+            float peak = 0;
+            for (size_t i = 0; i < pulses.size(); i++) {
+                _scratch.push_back(double(pulses[i].width));
+                peak = std::max(peak, pulses[i].peak);
+            }
+            train.width   = median(_scratch) / _rate;
+            train.peak_db = 10 * std::log10(peak);
+            train.last    = pulses.back().start;
+            out.push_back(train);
+        }
+        std::sort(out.begin(), out.end(), [](const pulse_train& a, const pulse_train& b) {
+            return a.peak_db > b.peak_db;
+        });
+    }
+
+private:
+    void expire(std::deque<pulse>& pulses, uint64_t now) const
+    {
+        while (not pulses.empty() and pulses.front().start + _window < now)
+            pulses.pop_front();
+    }
+
+    static double median(std::vector<double>& values)
+    {
+        std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+        return values[values.size() / 2];
+    }
+
+    double _rate;
+    uint64_t _window;
+    size_t _min_pulses;
+    std::mutex _mutex;
+    std::vector<std::deque<pulse>> _pulses;
+    std::vector<double> _scratch;
+};
+
+} // namespace esc_pulse
+
+#endif /*ESC_PULSE_HPP*/
@@ -0,0 +1,211 @@
+//
+// ESC sensor node - deadline scheduler for periodic work
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_SCHEDULER_HPP
+#define ESC_SCHEDULER_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace esc_scheduler {
+
+typedef std::chrono::steady_clock clock_type;
+
+//! Convert a rate in Hz to a period, a rate of 0 gives a period of 0 (always due)
+inline clock_type::duration rate_to_period(double rate)
+{
+    if (rate < 0)
+        throw std::runtime_error("task rate must not be negative");
+    if (rate == 0)
+        return clock_type::duration::zero();
+    return std::chrono::duration_cast<clock_type::duration>(
+        std::chrono::duration<double>(1.0 / rate));
+}
+
+/*!
+ * Min-heap of task deadlines owned by one thread.
+ *
+ * Periodic tasks are re-armed from their previous deadline, not from the
+ * time they ran, so their cadence does not drift. A task that falls more
+ * than one period behind skips the missed periods (counted as overruns)
+ * instead of running in a burst. One-shot tasks run once every time they
+ * are armed, arming a pending one-shot moves its deadline.
+ * wait() sleeps until the earliest deadline instead of spinning.
+ */
+class deadline_scheduler
+{
+public:
+    typedef std::function<void(void)> task_fn;
+
+    deadline_scheduler(void)
+        : _sequence(0)
+    {
+        /* NOP */
+    }
+
+    /*!
+     * Add a task that runs every period.
+     * \param name the task name, for reports
+     * \param period the task period, zero runs the task on every run_due()
+     * \param fn the task
+     * \param run_now run the task on the next run_due() instead of after one period
+     * \return the task id
+     */
+    size_t add_periodic(
+        const std::string& name, clock_type::duration period, task_fn fn, bool run_now = true)
+    {
+        task_type task = {name, period, fn, 0, true, 0};
+        _tasks.push_back(task);
+        push(_tasks.size() - 1, clock_type::now() + (run_now ? clock_type::duration::zero() : period));
+        return _tasks.size() - 1;
+    }
+
+    /*!
+     * Add a task that runs once each time it is armed, it starts unarmed.
+     * \param name the task name, for reports
+     * \param fn the task
+     * \return the task id
+     */
+    size_t add_oneshot(const std::string& name, task_fn fn)
+    {
+        task_type task = {name, clock_type::duration::zero(), fn, 0, false, 0};
+        _tasks.push_back(task);
+        return _tasks.size() - 1;
+    }
+
+    /*!
+     * Arm a one-shot task, replacing its pending deadline if it has one.
+     * \param id the task id
+     * \param when the deadline of the task
+     */
+    void arm(size_t id, clock_type::time_point when)
+    {
+        if (_tasks.at(id).periodic)
+            throw std::runtime_error("cannot arm periodic task " + _tasks[id].name);
+        _tasks[id].generation++;
+        push(id, when);
+    }
+
+    //! Run every task whose deadline has passed, returns the number of tasks run
+    size_t run_due(void)
+    {
+        const clock_type::time_point now = clock_type::now();
+        size_t num_run                   = 0;
+        // tasks re-armed while running are pushed to the back of the same instant
+        const unsigned long long last = _sequence;
+        while (not _heap.empty() and _heap.top().deadline <= now
+               and _heap.top().sequence < last) {
+            const entry_type entry = _heap.top();
+            _heap.pop();
+            task_type& task = _tasks[entry.id];
+            if (entry.generation != task.generation)
+                continue; // a one-shot that was armed again
+            if (not task.periodic)
+                task.generation++;
+            else
+                push(entry.id, next_deadline(task, entry.deadline, now));
+            task.fn();
+            num_run++;
+        }
+        return num_run;
+    }
+
+    //! The earliest deadline, or time_point::max() without tasks
+    clock_type::time_point get_next_deadline(void)
+    {
+        // drop the deadlines of re-armed one-shots so they do not wake us early
+        while (not _heap.empty()
+               and _heap.top().generation != _tasks[_heap.top().id].generation)
+            _heap.pop();
+        return _heap.empty() ? clock_type::time_point::max() : _heap.top().deadline;
+    }
+
+    //! Sleep until the earliest deadline, returns at once if a task is due
+    void wait(void)
+    {
+        const clock_type::time_point deadline = get_next_deadline();
+        if (deadline == clock_type::time_point::max())
+            return;
+        if (deadline > clock_type::now())
+            std::this_thread::sleep_until(deadline);
+    }
+
+    //! The number of periods a periodic task has skipped because it ran late
+    size_t get_overruns(size_t id) const
+    {
+        return _tasks.at(id).overruns;
+    }
+
+    //! The name of a task
+    const std::string& get_name(size_t id) const
+    {
+        return _tasks.at(id).name;
+    }
+
+    //! The number of tasks added so far
+    size_t size(void) const
+    {
+        return _tasks.size();
+    }
+
+private:
+    struct task_type
+    {
+        std::string name;
+        clock_type::duration period;
+        task_fn fn;
+        size_t overruns;
+        bool periodic;
+        size_t generation;
+    };
+
+    struct entry_type
+    {
+        clock_type::time_point deadline;
+        unsigned long long sequence; // keeps equal deadlines in FIFO order
+        size_t id;
+        size_t generation;
+        bool operator>(const entry_type& other) const
+        {
+            return (deadline != other.deadline) ? deadline > other.deadline
+                                                : sequence > other.sequence;
+        }
+    };
+
+    void push(size_t id, clock_type::time_point deadline)
+    {
+        entry_type entry = {deadline, _sequence++, id, _tasks[id].generation};
+        _heap.push(entry);
+    }
+
+    clock_type::time_point next_deadline(
+        task_type& task, clock_type::time_point deadline, clock_type::time_point now)
+    {
+        if (task.period == clock_type::duration::zero())
+            return now;
+        deadline += task.period;
+        if (deadline <= now) {
+            const size_t behind = size_t((now - deadline) / task.period) + 1;
+            task.overruns += behind;
+            deadline += behind * task.period;
+        }
+        return deadline;
+    }
+
+    std::vector<task_type> _tasks;
+    std::priority_queue<entry_type, std::vector<entry_type>, std::greater<entry_type>> _heap;
+    unsigned long long _sequence;
+};
+
+} // namespace esc_scheduler
+
+#endif /*ESC_SCHEDULER_HPP*/
@@ -0,0 +1,407 @@
+//
+// ESC sensor node - shared memory publication of spectra for local consumers
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_SHM_HPP
+#define ESC_SHM_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#if ATOMIC_LLONG_LOCK_FREE != 2
+#error "the shared memory ring needs lock-free 64 bit atomics"
+#endif
+
+/*!
+ * Layout of a spectrum ring, version 1, one POSIX shared memory object per
+ * RX channel. All fields are in host byte order, offsets in bytes.
+ *
+ * Header (shm_header, 128 bytes):
+ *    0  char[8]  magic "ESCSPEC"
+ *    8  uint32   version, 1
+ *   12  uint32   header_size, bytes before the first slot (header and channel table)
+ *   16  uint32   slot_size, bytes per slot
+ *   20  uint32   num_slots
+ *   24  uint32   num_bins, spectrum bins per frame
+ *   28  uint32   num_channels, channels of the channel plan
+ *   32  uint32   rx_channel
+ *   36  uint32   writer_pid
+ *   40  double   first_freq, Hz of spectrum bin 0, bin k is at first_freq + k * bin_width
+ *   48  double   bin_width in Hz
+ *   56  uint64   frames, the number of frames published, frame n is in slot n % num_slots
+ *   64  char[64] sensor_id
+ * Channel table, right after the header: num_channels of
+ *    0  double   center_freq in Hz
+ *    8  double   bandwidth in Hz
+ * Slots, from header_size on, slot_size apart:
+ *    0  uint64   seq, 2n + 1 while frame n is written, 2n + 2 once it is complete
+ *    8  uint64   frame, n
+ *   16  int64    time_us, Unix time of the frame in microseconds
+ *   24  int32    detected_channel, the strongest busy channel, -1 for none
+ *   64  float[num_bins]     spectrum in dB
+ *       float[num_channels] channel power in dB
+ *       uint8[num_channels] detected, 1 for a busy channel
+ *
+ * The single writer is esc_node. A slot is a seqlock: the writer makes seq
+ * odd, writes the frame and makes it even, a reader reads seq, the frame,
+ * then seq again and keeps the frame only if seq is 2n + 2 both times.
+ * Readers never write, so any number of them can follow a ring without
+ * slowing the writer down; one that falls more than num_slots frames
+ * behind loses the frames in between.
+ */
+namespace esc_shm {
+
+static const char magic[8]      = "ESCSPEC";
+static const uint32_t version   = 1;
+static const size_t slot_align  = 64;
+
+struct shm_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t slot_size;
+    uint32_t num_slots;
+    uint32_t num_bins;
+    uint32_t num_channels;
+    uint32_t rx_channel;
+    uint32_t writer_pid;
+    double first_freq;
+    double bin_width;
+    std::atomic<uint64_t> frames;
+    char sensor_id[64];
+};
+
+struct channel_entry
+{
+    double center_freq;
+    double bandwidth;
+};
+
+struct slot_header
+{
+    std::atomic<uint64_t> seq;
+    uint64_t frame;
+    int64_t time_us;
+    int32_t detected_channel;
+    uint8_t reserved[36];
+};
+
+static_assert(sizeof(shm_header) == 128, "shm_header layout");
+static_assert(sizeof(channel_entry) == 16, "channel_entry layout");
+static_assert(sizeof(slot_header) == 64, "slot_header layout");
+
+//! The shared memory object name of an RX channel, e.g. "/esc_spectrum0"
+inline std::string get_object_name(const std::string& prefix, size_t rx_channel)
+{
+    return "/" + prefix + std::to_string(rx_channel);
+}
+
+//! A frame in place in the ring, only valid if the visit that handed it out returns true
+struct frame_view
+{
+    uint64_t frame;
+    int64_t time_us;
+    int32_t detected_channel;
+    const float* spectrum;
+    const float* channel_pwr;
+    const uint8_t* detected;
+};
+
+//! A frame copied out of the ring
+struct spectrum_frame
+{
+    uint64_t frame;
+    int64_t time_us;
+    int32_t detected_channel;
+    std::vector<float> spectrum;
+    std::vector<float> channel_pwr;
+    std::vector<uint8_t> detected;
+};
+
+/*!
+ * The writer of a spectrum ring. Creates the shared memory object,
+ * replacing a stale one of the same name, and removes it on destruction.
+ */
+class spectrum_publisher
+{
+public:
+    /*!
+     * \param name the object name, see get_object_name()
+     * \param num_slots the number of frames the ring holds
+     * \param sensor_id the sensor the spectra come from
+     * \param rx_channel the RX channel the spectra come from
+     * \param first_freq frequency of spectrum bin 0 in Hz
+     * \param bin_width bin spacing in Hz
+     * \param num_bins spectrum bins per frame
+     * \param channels center frequency and bandwidth of every channel of the plan
+     */
+    spectrum_publisher(const std::string& name,
+        size_t num_slots,
+        const std::string& sensor_id,
+        size_t rx_channel,
+        double first_freq,
+        double bin_width,
+        size_t num_bins,
+        const std::vector<channel_entry>& channels)
+        : _name(name)
+    {
+        if (num_slots == 0 or num_bins == 0)
+            throw std::runtime_error("spectrum ring needs slots and bins");
+        const size_t header_size = align(sizeof(shm_header) + channels.size() * sizeof(channel_entry));
+        const size_t slot_size   = align(sizeof(slot_header)
+                                       + (num_bins + channels.size()) * sizeof(float) + channels.size());
+        _size = header_size + num_slots * slot_size;
+
+        shm_unlink(name.c_str());
+        const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0)
+            throw std::runtime_error("cannot create shared memory " + name + ": " + std::strerror(errno));
+        if (ftruncate(fd, off_t(_size)) != 0) {
+            close(fd);
+            shm_unlink(name.c_str());
+            throw std::runtime_error("cannot size shared memory " + name + ": " + std::strerror(errno));
+        }
+        void* area = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (area == MAP_FAILED) {
+            shm_unlink(name.c_str());
+            throw std::runtime_error("cannot map shared memory " + name + ": " + std::strerror(errno));
+        }
+        _base   = static_cast<char*>(area);
+        _header = reinterpret_cast<shm_header*>(_base);
+
+        // a fresh object is zeroed, the magic goes in last so readers never see half a header
+        _header->version      = version;
+        _header->header_size  = uint32_t(header_size);
+        _header->slot_size    = uint32_t(slot_size);
+        _header->num_slots    = uint32_t(num_slots);
+        _header->num_bins     = uint32_t(num_bins);
+        _header->num_channels = uint32_t(channels.size());
+        _header->rx_channel   = uint32_t(rx_channel);
+        _header->writer_pid   = uint32_t(getpid());
+        _header->first_freq   = first_freq;
+        _header->bin_width    = bin_width;
+        std::strncpy(_header->sensor_id, sensor_id.c_str(), sizeof(_header->sensor_id) - 1);
+        if (not channels.empty())
+            std::memcpy(_base + sizeof(shm_header), &channels.front(), channels.size() * sizeof(channel_entry));
+        _header->frames.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(_header->magic, magic, sizeof(magic));
+    }
+
+    ~spectrum_publisher(void)
+    {
+        munmap(_base, _size);
+        shm_unlink(_name.c_str());
+    }
+
+    spectrum_publisher(const spectrum_publisher&) = delete;
+    spectrum_publisher& operator=(const spectrum_publisher&) = delete;
+
+    /*!
+     * Publish one frame.
+     * \param time_us Unix time of the frame in microseconds
+     * \param spectrum num_bins values in dB
+     * \param channel_pwr the power of every channel in dB
+     * \param detected the busy state of every channel
+     * \param detected_channel the strongest busy channel, -1 for none
+     */
+    void publish(int64_t time_us,
+        const float* spectrum,
+        const std::vector<float>& channel_pwr,
+        const std::vector<bool>& detected,
+        int detected_channel)
+    {
+        const size_t num_bins     = _header->num_bins;
+        const size_t num_channels = _header->num_channels;
+        const uint64_t frame      = _header->frames.load(std::memory_order_relaxed);
+        char* slot = _base + _header->header_size + (frame % _header->num_slots) * _header->slot_size;
+        slot_header* head = reinterpret_cast<slot_header*>(slot);
+
+        head->seq.store(2 * frame + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        head->frame            = frame;
+        head->time_us          = time_us;
+        head->detected_channel = detected_channel;
+        float* values = reinterpret_cast<float*>(slot + sizeof(slot_header));
+        std::memcpy(values, spectrum, num_bins * sizeof(float));
+        for (size_t ch = 0; ch < num_channels; ch++)
+            values[num_bins + ch] = ch < channel_pwr.size() ? channel_pwr[ch] : 0;
+        uint8_t* busy = reinterpret_cast<uint8_t*>(values + num_bins + num_channels);
+        for (size_t ch = 0; ch < num_channels; ch++)
+            busy[ch] = ch < detected.size() and detected[ch];
+        head->seq.store(2 * frame + 2, std::memory_order_release);
+        _header->frames.store(frame + 1, std::memory_order_release);
+    }
+
+private:
+    static size_t align(size_t bytes)
+    {
+        return (bytes + slot_align - 1) / slot_align * slot_align;
+    }
+
+    std::string _name;
+    size_t _size;
+    char* _base;
+    shm_header* _header;
+};
+
+/*!
+ * A reader of a spectrum ring, it only maps the object read-only.
+ *
+ * Follow the ring by waiting for get_frames() to grow and visiting or
+ * reading the new frames; a frame more than num_slots behind the newest
+ * has been overwritten and is refused.
+ */
+class spectrum_reader
+{
+public:
+    //! \param name the object name, see get_object_name()
+    spectrum_reader(const std::string& name)
+    {
+        const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+            throw std::runtime_error("cannot open shared memory " + name + ": " + std::strerror(errno));
+        struct stat st;
+        if (fstat(fd, &st) != 0 or size_t(st.st_size) < sizeof(shm_header)) {
+            close(fd);
+            throw std::runtime_error("shared memory " + name + " holds no spectrum ring");
+        }
+        _size = size_t(st.st_size);
+        void* area = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (area == MAP_FAILED)
+            throw std::runtime_error("cannot map shared memory " + name + ": " + std::strerror(errno));
+        _base   = static_cast<const char*>(area);
+        _header = reinterpret_cast<const shm_header*>(_base);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (std::memcmp(_header->magic, magic, sizeof(magic)) != 0 or _header->version != version
+            or _header->header_size + size_t(_header->num_slots) * _header->slot_size > _size) {
+            munmap(const_cast<char*>(_base), _size);
+            throw std::runtime_error("shared memory " + name + " is not a version 1 spectrum ring");
+        }
+    }
+
+    ~spectrum_reader(void)
+    {
+        munmap(const_cast<char*>(_base), _size);
+    }
+
+    spectrum_reader(const spectrum_reader&) = delete;
+    spectrum_reader& operator=(const spectrum_reader&) = delete;
+
+    //! The ring header, for the geometry of the frames
+    const shm_header& get_header(void) const
+    {
+        return *_header;
+    }
+
+    //! Center frequency and bandwidth of a channel of the plan
+    const channel_entry& get_channel(size_t ch) const
+    {
+        if (ch >= _header->num_channels)
+            throw std::runtime_error("channel out of range");
+        return reinterpret_cast<const channel_entry*>(_base + sizeof(shm_header))[ch];
+    }
+
+    //! The number of frames published so far
+    uint64_t get_frames(void) const
+    {
+        return _header->frames.load(std::memory_order_acquire);
+    }
+
+    /*!
+     * Wait until more frames than seen are published.
+     * \param seen the frame count the caller has seen
+     * \param timeout the longest wait in seconds
+     * \return the frame count, seen on timeout
+     */
+    uint64_t wait(uint64_t seen, double timeout) const
+    {
+        const auto deadline = std::chrono::steady_clock::now()
+                              + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                  std::chrono::duration<double>(timeout));
+        uint64_t frames;
+        while ((frames = get_frames()) <= seen) {
+            if (std::chrono::steady_clock::now() >= deadline)
+                return seen;
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        return frames;
+    }
+
+    /*!
+     * Run fn on a frame in place, without copying it.
+     * \param frame the frame number
+     * \param fn called with a frame_view, whatever it computed is only good if visit returns true
+     * \return false if the frame is not published yet, was overwritten, or was overwritten during fn
+     */
+    template <typename F> bool visit(uint64_t frame, F fn) const
+    {
+        const char* slot       = get_slot(frame);
+        const slot_header* head = reinterpret_cast<const slot_header*>(slot);
+        const uint64_t seq      = head->seq.load(std::memory_order_acquire);
+        if (seq != 2 * frame + 2)
+            return false;
+        const float* values = reinterpret_cast<const float*>(slot + sizeof(slot_header));
+        frame_view view;
+        view.frame            = frame;
+        view.time_us          = head->time_us;
+        view.detected_channel = head->detected_channel;
+        view.spectrum         = values;
+        view.channel_pwr      = values + _header->num_bins;
+        view.detected         = reinterpret_cast<const uint8_t*>(values + _header->num_bins + _header->num_channels);
+        fn(view);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return head->seq.load(std::memory_order_relaxed) == seq;
+    }
+
+    /*!
+     * Copy a frame out of the ring.
+     * \param frame the frame number
+     * \param out the copy
+     * \return false if the frame is not published yet or was overwritten
+     */
+    bool read(uint64_t frame, spectrum_frame& out) const
+    {
+        const size_t num_bins     = _header->num_bins;
+        const size_t num_channels = _header->num_channels;
+        return visit(frame, [&](const frame_view& view) {
+            out.frame            = view.frame;
+            out.time_us          = view.time_us;
+            out.detected_channel = view.detected_channel;
+            out.spectrum.assign(view.spectrum, view.spectrum + num_bins);
+            out.channel_pwr.assign(view.channel_pwr, view.channel_pwr + num_channels);
+            out.detected.assign(view.detected, view.detected + num_channels);
+        });
+    }
+
+private:
+    const char* get_slot(uint64_t frame) const
+    {
+        return _base + _header->header_size + (frame % _header->num_slots) * _header->slot_size;
+    }
+
+    size_t _size;
+    const char* _base;
+    const shm_header* _header;
+};
+
+} // namespace esc_shm
+
+#endif /*ESC_SHM_HPP*/
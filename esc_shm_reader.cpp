@@ -0,0 +1,99 @@
+//
+// ESC sensor node - example reader of the shared memory spectra
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#include "esc_shm.hpp"
+#include <boost/format.hpp>
+#include <boost/program_options.hpp>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+
+namespace po = boost::program_options;
+
+static volatile std::sig_atomic_t stop_signal_called = false;
+
+void sig_int_handler(int)
+{
+    stop_signal_called = true;
+}
+
+/*
+Follows the spectrum ring of one RX channel of a running esc_node and prints
+the peak bin and the busy channels of every frame, finding the peak in place
+without copying the spectrum
+*/
+int main(int argc, char* argv[])
+{
+    std::string name;
+    size_t rx_channel;
+
+    po::options_description desc("Allowed options");
+    // clang-format off
+    desc.add_options()
+        ("help", "help message")
+        ("name", po::value<std::string>(&name)->default_value("esc_spectrum"), "the --shm name of esc_node")
+        ("rx", po::value<size_t>(&rx_channel)->default_value(0), "the RX channel to follow")
+    ;
+    // clang-format on
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::cout << boost::format("ESC shared memory spectrum reader %s") % desc << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    esc_shm::spectrum_reader reader(esc_shm::get_object_name(name, rx_channel));
+    const esc_shm::shm_header& header = reader.get_header();
+    std::cout << boost::format("%s RX %d (pid %d): %d bins from %f MHz, %f kHz apart, %d channels, %d slots")
+                     % header.sensor_id % header.rx_channel % header.writer_pid % header.num_bins
+                     % (header.first_freq / 1e6) % (header.bin_width / 1e3) % header.num_channels
+                     % header.num_slots
+              << std::endl;
+
+    std::signal(SIGINT, &sig_int_handler);
+    // start with the newest frame
+    uint64_t next = reader.get_frames();
+    next          = next == 0 ? 0 : next - 1;
+    size_t lost   = 0;
+    while (not stop_signal_called) {
+        const uint64_t frames = reader.wait(next, 1.0);
+        if (frames <= next)
+            continue;
+        // a reader too far behind skips to the oldest frame still in the ring
+        if (frames - next > header.num_slots) {
+            lost += frames - header.num_slots - next;
+            next = frames - header.num_slots;
+        }
+        for (; next < frames; next++) {
+            size_t peak = 0;
+            int64_t time_us = 0;
+            std::string busy;
+            const bool valid = reader.visit(next, [&](const esc_shm::frame_view& view) {
+                for (size_t n = 1; n < header.num_bins; n++) {
+                    if (view.spectrum[n] > view.spectrum[peak])
+                        peak = n;
+                }
+                time_us = view.time_us;
+                for (size_t ch = 0; ch < header.num_channels; ch++) {
+                    if (view.detected[ch])
+                        busy += str(boost::format(" %d (%.1f dB)") % ch % view.channel_pwr[ch]);
+                }
+            });
+            if (not valid) {
+                lost++;
+                continue;
+            }
+            std::cout << boost::format("Frame %d at %d us: peak %f MHz, busy:%s") % next % time_us
+                             % ((header.first_freq + peak * header.bin_width) / 1e6)
+                             % (busy.empty() ? " none" : busy)
+                      << std::endl;
+        }
+    }
+    std::cout << boost::format("Lost frames: %d") % lost << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,357 @@
+//
+// ESC sensor node - simulated RX source for benchmarks
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_SIM_HPP
+#define ESC_SIM_HPP
+
+#include <uhd/stream.hpp>
+#include <boost/format.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace esc_sim {
+
+//! What the simulated source plays
+struct sim_config
+{
+    std::string path;    //!< file of interleaved float32 I/Q (fc32) played in a loop, empty for the synthetic signal
+    bool realtime;       //!< deliver samples no faster than the sample rate
+    double noise_db;     //!< synthetic noise power in dBFS
+    double signal_db;    //!< synthetic signal power in dBFS while a burst is on
+    double offset;       //!< synthetic signal center relative to the RX center in Hz
+    double bandwidth;    //!< synthetic signal bandwidth in Hz
+    double burst_width;  //!< seconds a burst is on, 0 keeps the signal on
+    double burst_period; //!< seconds between burst starts
+    double control_latency; //!< seconds every tuning control or readback takes, a device round trip
+    double lo_settle;       //!< seconds the LO takes to lock after a retune takes effect
+
+    sim_config(void)
+        : realtime(true)
+        , noise_db(-60)
+        , signal_db(-30)
+        , offset(5e6)
+        , bandwidth(8e6)
+        , burst_width(0.2)
+        , burst_period(1)
+        , control_latency(100e-6)
+        , lo_settle(300e-6)
+    {
+        /* NOP */
+    }
+};
+
+/*!
+ * A stand-in for a UHD RX streamer and the tuning of its channel, to run
+ * the node without a radio.
+ *
+ * The samples come from a recorded fc32 file or from a synthetic signal:
+ * complex white noise plus a flat band of tones that is switched on in
+ * bursts. Both are held in memory as loops, the synthetic loop has a whole
+ * number of cycles of every tone so it plays without seams. Tuning and rate
+ * changes are recorded but do not change the samples, the rate only sets
+ * the pace in realtime mode. Every tuning control or readback takes the
+ * control latency, and after a retune the LO reports lock once the settle
+ * time has passed.
+ *
+ * The device time counts from the creation of the source. Timed commands
+ * are emulated: a retune under a command time locks counting from that
+ * time, and a stream command that is not for now starts at its time.
+ *
+ * Stream commands are followed like a device does (num_samps, continuous,
+ * stop). In realtime mode the streamer blocks until the requested samples
+ * would have arrived, counted from the stream start, otherwise it returns
+ * at once so the pipeline runs as fast as it can. Every second the input
+ * rate delivered to the pipeline is printed.
+ */
+class sim_source : public uhd::rx_streamer
+{
+public:
+    /*!
+     * \param config the signal to play
+     * \param rx_channel the index printed with the input rate
+     * \param rate the initial sample rate in Sps
+     * \param freq the initial center frequency in Hz
+     */
+    sim_source(const sim_config& config, size_t rx_channel, double rate, double freq)
+        : _config(config)
+        , _rx_channel(rx_channel)
+        , _rate(rate)
+        , _freq(freq)
+        , _timed(false)
+        , _pos(0)
+        , _remaining(0)
+        , _continuous(false)
+        , _sample_time(0)
+        , _streamed(0)
+        , _report_samps(0)
+    {
+        if (rate <= 0)
+            throw std::runtime_error("simulated source needs a sample rate");
+        if (config.path.empty())
+            make_synthetic();
+        else
+            load(config.path);
+        _epoch = _stream_start = _report_time = _locked_at = clock_type::now();
+    }
+
+    size_t get_num_channels(void) const
+    {
+        return 1;
+    }
+
+    size_t get_max_num_samps(void) const
+    {
+        return max_packet_samps;
+    }
+
+    void issue_stream_cmd(const uhd::stream_cmd_t& stream_cmd)
+    {
+        switch (stream_cmd.stream_mode) {
+            case uhd::stream_cmd_t::STREAM_MODE_START_CONTINUOUS:
+                _continuous = true;
+                break;
+            case uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS:
+                _continuous = false;
+                _remaining  = 0;
+                return;
+            default:
+                _continuous = false;
+                _remaining  = stream_cmd.num_samps;
+                break;
+        }
+        _stream_start = stream_cmd.stream_now ? clock_type::now() : at(stream_cmd.time_spec);
+        _streamed     = 0;
+    }
+
+    size_t recv(const buffs_type& buffs,
+        const size_t nsamps_per_buff,
+        uhd::rx_metadata_t& metadata,
+        const double timeout   = 0.1,
+        const bool one_packet  = false)
+    {
+        metadata.error_code      = uhd::rx_metadata_t::ERROR_CODE_NONE;
+        metadata.has_time_spec   = false;
+        metadata.more_fragments  = false;
+        metadata.start_of_burst  = false;
+        metadata.end_of_burst    = false;
+        metadata.out_of_sequence = false;
+
+        size_t nsamps = _continuous ? nsamps_per_buff : std::min(nsamps_per_buff, _remaining);
+        if (one_packet)
+            nsamps = std::min(nsamps, size_t(max_packet_samps));
+        if (nsamps == 0) {
+            // nothing was asked for, a device times out
+            std::this_thread::sleep_for(std::chrono::duration<double>(timeout));
+            metadata.error_code = uhd::rx_metadata_t::ERROR_CODE_TIMEOUT;
+            return 0;
+        }
+
+        if (_config.realtime) {
+            std::this_thread::sleep_until(_stream_start
+                                          + std::chrono::duration_cast<clock_type::duration>(
+                                              std::chrono::duration<double>((_streamed + nsamps) / _rate)));
+        }
+        fill(static_cast<std::complex<float>*>(buffs[0]), nsamps);
+        _streamed += nsamps;
+        if (not _continuous)
+            _remaining -= nsamps;
+
+        _report_samps += nsamps;
+        const clock_type::time_point now = clock_type::now();
+        const double elapsed = std::chrono::duration<double>(now - _report_time).count();
+        if (elapsed >= 1) {
+            std::cout << boost::format("Sim RX %d input rate: %f Msps") % _rx_channel
+                             % (_report_samps / elapsed / 1e6)
+                      << std::endl;
+            _report_samps = 0;
+            _report_time  = now;
+        }
+        return nsamps;
+    }
+
+    void set_rx_rate(double rate)
+    {
+        if (rate <= 0)
+            throw std::runtime_error("simulated source needs a sample rate");
+        control();
+        _rate = rate;
+    }
+
+    double get_rx_rate(void) const
+    {
+        control();
+        return _rate;
+    }
+
+    void set_rx_freq(double freq)
+    {
+        control();
+        _freq      = freq;
+        _locked_at = (_timed ? at(_command_time) : clock_type::now())
+                     + std::chrono::duration_cast<clock_type::duration>(
+                         std::chrono::duration<double>(_config.lo_settle));
+    }
+
+    double get_rx_freq(void) const
+    {
+        control();
+        return _freq;
+    }
+
+    //! The device time, seconds since the source was created
+    uhd::time_spec_t get_time_now(void) const
+    {
+        control();
+        return uhd::time_spec_t(std::chrono::duration<double>(clock_type::now() - _epoch).count());
+    }
+
+    //! Retunes after this take effect at a device time
+    void set_command_time(const uhd::time_spec_t& time)
+    {
+        _command_time = time;
+        _timed        = true;
+    }
+
+    void clear_command_time(void)
+    {
+        _timed = false;
+    }
+
+    bool is_lo_locked(void) const
+    {
+        control();
+        return clock_type::now() >= _locked_at;
+    }
+
+private:
+    typedef std::chrono::steady_clock clock_type;
+
+    static const size_t max_packet_samps = 2000;
+    static const size_t synthetic_len    = 1 << 20;
+    static const size_t num_tones        = 64;
+
+    //! A device round trip
+    void control(void) const
+    {
+        if (_config.control_latency > 0)
+            std::this_thread::sleep_for(std::chrono::duration<double>(_config.control_latency));
+    }
+
+    //! The host time of a device time
+    clock_type::time_point at(const uhd::time_spec_t& time) const
+    {
+        return _epoch + std::chrono::duration_cast<clock_type::duration>(
+                            std::chrono::duration<double>(time.get_real_secs()));
+    }
+
+    //! Copy the next samples of the loop, adding the signal while a burst is on
+    void fill(std::complex<float>* out, size_t nsamps)
+    {
+        const double burst_width  = _config.burst_width * _rate;
+        const double burst_period = std::max(_config.burst_period * _rate, 1.0);
+        size_t done = 0;
+        while (done < nsamps) {
+            size_t n = std::min(nsamps - done, _noise.size() - _pos);
+            bool on  = true;
+            if (not _signal.empty() and burst_width > 0) {
+                // runs of samples with the same burst state
+                const double phase = std::fmod(_sample_time, burst_period);
+                on                 = phase < burst_width;
+                const double left  = on ? burst_width - phase : burst_period - phase;
+                n = std::min(n, std::max(size_t(1), size_t(std::ceil(left))));
+            }
+            if (on and not _signal.empty()) {
+                for (size_t i = 0; i < n; i++)
+                    out[done + i] = _noise[_pos + i] + _signal[_pos + i];
+            } else {
+                std::copy(_noise.begin() + _pos, _noise.begin() + _pos + n, out + done);
+            }
+            done += n;
+            _sample_time += n;
+            _pos = (_pos + n) % _noise.size();
+        }
+    }
+
+    void load(const std::string& path)
+    {
+        std::ifstream file(path.c_str(), std::ios::binary | std::ios::ate);
+        if (not file)
+            throw std::runtime_error("cannot open simulated source " + path);
+        const size_t nsamps = size_t(file.tellg()) / sizeof(std::complex<float>);
+        if (nsamps == 0)
+            throw std::runtime_error("simulated source " + path + " holds no samples");
+        _noise.resize(nsamps);
+        file.seekg(0);
+        file.read(reinterpret_cast<char*>(&_noise.front()), nsamps * sizeof(std::complex<float>));
+        std::cout << boost::format("Sim RX %d: %d samples from %s") % _rx_channel % nsamps % path
+                  << std::endl;
+    }
+
+    void make_synthetic(void)
+    {
+        std::mt19937 rng(unsigned(_rx_channel + 1));
+        std::normal_distribution<float> normal(0, float(std::sqrt(std::pow(10.0, _config.noise_db / 10) / 2)));
+        _noise.resize(synthetic_len);
+        for (size_t i = 0; i < synthetic_len; i++)
+            _noise[i] = std::complex<float>(normal(rng), normal(rng));
+
+        // tones on the loop frequency grid spread over the band, each gets an
+        // equal share of the power and a random phase
+        _signal.assign(synthetic_len, std::complex<float>(0));
+        const double pi         = std::acos(-1.0);
+        const double grid       = _rate / synthetic_len;
+        const double amplitude  = std::sqrt(std::pow(10.0, _config.signal_db / 10) / num_tones);
+        std::uniform_real_distribution<double> uniform(0, 2 * pi);
+        for (size_t t = 0; t < num_tones; t++) {
+            const double freq = _config.offset + _config.bandwidth * ((t + 0.5) / num_tones - 0.5);
+            const int64_t cycles = int64_t(std::floor(freq / grid + 0.5));
+            const std::complex<double> step = std::polar(1.0, 2 * pi * cycles / double(synthetic_len));
+            std::complex<double> phasor = std::polar(amplitude, uniform(rng));
+            for (size_t i = 0; i < synthetic_len; i++) {
+                _signal[i] += std::complex<float>(phasor);
+                phasor *= step;
+            }
+        }
+        std::cout << boost::format("Sim RX %d: %f dBFS noise, %f dBFS signal %f MHz wide at %+f MHz, bursts of %f s every %f s")
+                         % _rx_channel % _config.noise_db % _config.signal_db % (_config.bandwidth / 1e6)
+                         % (_config.offset / 1e6) % _config.burst_width % _config.burst_period
+                  << std::endl;
+    }
+
+    sim_config _config;
+    size_t _rx_channel;
+    double _rate;
+    double _freq;
+    clock_type::time_point _epoch;     // device time zero
+    uhd::time_spec_t _command_time;
+    bool _timed;                       // retunes wait for the command time
+    clock_type::time_point _locked_at; // when the LO locks after the last retune
+    std::vector<std::complex<float>> _noise;  // the loop, the recording for a file source
+    std::vector<std::complex<float>> _signal; // synthetic only
+    size_t _pos;
+    size_t _remaining;
+    bool _continuous;
+    double _sample_time; // samples played since the start, for the burst schedule
+    clock_type::time_point _stream_start;
+    size_t _streamed;
+    clock_type::time_point _report_time;
+    size_t _report_samps;
+};
+
+} // namespace esc_sim
+
+#endif /*ESC_SIM_HPP*/
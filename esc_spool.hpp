@@ -0,0 +1,321 @@
+//
+// ESC sensor node - disk backed store-and-forward spool
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_SPOOL_HPP
+#define ESC_SPOOL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace esc_spool {
+
+//! CRC-32 (IEEE) of a byte range, crc chains several ranges
+inline uint32_t crc32(const void* data, size_t len, uint32_t crc = 0)
+{
+    static uint32_t table[256];
+    static bool init = false;
+    if (not init) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        init = true;
+    }
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    crc              = ~crc;
+    for (size_t i = 0; i < len; i++)
+        crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+//! One spooled request
+struct record_type
+{
+    std::string url;
+    std::string json;
+    uint64_t end; // offset after the record, to consume() up to it
+};
+
+/*!
+ * Append-only log of POST requests in a memory mapped file, used to keep
+ * reports while the server is unreachable.
+ *
+ * The file holds a header page and a data area used as a circular log.
+ * Read and write offsets grow monotonically, a record sits at offset modulo
+ * the data size and never wraps (the tail of the area is padded instead).
+ * Every record carries a CRC. A record is synced to disk before the write
+ * offset in the header moves past it, so after a crash the header never
+ * points at a partial record. Opening an existing spool re-checks every
+ * pending record and cuts the log at the first bad one.
+ *
+ * When a new record does not fit, the oldest records are dropped and
+ * counted, and the read offset is synced past them before their space is
+ * reused. The spool is not thread safe, it is meant for the upload thread.
+ */
+class spool
+{
+public:
+    /*!
+     * Open or create a spool file.
+     * \param path the spool file
+     * \param capacity the size of the data area in bytes
+     */
+    spool(const std::string& path, size_t capacity)
+        : _fd(-1), _map(nullptr), _capacity(align(capacity)), _num_records(0)
+    {
+        if (_capacity < 2 * page_size)
+            throw std::runtime_error("spool capacity is too small");
+        _fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (_fd < 0)
+            throw std::runtime_error("cannot open spool file " + path);
+        struct stat st;
+        const size_t file_size = page_size + _capacity;
+        if (fstat(_fd, &st) < 0 or (size_t(st.st_size) != file_size and ftruncate(_fd, file_size) < 0)) {
+            ::close(_fd);
+            throw std::runtime_error("cannot size spool file " + path);
+        }
+        void* map = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (map == MAP_FAILED) {
+            ::close(_fd);
+            throw std::runtime_error("cannot map spool file " + path);
+        }
+        _map    = static_cast<uint8_t*>(map);
+        _header = reinterpret_cast<header_type*>(_map);
+        _data   = _map + page_size;
+
+        if (_header->magic != spool_magic or _header->capacity != _capacity) {
+            if (_header->magic == spool_magic)
+                std::cerr << "Spool " << path << " has a different size, discarding it" << std::endl;
+            std::memset(_header, 0, sizeof(header_type));
+            _header->magic    = spool_magic;
+            _header->capacity = _capacity;
+            sync(_header, sizeof(header_type));
+        }
+        recover();
+    }
+
+    ~spool(void)
+    {
+        munmap(_map, page_size + _capacity);
+        ::close(_fd);
+    }
+
+    /*!
+     * Append a request, dropping the oldest records when it does not fit.
+     * \return false if the request is larger than the spool
+     */
+    bool append(const std::string& url, const std::string& json)
+    {
+        const size_t size = align(sizeof(record_header) + url.size() + json.size());
+        if (size > _capacity / 2)
+            return false;
+        uint64_t write = _header->write_offset;
+        // a record never wraps, pad the tail of the area instead
+        const size_t to_end = _capacity - write % _capacity;
+        const size_t needed = (size > to_end) ? to_end + size : size;
+        if (write + needed - _header->read_offset > _capacity) {
+            while (write + needed - _header->read_offset > _capacity)
+                drop_oldest();
+            // the header must not point into the space the pad and the record overwrite
+            sync(_header, sizeof(header_type));
+        }
+
+        if (size > to_end) {
+            record_header* pad = at(write);
+            pad->magic         = pad_magic;
+            pad->length        = uint32_t(to_end);
+            sync(pad, sizeof(record_header));
+            write += to_end;
+        }
+        record_header* rec = at(write);
+        rec->magic         = record_magic;
+        rec->length        = uint32_t(size);
+        rec->url_len       = uint32_t(url.size());
+        uint8_t* payload   = reinterpret_cast<uint8_t*>(rec + 1);
+        std::memcpy(payload, url.data(), url.size());
+        std::memcpy(payload + url.size(), json.data(), json.size());
+        rec->json_len = uint32_t(json.size());
+        rec->crc      = crc32(payload, url.size() + json.size());
+        sync(rec, size);
+
+        // the record is on disk, now it may become visible
+        _header->write_offset = write + size;
+        sync(_header, sizeof(header_type));
+        _num_records++;
+        return true;
+    }
+
+    /*!
+     * Read the oldest records without removing them.
+     * \param max_records the most records to read
+     * \param records filled with the records
+     * \return the offset to pass to consume() once the records are delivered
+     */
+    uint64_t peek(size_t max_records, std::vector<record_type>& records) const
+    {
+        records.clear();
+        uint64_t read = _header->read_offset;
+        while (read < _header->write_offset and records.size() < max_records) {
+            const record_header* rec = at(read);
+            if (rec->magic == record_magic) {
+                const char* payload = reinterpret_cast<const char*>(rec + 1);
+                record_type record;
+                record.url.assign(payload, rec->url_len);
+                record.json.assign(payload + rec->url_len, rec->json_len);
+                record.end = read + rec->length;
+                records.push_back(record);
+            }
+            read += rec->length;
+        }
+        return read;
+    }
+
+    //! Remove the records before offset, as returned by peek()
+    void consume(uint64_t offset)
+    {
+        uint64_t read = _header->read_offset;
+        while (read < offset) {
+            if (at(read)->magic == record_magic)
+                _num_records--;
+            read += at(read)->length;
+        }
+        _header->read_offset = read;
+        sync(_header, sizeof(header_type));
+    }
+
+    //! The number of spooled records
+    size_t size(void) const
+    {
+        return _num_records;
+    }
+
+    bool empty(void) const
+    {
+        return _num_records == 0;
+    }
+
+    //! The number of bytes in use
+    size_t get_used(void) const
+    {
+        return size_t(_header->write_offset - _header->read_offset);
+    }
+
+    //! The number of records dropped because the spool was full, over its lifetime
+    uint64_t get_dropped(void) const
+    {
+        return _header->dropped;
+    }
+
+private:
+    static const size_t page_size       = 4096;
+    static const uint32_t spool_magic   = 0x4c4f5053; // "SPOL"
+    static const uint32_t record_magic  = 0x44524552; // "RERD"
+    static const uint32_t pad_magic     = 0x44444150; // "PADD"
+
+    struct header_type
+    {
+        uint32_t magic;
+        uint32_t reserved;
+        uint64_t capacity;
+        uint64_t read_offset;
+        uint64_t write_offset;
+        uint64_t dropped;
+    };
+
+    struct record_header
+    {
+        uint32_t magic;
+        uint32_t length; // whole record including this header and padding
+        uint32_t url_len;
+        uint32_t json_len;
+        uint32_t crc; // of url and json
+        uint32_t reserved;
+    };
+
+    static size_t align(size_t n)
+    {
+        return (n + 7) & ~size_t(7);
+    }
+
+    record_header* at(uint64_t offset) const
+    {
+        return reinterpret_cast<record_header*>(_data + offset % _capacity);
+    }
+
+    //! Write a range of the mapping through to disk
+    void sync(const void* ptr, size_t len)
+    {
+        const uintptr_t start = reinterpret_cast<uintptr_t>(ptr) & ~uintptr_t(page_size - 1);
+        const uintptr_t end   = reinterpret_cast<uintptr_t>(ptr) + len;
+        if (msync(reinterpret_cast<void*>(start), end - start, MS_SYNC) < 0)
+            perror("ERROR syncing spool");
+    }
+
+    void drop_oldest(void)
+    {
+        const record_header* rec = at(_header->read_offset);
+        if (rec->magic == record_magic) {
+            _num_records--;
+            _header->dropped++;
+            if (_header->dropped % 100 == 1)
+                std::cerr << "Spool full, dropped " << _header->dropped << " records" << std::endl;
+        }
+        _header->read_offset += rec->length;
+    }
+
+    //! Check the pending records, the log ends at the first invalid one
+    void recover(void)
+    {
+        uint64_t read = _header->read_offset;
+        if (_header->write_offset < read or _header->write_offset - read > _capacity)
+            _header->write_offset = read;
+        while (read < _header->write_offset) {
+            const record_header* rec = at(read);
+            const size_t to_end      = _capacity - read % _capacity;
+            bool valid               = rec->length >= sizeof(record_header)
+                         and rec->length <= to_end and rec->length % 8 == 0;
+            if (valid and rec->magic == record_magic) {
+                valid = sizeof(record_header) + rec->url_len + rec->json_len <= rec->length
+                        and crc32(rec + 1, rec->url_len + rec->json_len) == rec->crc;
+            } else if (valid) {
+                valid = rec->magic == pad_magic;
+            }
+            if (not valid) {
+                std::cerr << "Spool damaged, discarding " << (_header->write_offset - read)
+                          << " bytes" << std::endl;
+                _header->write_offset = read;
+                break;
+            }
+            if (rec->magic == record_magic)
+                _num_records++;
+            read += rec->length;
+        }
+        sync(_header, sizeof(header_type));
+    }
+
+    int _fd;
+    uint8_t* _map;
+    header_type* _header;
+    uint8_t* _data;
+    size_t _capacity;
+    size_t _num_records;
+};
+
+} // namespace esc_spool
+
+#endif /*ESC_SPOOL_HPP*/
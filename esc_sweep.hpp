@@ -0,0 +1,397 @@
+//
+// ESC sensor node - wideband sweep scheduler and spectrum stitching
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_SWEEP_HPP
+#define ESC_SWEEP_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace esc_sweep {
+
+//! The order the LO visits the steps of a sweep
+enum sweep_order {
+    ORDER_AUTO,      //!< whichever gives the shorter worst-case revisit time
+    ORDER_LINEAR,    //!< low to high, then jump back to the lowest step
+    ORDER_SERPENTINE //!< low to high, then high to low
+};
+
+//! Parse "auto", "linear" or "serpentine" into a sweep_order
+inline sweep_order parse_order(const std::string& order)
+{
+    if (order == "auto")
+        return ORDER_AUTO;
+    if (order == "linear")
+        return ORDER_LINEAR;
+    if (order == "serpentine")
+        return ORDER_SERPENTINE;
+    throw std::runtime_error("unknown sweep order: " + order);
+}
+
+//! Sweep settings
+struct sweep_config
+{
+    sweep_config(void)
+        : start_freq(0)
+        , stop_freq(0)
+        , overlap(0.25)
+        , dwell_frames(4)
+        , settle_frames(1)
+        , order(ORDER_AUTO)
+        , retune_time(120e-3)
+        , retune_time_per_hz(0)
+        , frame_time(1e-3)
+    {
+        /* NOP */
+    }
+
+    double start_freq;         //!< lowest frequency to cover in Hz
+    double stop_freq;          //!< highest frequency to cover in Hz
+    double overlap;            //!< fraction of the usable bins shared by adjacent steps
+    size_t dwell_frames;       //!< spectrum frames stitched per step
+    size_t settle_frames;      //!< frames dropped after every retune
+    sweep_order order;         //!< step order
+    double retune_time;        //!< fixed cost of a retune in seconds
+    double retune_time_per_hz; //!< additional retune cost per Hz of LO travel
+    double frame_time;         //!< initial guess of the time per frame in seconds
+};
+
+/*!
+ * Steps the LO across [start_freq, stop_freq] and stitches the centered
+ * spectra of every step into one composite spectrum with the same bin width.
+ *
+ * Each step only contributes its usable bins (num_bins minus edge_bins at
+ * each end). Step centers sit on the composite bin grid, so step bins map
+ * one to one onto composite bins. The filter rolloff is estimated from the
+ * median-normalized spectra of all steps (signals move across the bins from
+ * step to step, the filter shape does not) and removed before stitching,
+ * a single step sweep has no such diversity and is not corrected.
+ * Where steps overlap, their bins are averaged weighted by the filter gain.
+ *
+ * The step order is chosen from a retune cost model, measured retune and
+ * dwell times refine the model for the reported revisit times.
+ */
+class sweep_scheduler
+{
+public:
+    sweep_scheduler(double samp_rate, size_t num_bins, size_t edge_bins, const sweep_config& config)
+        : _config(config)
+        , _num_bins(num_bins)
+        , _edge_bins(edge_bins)
+        , _res(samp_rate / num_bins)
+        , _rolloff(num_bins, 1.0f)
+        , _scratch(num_bins)
+        , _retune_time(config.retune_time)
+        , _frame_time(config.frame_time)
+        , _pos(0)
+        , _frames(0)
+    {
+        if (config.stop_freq <= config.start_freq)
+            throw std::runtime_error("sweep stop frequency must be above the start frequency");
+        if (config.overlap < 0 or config.overlap >= 1)
+            throw std::runtime_error("sweep overlap must be in [0, 1)");
+        if (config.dwell_frames == 0)
+            throw std::runtime_error("sweep dwell must be at least one frame");
+        if (2 * edge_bins >= num_bins)
+            throw std::runtime_error("sweep edge bins exceed the bin count");
+
+        _usable    = num_bins - 2 * edge_bins;
+        _spacing   = std::max<size_t>(1, size_t(std::floor(_usable * (1 - config.overlap))));
+        _num_comp  = size_t(std::floor((config.stop_freq - config.start_freq) / _res)) + 1;
+        _num_steps = (_num_comp > _usable)
+                         ? (_num_comp - _usable + _spacing - 1) / _spacing + 1
+                         : 1;
+        // center the covered range on the requested span
+        const size_t covered = (_num_steps - 1) * _spacing + _usable;
+        _shift               = long((covered - _num_comp) / 2);
+
+        _step_lin.assign(_num_steps, std::vector<float>(_usable, 0.0f));
+        _step_valid.assign(_num_steps, false);
+        _composite_lin.assign(_num_comp, 1e-20f);
+
+        _tour = make_tour(config.order);
+    }
+
+    //! The number of LO steps
+    size_t get_num_steps(void) const
+    {
+        return _num_steps;
+    }
+
+    //! The LO frequency of a step in Hz
+    double get_step_freq(size_t step) const
+    {
+        return comp_freq(long(step * _spacing) - _shift + long(_num_bins / 2 - _edge_bins));
+    }
+
+    //! The steps in the order they are visited every cycle
+    const std::vector<size_t>& get_tour(void) const
+    {
+        return _tour;
+    }
+
+    //! The LO frequency to be tuned to now
+    double get_current_freq(void) const
+    {
+        return get_step_freq(_tour[_pos]);
+    }
+
+    //! The number of bins of the composite spectrum
+    size_t get_num_composite_bins(void) const
+    {
+        return _num_comp;
+    }
+
+    //! The frequency of composite bin c in Hz
+    double comp_freq(long c) const
+    {
+        return _config.start_freq + c * _res;
+    }
+
+    //! The center frequency of the composite spectrum (bin num_bins/2) in Hz
+    double get_composite_center(void) const
+    {
+        return comp_freq(long(_num_comp / 2));
+    }
+
+    //! The span of the composite spectrum in Hz (bin width times bin count)
+    double get_composite_rate(void) const
+    {
+        return _res * _num_comp;
+    }
+
+    //! The composite spectrum in linear power, bins without data read 1e-20 (-200 dB)
+    const std::vector<float>& get_composite_linear(void) const
+    {
+        return _composite_lin;
+    }
+
+    /*!
+     * Stitch one centered spectrum frame taken at the current step.
+     * \param dft the centered spectrum in linear power, num_bins values
+     * \return true when the dwell on the step is complete and the LO
+     *         should move to get_current_freq() after advance()
+     */
+    bool add_frame(const float* dft)
+    {
+        if (_frames++ < _config.settle_frames)
+            return false;
+        if (_frames == _config.settle_frames + 1)
+            _dwell_start = std::chrono::steady_clock::now();
+
+        if (_num_steps > 1)
+            update_rolloff(dft);
+
+        // average the dwell frames of the step in linear power
+        const size_t step       = _tour[_pos];
+        const size_t dwell_idx  = _frames - _config.settle_frames - 1;
+        std::vector<float>& lin = _step_lin[step];
+        const float keep        = float(dwell_idx) / float(dwell_idx + 1);
+        for (size_t u = 0; u < _usable; u++) {
+            const size_t n  = u + _edge_bins;
+            const float val = dft[n] / _rolloff[n];
+            lin[u]          = keep * lin[u] + (1 - keep) * val;
+        }
+
+        if (dwell_idx + 1 < _config.dwell_frames)
+            return false;
+
+        _step_valid[step] = true;
+        stitch(step);
+        const double dwell = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - _dwell_start)
+                                 .count();
+        _frame_time += 0.1 * (dwell / _config.dwell_frames - _frame_time);
+        return true;
+    }
+
+    /*!
+     * Move on to the next step of the tour, call after add_frame returned true.
+     * \return true when this completed a full cycle of the tour
+     */
+    bool advance(void)
+    {
+        _pos    = (_pos + 1) % _tour.size();
+        _frames = 0;
+        return _pos == 0;
+    }
+
+    //! Drop the frames of the current step and settle again, after an outside retune
+    void restart_step(void)
+    {
+        _frames = 0;
+    }
+
+    /*!
+     * Feed back a measured retune to refine the cost model.
+     * \param df the LO travel in Hz
+     * \param seconds the measured retune time
+     */
+    void record_retune(double df, double seconds)
+    {
+        const double fixed = seconds - _config.retune_time_per_hz * std::abs(df);
+        _retune_time += 0.1 * (std::max(fixed, 0.0) - _retune_time);
+    }
+
+    //! The modeled time of one full cycle of the tour in seconds
+    double get_cycle_time(void) const
+    {
+        return cycle_time(_tour);
+    }
+
+    /*!
+     * The longest time between two looks at a frequency, from the cost model
+     * and the measured dwell and retune times.
+     * \param freq the frequency in Hz
+     * \return the revisit time in seconds, 0 if the frequency is not covered
+     */
+    double get_revisit_time(double freq) const
+    {
+        const long c = long(std::floor((freq - _config.start_freq) / _res + 0.5));
+        if (c < 0 or c >= long(_num_comp))
+            return 0;
+        return revisit_time(_tour, size_t(c));
+    }
+
+private:
+    //! Build the cyclic tour of the steps for an order
+    std::vector<size_t> make_tour(sweep_order order) const
+    {
+        std::vector<size_t> linear, serpentine;
+        for (size_t k = 0; k < _num_steps; k++)
+            linear.push_back(k);
+        serpentine = linear;
+        for (size_t k = _num_steps - 1; k > 1; k--)
+            serpentine.push_back(k - 1);
+
+        if (order == ORDER_LINEAR)
+            return linear;
+        if (order == ORDER_SERPENTINE)
+            return serpentine;
+        return (worst_revisit(serpentine) < worst_revisit(linear)) ? serpentine : linear;
+    }
+
+    double retune_cost(size_t from, size_t to) const
+    {
+        if (from == to)
+            return 0;
+        return _retune_time
+               + _config.retune_time_per_hz
+                     * std::abs(get_step_freq(to) - get_step_freq(from));
+    }
+
+    double dwell_cost(void) const
+    {
+        return (_config.settle_frames + _config.dwell_frames) * _frame_time;
+    }
+
+    double cycle_time(const std::vector<size_t>& tour) const
+    {
+        double t = 0;
+        for (size_t i = 0; i < tour.size(); i++)
+            t += retune_cost(tour[(i + tour.size() - 1) % tour.size()], tour[i]) + dwell_cost();
+        return t;
+    }
+
+    //! Largest gap between the visits to composite bin c over one cycle
+    double revisit_time(const std::vector<size_t>& tour, size_t c) const
+    {
+        std::vector<double> looks;
+        double t = 0;
+        for (size_t i = 0; i < tour.size(); i++) {
+            t += retune_cost(tour[(i + tour.size() - 1) % tour.size()], tour[i]) + dwell_cost();
+            if (covers(tour[i], c))
+                looks.push_back(t);
+        }
+        if (looks.empty())
+            return 0;
+        double gap = looks.front() + t - looks.back();
+        for (size_t i = 1; i < looks.size(); i++)
+            gap = std::max(gap, looks[i] - looks[i - 1]);
+        return gap;
+    }
+
+    double worst_revisit(const std::vector<size_t>& tour) const
+    {
+        double worst = 0;
+        for (size_t c = 0; c < _num_comp; c++)
+            worst = std::max(worst, revisit_time(tour, c));
+        return worst;
+    }
+
+    //! True when step k contributes to composite bin c
+    bool covers(size_t k, size_t c) const
+    {
+        const long u = long(c) + _shift - long(k * _spacing);
+        return u >= 0 and u < long(_usable);
+    }
+
+    //! Track the filter gain as the average median-normalized spectrum
+    void update_rolloff(const float* dft)
+    {
+        _scratch.assign(dft, dft + _num_bins);
+        std::nth_element(_scratch.begin(), _scratch.begin() + _num_bins / 2, _scratch.end());
+        const float median = _scratch[_num_bins / 2];
+        if (not(median > 0))
+            return;
+        // floored so that an empty bin (DC null) never divides by zero
+        for (size_t n = 0; n < _num_bins; n++)
+            _rolloff[n] = std::max(1e-10f, _rolloff[n] + 0.01f * (dft[n] / median - _rolloff[n]));
+    }
+
+    //! Recompute the composite bins step k contributes to
+    void stitch(size_t k)
+    {
+        const long first = std::max(0L, long(k * _spacing) - _shift);
+        const long last = std::min(long(_num_comp), long(k * _spacing + _usable) - _shift);
+        for (long c = first; c < last; c++) {
+            double sum = 0, norm = 0;
+            const long lo = std::max(0L, (c + _shift - long(_usable) + long(_spacing)) / long(_spacing));
+            const long hi = std::min(long(_num_steps) - 1, (c + _shift) / long(_spacing));
+            for (long j = lo; j <= hi; j++) {
+                const long u = c + _shift - j * long(_spacing);
+                if (not _step_valid[j] or u < 0 or u >= long(_usable))
+                    continue;
+                // weight by the filter gain of the bin
+                const double w = _rolloff[u + _edge_bins];
+                sum += w * _step_lin[j][u];
+                norm += w;
+            }
+            if (norm > 0)
+                _composite_lin[c] = float(sum / norm);
+        }
+    }
+
+    sweep_config _config;
+    size_t _num_bins;
+    size_t _edge_bins;
+    double _res;
+    size_t _usable;
+    size_t _spacing;
+    size_t _num_comp;
+    size_t _num_steps;
+    long _shift;
+    std::vector<std::vector<float>> _step_lin;
+    std::vector<bool> _step_valid;
+    std::vector<float> _composite_lin;
+    std::vector<float> _rolloff;
+    std::vector<float> _scratch;
+    std::vector<size_t> _tour;
+    double _retune_time;
+    double _frame_time;
+    size_t _pos;
+    size_t _frames;
+    std::chrono::steady_clock::time_point _dwell_start;
+};
+
+} // namespace esc_sweep
+
+#endif /*ESC_SWEEP_HPP*/
@@ -0,0 +1,191 @@
+//
+// ESC sensor node - real-time priority and CPU affinity of threads
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_THREAD_HPP
+#define ESC_THREAD_HPP
+
+#include <boost/algorithm/string.hpp>
+#include <boost/format.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace esc_thread {
+
+//! Scheduling settings of one thread
+struct thread_config
+{
+    int priority;             //!< SCHED_FIFO priority 1-99, 0 keeps the normal scheduler
+    std::vector<size_t> cpus; //!< CPUs the thread may run on, empty for any of the process
+
+    thread_config(void) : priority(0)
+    {
+        /* NOP */
+    }
+};
+
+/*!
+ * Parse a CPU list like "2", "2,3" or "0-3,6".
+ * \param list the CPU list, empty for none
+ * \return the CPUs in list order
+ */
+inline std::vector<size_t> parse_cpu_list(const std::string& list)
+{
+    std::vector<size_t> cpus;
+    std::vector<std::string> ranges;
+    boost::split(ranges, list, boost::is_any_of(","));
+    for (size_t i = 0; i < ranges.size(); i++) {
+        const std::string range = boost::trim_copy(ranges[i]);
+        if (range.empty())
+            continue;
+        const size_t dash = range.find('-');
+        try {
+            const size_t first = std::stoul(range.substr(0, dash));
+            const size_t last  = (dash == std::string::npos) ? first : std::stoul(range.substr(dash + 1));
+            if (last < first or last >= CPU_SETSIZE)
+                throw std::invalid_argument(range);
+            for (size_t cpu = first; cpu <= last; cpu++)
+                cpus.push_back(cpu);
+        } catch (const std::logic_error&) {
+            throw std::runtime_error("invalid CPU list " + list);
+        }
+    }
+    return cpus;
+}
+
+//! Format CPUs as a comma separated list
+inline std::string format_cpu_list(const std::vector<size_t>& cpus)
+{
+    std::string list;
+    for (size_t i = 0; i < cpus.size(); i++)
+        list += (i ? "," : "") + std::to_string(cpus[i]);
+    return list;
+}
+
+//! The CPUs the kernel keeps free of other work (isolcpus), empty if none
+inline std::vector<size_t> get_isolated_cpus(void)
+{
+    std::ifstream file("/sys/devices/system/cpu/isolated");
+    std::string list;
+    std::getline(file, list);
+    return parse_cpu_list(list);
+}
+
+//! The CPUs the calling thread may run on
+inline std::vector<size_t> get_thread_cpus(void)
+{
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    pthread_getaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    std::vector<size_t> cpus;
+    for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &cpu_set))
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+/*!
+ * The CPUs of the process, as the thread that calls this first may run on.
+ * Call it from main before any thread pins itself, a thread started by a
+ * pinned thread inherits its CPUs.
+ */
+inline const std::vector<size_t>& get_process_cpus(void)
+{
+    static const std::vector<size_t> cpus = get_thread_cpus();
+    return cpus;
+}
+
+/*!
+ * Pick CPUs no other thread is pinned to, isolated ones first, then from
+ * the highest down as CPU 0 usually takes the interrupts.
+ * \param used the CPUs taken
+ * \param count the number of CPUs wanted
+ * 
+eturn count CPUs, or none if there are not that many free
+ */
+inline std::vector<size_t> pick_free_cpus(const std::vector<size_t>& used, size_t count)
+{
+    const std::vector<size_t>& all     = get_process_cpus();
+    const std::vector<size_t> isolated = get_isolated_cpus();
+    std::vector<size_t> free;
+    for (size_t pass = 0; pass < 2; pass++) {
+        for (size_t i = all.size(); i-- > 0;) {
+            const bool is_isolated = std::find(isolated.begin(), isolated.end(), all[i]) != isolated.end();
+            if (is_isolated == (pass == 0) and std::find(used.begin(), used.end(), all[i]) == used.end())
+                free.push_back(all[i]);
+        }
+    }
+    if (free.size() < count)
+        return std::vector<size_t>();
+    free.resize(count);
+    return free;
+}
+
+/*!
+ * Apply settings to the calling thread and read them back.
+ * Failures (usually missing CAP_SYS_NICE or an rtprio limit) do not
+ * throw, they show up in the report.
+ * \param name the thread name, also set as the OS thread name
+ * \param config the settings
+ * \return a one line report of the effective settings
+ */
+inline std::string apply_thread_config(const std::string& name, const thread_config& config)
+{
+    std::string warnings;
+    pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+
+    {
+        // without CPUs undo the pinning a thread inherits from a pinned parent
+        const std::vector<size_t>& pin = config.cpus.empty() ? get_process_cpus() : config.cpus;
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        for (size_t i = 0; i < pin.size(); i++)
+            CPU_SET(pin[i], &cpu_set);
+        const int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+        if (err != 0)
+            warnings += std::string(", cannot set affinity: ") + std::strerror(err);
+    }
+    if (config.priority > 0) {
+        sched_param param;
+        param.sched_priority = config.priority;
+        const int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0)
+            warnings += boost::str(boost::format(", cannot set SCHED_FIFO %d: %s")
+                                   % config.priority % std::strerror(err));
+    }
+
+    // report what the kernel actually applied
+    int policy;
+    sched_param param;
+    pthread_getschedparam(pthread_self(), &policy, &param);
+    const std::vector<size_t> cpus     = get_thread_cpus();
+    const std::vector<size_t> isolated = get_isolated_cpus();
+    bool all_isolated = not cpus.empty();
+    for (size_t i = 0; i < cpus.size(); i++) {
+        if (std::find(isolated.begin(), isolated.end(), cpus[i]) == isolated.end())
+            all_isolated = false;
+    }
+
+    const std::string sched = (policy == SCHED_FIFO) ? "SCHED_FIFO"
+                              : (policy == SCHED_RR) ? "SCHED_RR"
+                                                     : "SCHED_OTHER";
+    return boost::str(boost::format("Thread %s: %s priority %d, CPUs %s%s%s%s") % name % sched
+                      % param.sched_priority % format_cpu_list(cpus)
+                      % (all_isolated ? " (isolated)" : "")
+                      % (config.cpus.empty() ? " (not pinned)" : "") % warnings);
+}
+
+} // namespace esc_thread
+
+#endif /*ESC_THREAD_HPP*/
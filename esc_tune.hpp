@@ -0,0 +1,457 @@
+//
+// ESC sensor node - cached tune plans and timed retunes
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_TUNE_HPP
+#define ESC_TUNE_HPP
+
+#include "esc_sim.hpp"
+#include <uhd/usrp/multi_usrp.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace esc_tune {
+
+//! Timed retune settings
+struct tune_config
+{
+    double lead;   //!< seconds ahead of the device time the retune commands are timed, covers getting them there
+    double settle; //!< seconds from the command time until samples are taken, the LO settling time
+    bool int_n;    //!< integer-N LO tuning
+
+    tune_config(void)
+        : lead(1e-3)
+        , settle(1e-3)
+        , int_n(false)
+    {
+        /* NOP */
+    }
+};
+
+//! The tuning and streaming controls of one RX channel
+class tune_backend
+{
+public:
+    virtual ~tune_backend(void)
+    {
+        /* NOP */
+    }
+
+    virtual uhd::time_spec_t get_time_now(void) = 0;
+    //! Controls after this take effect at the given device time
+    virtual void set_command_time(const uhd::time_spec_t& time) = 0;
+    virtual void clear_command_time(void) = 0;
+    virtual uhd::tune_result_t set_rx_freq(const uhd::tune_request_t& request) = 0;
+    virtual double get_rx_freq(void) = 0;
+    virtual void set_rx_rate(double rate) = 0;
+    virtual double get_rx_rate(void) = 0;
+    //! Whether the LO is locked, true where there is no lock sensor
+    virtual bool is_lo_locked(void) = 0;
+    virtual void issue_stream_cmd(const uhd::stream_cmd_t& stream_cmd) = 0;
+};
+
+//! A channel of a USRP
+class usrp_backend : public tune_backend
+{
+public:
+    /*!
+     * \param usrp the device
+     * \param chan the RX channel of the device
+     * \param rx_stream the streamer of that channel
+     */
+    usrp_backend(uhd::usrp::multi_usrp::sptr usrp, size_t chan, uhd::rx_streamer::sptr rx_stream)
+        : _usrp(usrp)
+        , _chan(chan)
+        , _rx_stream(rx_stream)
+    {
+        const std::vector<std::string> names = usrp->get_rx_sensor_names(chan);
+        _has_lo_sensor = std::find(names.begin(), names.end(), "lo_locked") != names.end();
+    }
+
+    uhd::time_spec_t get_time_now(void)
+    {
+        return _usrp->get_time_now();
+    }
+
+    void set_command_time(const uhd::time_spec_t& time)
+    {
+        _usrp->set_command_time(time);
+    }
+
+    void clear_command_time(void)
+    {
+        _usrp->clear_command_time();
+    }
+
+    uhd::tune_result_t set_rx_freq(const uhd::tune_request_t& request)
+    {
+        return _usrp->set_rx_freq(request, _chan);
+    }
+
+    double get_rx_freq(void)
+    {
+        return _usrp->get_rx_freq(_chan);
+    }
+
+    void set_rx_rate(double rate)
+    {
+        _usrp->set_rx_rate(rate, _chan);
+    }
+
+    double get_rx_rate(void)
+    {
+        return _usrp->get_rx_rate(_chan);
+    }
+
+    bool is_lo_locked(void)
+    {
+        return not _has_lo_sensor or _usrp->get_rx_sensor("lo_locked", _chan).to_bool();
+    }
+
+    void issue_stream_cmd(const uhd::stream_cmd_t& stream_cmd)
+    {
+        _rx_stream->issue_stream_cmd(stream_cmd);
+    }
+
+private:
+    uhd::usrp::multi_usrp::sptr _usrp;
+    size_t _chan;
+    uhd::rx_streamer::sptr _rx_stream;
+    bool _has_lo_sensor;
+};
+
+//! The simulated source, which emulates the device time, timed commands and LO settling
+class sim_backend : public tune_backend
+{
+public:
+    explicit sim_backend(std::shared_ptr<esc_sim::sim_source> sim)
+        : _sim(sim)
+    {
+        /* NOP */
+    }
+
+    uhd::time_spec_t get_time_now(void)
+    {
+        return _sim->get_time_now();
+    }
+
+    void set_command_time(const uhd::time_spec_t& time)
+    {
+        _sim->set_command_time(time);
+    }
+
+    void clear_command_time(void)
+    {
+        _sim->clear_command_time();
+    }
+
+    uhd::tune_result_t set_rx_freq(const uhd::tune_request_t& request)
+    {
+        // the LO lands on the request, or on the given RF frequency, and the DSP makes up the rest
+        uhd::tune_result_t result;
+        result.clipped_rf_freq = request.target_freq;
+        result.target_rf_freq  = request.rf_freq_policy == uhd::tune_request_t::POLICY_MANUAL
+                                     ? request.rf_freq
+                                     : request.target_freq;
+        result.actual_rf_freq  = result.target_rf_freq;
+        result.target_dsp_freq = request.target_freq - result.actual_rf_freq;
+        result.actual_dsp_freq = result.target_dsp_freq;
+        _sim->set_rx_freq(request.target_freq);
+        return result;
+    }
+
+    double get_rx_freq(void)
+    {
+        return _sim->get_rx_freq();
+    }
+
+    void set_rx_rate(double rate)
+    {
+        _sim->set_rx_rate(rate);
+    }
+
+    double get_rx_rate(void)
+    {
+        return _sim->get_rx_rate();
+    }
+
+    bool is_lo_locked(void)
+    {
+        return _sim->is_lo_locked();
+    }
+
+    void issue_stream_cmd(const uhd::stream_cmd_t& stream_cmd)
+    {
+        _sim->issue_stream_cmd(stream_cmd);
+    }
+
+private:
+    std::shared_ptr<esc_sim::sim_source> _sim;
+};
+
+/*!
+ * Retunes an RX channel to the frequencies of its plan with as little
+ * work in the detection path as possible.
+ *
+ * Every frequency is tuned once up front and the LO frequency the driver
+ * picked is kept, later tunes to it ask for that LO frequency directly
+ * (manual RF policy) so the driver does not solve for it again, and the
+ * actual frequency and rate come from the cache instead of being read
+ * back from the device.
+ *
+ * A retune is a batch of timed commands: the tune and the rate change
+ * take effect lead seconds ahead on the device clock, and the stream
+ * command that follows them starts settle seconds after that, so the
+ * first sample is taken at a known device time with the LO settled. The
+ * device time is estimated from the host clock, so issuing a retune takes
+ * no reads from the device, except for a synchronization every
+ * resync_period seconds that keeps the drift between the two clocks well
+ * inside the lead.
+ */
+class tuner
+{
+public:
+    /*!
+     * \param backend the channel to tune
+     * \param config the timed retune settings
+     */
+    tuner(std::shared_ptr<tune_backend> backend, const tune_config& config)
+        : _backend(backend)
+        , _config(config)
+        , _freq(0)
+        , _rate(0)
+        , _hits(0)
+        , _misses(0)
+        , _settle(0)
+        , _synced(0)
+    {
+        if (config.lead < 0 or config.settle < 0)
+            throw std::runtime_error("tune lead and settle times cannot be negative");
+        sync_time();
+        _ready = _command = device_now();
+    }
+
+    /*!
+     * Tune every frequency and set every rate once, untimed, to fill the caches.
+     * \param freqs the center frequencies the channel will be tuned to
+     * \param rates the sample rates it will be set to
+     */
+    void prepare(const std::vector<double>& freqs, const std::vector<double>& rates)
+    {
+        for (size_t i = 0; i < freqs.size(); i++) {
+            if (_tunes.count(freqs[i]) == 0)
+                lookup(freqs[i]);
+        }
+        for (size_t i = 0; i < rates.size(); i++) {
+            if (_rates.count(rates[i]) == 0) {
+                _backend->set_rx_rate(rates[i]);
+                _rates[rates[i]] = _backend->get_rx_rate();
+            }
+        }
+        _freq = _rate = 0; // whatever was set last, the next retune sets both
+        _hits = _misses = 0;
+        sync_time();
+    }
+
+    /*!
+     * Retune the channel and change its rate as timed commands.
+     * \param freq the center frequency in Hz
+     * \param rate the sample rate in Sps
+     * \param stream_cmd a stream command to issue for when the retune has settled, or null
+     * \return the device time from which samples are taken at the new settings
+     */
+    uhd::time_spec_t retune(double freq, double rate, const uhd::stream_cmd_t* stream_cmd = nullptr)
+    {
+        if (freq != _freq or rate != _rate) {
+            std::lock_guard<std::mutex> lock(command_mutex());
+            if (host_now() - _synced > resync_period)
+                sync_time();
+            _command = device_now() + uhd::time_spec_t(_config.lead);
+            _backend->set_command_time(_command);
+            if (freq != _freq) {
+                const std::map<double, tune_entry>::iterator cached = _tunes.find(freq);
+                if (cached == _tunes.end()) {
+                    lookup(freq);
+                } else {
+                    _backend->set_rx_freq(make_request(freq, cached->second.rf_freq));
+                    _hits++;
+                }
+                _freq = freq;
+            }
+            if (rate != _rate) {
+                _backend->set_rx_rate(rate);
+                if (_rates.count(rate) == 0)
+                    _rates[rate] = _backend->get_rx_rate();
+                _rate = rate;
+            }
+            _backend->clear_command_time();
+            _ready = _command + uhd::time_spec_t(_config.settle);
+        }
+        if (stream_cmd)
+            issue_stream_cmd(*stream_cmd);
+        return _ready;
+    }
+
+    /*!
+     * Issue a stream command, held back to the end of the settling time
+     * of the last retune if that is still ahead.
+     * \return seconds the stream start was held back
+     */
+    double issue_stream_cmd(uhd::stream_cmd_t stream_cmd)
+    {
+        double delay = 0;
+        if (stream_cmd.stream_now) {
+            delay = std::max(0.0, time_until(_ready));
+            if (delay > 0) {
+                stream_cmd.stream_now = false;
+                stream_cmd.time_spec  = _ready;
+            }
+        }
+        _backend->issue_stream_cmd(stream_cmd);
+        return delay;
+    }
+
+    /*!
+     * Wait for the LO to lock after the last retune and measure how long it took.
+     * \return seconds from the command time until the LO reported lock
+     */
+    double measure_settle(void)
+    {
+        const double wait = time_until(_command);
+        if (wait > 0)
+            std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+        while (not _backend->is_lo_locked() and time_until(_command) > -max_settle)
+            std::this_thread::yield();
+        _settle = -time_until(_command);
+        return _settle;
+    }
+
+    //! Seconds from now until a device time, negative once it has passed
+    double time_until(const uhd::time_spec_t& time) const
+    {
+        return (time - device_now()).get_real_secs();
+    }
+
+    //! The actual center frequency of the last retune in Hz
+    double get_freq(void) const
+    {
+        const std::map<double, tune_entry>::const_iterator cached = _tunes.find(_freq);
+        return cached == _tunes.end() ? _freq : cached->second.actual_freq;
+    }
+
+    //! The actual sample rate of the last retune in Sps
+    double get_rate(void) const
+    {
+        const std::map<double, double>::const_iterator cached = _rates.find(_rate);
+        return cached == _rates.end() ? _rate : cached->second;
+    }
+
+    //! The last measured settling time in seconds
+    double get_settle_time(void) const
+    {
+        return _settle;
+    }
+
+    //! Retunes since prepare() that found their tune in the cache
+    size_t get_cache_hits(void) const
+    {
+        return _hits;
+    }
+
+    //! Retunes since prepare() that had to be solved by the driver
+    size_t get_cache_misses(void) const
+    {
+        return _misses;
+    }
+
+private:
+    typedef std::chrono::steady_clock clock_type;
+
+    //! Longest wait for the LO to lock in seconds
+    static constexpr double max_settle = 0.1;
+
+    //! Seconds between synchronizations of the host and device clocks, tens of ppm apart
+    static constexpr double resync_period = 5;
+
+    struct tune_entry
+    {
+        double rf_freq;     // LO frequency the driver picked
+        double actual_freq; // center frequency it got to
+    };
+
+    //! Timed commands are set per device, channels of one device must not interleave them
+    static std::mutex& command_mutex(void)
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    uhd::tune_request_t make_request(double freq, double rf_freq) const
+    {
+        uhd::tune_request_t request(freq);
+        if (rf_freq != 0) {
+            request.rf_freq_policy = uhd::tune_request_t::POLICY_MANUAL;
+            request.rf_freq        = rf_freq;
+        }
+        if (_config.int_n)
+            request.args = uhd::device_addr_t("mode_n=integer");
+        return request;
+    }
+
+    //! Let the driver solve a tune and keep the result
+    void lookup(double freq)
+    {
+        const uhd::tune_result_t result = _backend->set_rx_freq(make_request(freq, 0));
+        const tune_entry entry          = {result.actual_rf_freq, _backend->get_rx_freq()};
+        _tunes[freq]                    = entry;
+        _misses++;
+    }
+
+    static double host_now(void)
+    {
+        return std::chrono::duration<double>(clock_type::now().time_since_epoch()).count();
+    }
+
+    //! Find the device time at a host time, halfway through the read
+    void sync_time(void)
+    {
+        const double before           = host_now();
+        const uhd::time_spec_t device = _backend->get_time_now();
+        const double after            = host_now();
+        _offset = device - uhd::time_spec_t((before + after) / 2);
+        _synced = after;
+    }
+
+    uhd::time_spec_t device_now(void) const
+    {
+        return _offset + uhd::time_spec_t(host_now());
+    }
+
+    std::shared_ptr<tune_backend> _backend;
+    tune_config _config;
+    double _freq; // requested, the keys of the caches
+    double _rate;
+    std::map<double, tune_entry> _tunes;
+    std::map<double, double> _rates;
+    size_t _hits;
+    size_t _misses;
+    double _settle;
+    uhd::time_spec_t _offset;  // device time minus host time
+    double _synced;            // host time of the last synchronization
+    uhd::time_spec_t _command; // command time of the last retune
+    uhd::time_spec_t _ready;   // when the last retune has settled
+};
+
+} // namespace esc_tune
+
+#endif /*ESC_TUNE_HPP*/
@@ -0,0 +1,194 @@
+//
+// ESC sensor node - tuner test
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#include "esc_tune.hpp"
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+static bool passed = true;
+
+static void check(bool cond, const std::string& what)
+{
+    if (not cond) {
+        std::cerr << "FAILED: " << what << std::endl;
+        passed = false;
+    }
+}
+
+static bool same_time(const uhd::time_spec_t& a, const uhd::time_spec_t& b)
+{
+    return std::abs((a - b).get_real_secs()) < 1e-9;
+}
+
+/*!
+ * The simulated channel with a device clock running fast by a fixed rate,
+ * recording the controls the tuner issues and the device time they were
+ * issued at.
+ */
+class recording_backend : public esc_tune::tune_backend
+{
+public:
+    recording_backend(std::shared_ptr<esc_sim::sim_source> sim, double drift)
+        : _source(sim)
+        , _sim(sim)
+        , _drift(drift)
+        , time_reads(0)
+        , timed(false)
+    {
+        /* NOP */
+    }
+
+    //! The device time as the device sees it, without counting a read
+    uhd::time_spec_t true_now(void) const
+    {
+        return uhd::time_spec_t(_source->get_time_now().get_real_secs() * (1 + _drift));
+    }
+
+    uhd::time_spec_t get_time_now(void)
+    {
+        time_reads++;
+        return true_now();
+    }
+
+    void set_command_time(const uhd::time_spec_t& time)
+    {
+        command_time   = time;
+        command_issued = true_now();
+        timed          = true;
+        _sim.set_command_time(time);
+    }
+
+    void clear_command_time(void)
+    {
+        timed = false;
+        _sim.clear_command_time();
+    }
+
+    uhd::tune_result_t set_rx_freq(const uhd::tune_request_t& request)
+    {
+        requests.push_back(request);
+        tuned_timed.push_back(timed);
+        return _sim.set_rx_freq(request);
+    }
+
+    double get_rx_freq(void)
+    {
+        return _sim.get_rx_freq();
+    }
+
+    void set_rx_rate(double rate)
+    {
+        _sim.set_rx_rate(rate);
+    }
+
+    double get_rx_rate(void)
+    {
+        return _sim.get_rx_rate();
+    }
+
+    bool is_lo_locked(void)
+    {
+        return _sim.is_lo_locked();
+    }
+
+    void issue_stream_cmd(const uhd::stream_cmd_t& stream_cmd)
+    {
+        stream_cmds.push_back(stream_cmd);
+        _sim.issue_stream_cmd(stream_cmd);
+    }
+
+private:
+    std::shared_ptr<esc_sim::sim_source> _source;
+    esc_tune::sim_backend _sim;
+    double _drift;
+
+public:
+    size_t time_reads;
+    bool timed;
+    uhd::time_spec_t command_time;   // of the last retune
+    uhd::time_spec_t command_issued; // device time the last command time was set at
+    std::vector<uhd::tune_request_t> requests;
+    std::vector<bool> tuned_timed;
+    std::vector<uhd::stream_cmd_t> stream_cmds;
+};
+
+/*
+Drives a tuner over the simulated source and checks the tune cache, that
+retunes are timed lead seconds ahead of the device time, that a stream
+command is held back until the retune has settled, and that the host
+estimate of the device time is resynchronized every 5 seconds, with a
+device clock drifting 1000 ppm so that a missed resynchronization would
+misplace the commands by 5 ms
+*/
+int main(void)
+{
+    const double drift = 1e-3, tolerance = 1e-3;
+    esc_sim::sim_config sim_config;
+    sim_config.control_latency = 0; // keeps the recorded issue times exact
+    std::shared_ptr<esc_sim::sim_source> sim =
+        std::make_shared<esc_sim::sim_source>(sim_config, 0, 10e6, 3550e6);
+    std::shared_ptr<recording_backend> backend = std::make_shared<recording_backend>(sim, drift);
+
+    esc_tune::tune_config config;
+    config.lead   = 20e-3;
+    config.settle = 10e-3;
+    esc_tune::tuner tuner(backend, config);
+
+    // every prepared frequency is solved once, then retunes hit the cache
+    const std::vector<double> freqs = {3550e6, 3560e6, 3570e6};
+    tuner.prepare(freqs, std::vector<double>(1, 10e6));
+    check(backend->requests.size() == freqs.size(), "prepare tunes every frequency");
+    check(tuner.get_cache_hits() == 0 and tuner.get_cache_misses() == 0, "prepare resets the counters");
+    const size_t reads = backend->time_reads;
+
+    backend->requests.clear();
+    backend->tuned_timed.clear();
+    uhd::time_spec_t ready = tuner.retune(3560e6, 10e6);
+    check(tuner.get_cache_hits() == 1 and tuner.get_cache_misses() == 0, "prepared frequency hits the cache");
+    check(backend->requests.size() == 1
+              and backend->requests[0].rf_freq_policy == uhd::tune_request_t::POLICY_MANUAL,
+        "cached tune asks for the cached LO frequency");
+    check(backend->tuned_timed.size() == 1 and backend->tuned_timed[0], "tune is a timed command");
+    const double lead = (backend->command_time - backend->command_issued).get_real_secs();
+    check(std::abs(lead - config.lead) < tolerance,
+        "command time is lead ahead of the device time, got " + std::to_string(lead));
+    check(same_time(ready, backend->command_time + uhd::time_spec_t(config.settle)),
+        "samples are taken settle after the command time");
+
+    tuner.retune(3580e6, 10e6);
+    check(tuner.get_cache_hits() == 1 and tuner.get_cache_misses() == 1, "unprepared frequency misses");
+    check(backend->requests.back().rf_freq_policy != uhd::tune_request_t::POLICY_MANUAL,
+        "missed tune lets the driver solve the LO");
+    const uhd::time_spec_t command = backend->command_time;
+    tuner.retune(3580e6, 10e6);
+    check(same_time(backend->command_time, command) and tuner.get_cache_hits() == 1,
+        "unchanged retune issues nothing");
+    check(backend->time_reads == reads, "retunes do not read the device time");
+
+    // a stream start right after the retune waits for it to settle
+    const double delay = tuner.issue_stream_cmd(uhd::stream_cmd_t(uhd::stream_cmd_t::STREAM_MODE_START_CONTINUOUS));
+    check(delay > config.lead and delay <= config.lead + config.settle + tolerance,
+        "stream start is held back, got " + std::to_string(delay));
+    check(not backend->stream_cmds.back().stream_now
+              and same_time(backend->stream_cmds.back().time_spec, command + uhd::time_spec_t(config.settle)),
+        "held back stream start is timed at the end of the settling");
+    std::this_thread::sleep_for(std::chrono::duration<double>(config.lead + config.settle));
+    check(tuner.issue_stream_cmd(uhd::stream_cmd_t(uhd::stream_cmd_t::STREAM_MODE_START_CONTINUOUS)) == 0
+              and backend->stream_cmds.back().stream_now,
+        "stream start after the settling goes at once");
+
+    // past the resync period the drift would exceed the tolerance
+    std::this_thread::sleep_for(std::chrono::duration<double>(5.1));
+    tuner.retune(3550e6, 10e6);
+    check(backend->time_reads == reads + 1, "retune after 5 s resynchronizes once");
+    const double resynced = (backend->command_time - backend->command_issued).get_real_secs();
+    check(std::abs(resynced - config.lead) < tolerance,
+        "resynchronized command time is lead ahead, got " + std::to_string(resynced));
+
+    std::cout << (passed ? "passed" : "failed") << std::endl;
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,309 @@
+//
+// ESC sensor node - shared upload path
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//
+
+#ifndef ESC_UPLOAD_HPP
+#define ESC_UPLOAD_HPP
+
+#include "esc_spool.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace esc_upload {
+
+//! One pending POST request
+struct request_type
+{
+    std::string json;
+    std::string url;
+    bool deferred; // for the spool, not the server
+};
+
+//! How spooled requests are sent once the server is reachable again
+struct replay_config
+{
+    double rate;           //!< replay requests per second
+    size_t batch;          //!< spooled reports joined into one JSON array request
+    double retry_interval; //!< seconds between connection attempts while offline
+
+    replay_config(void) : rate(2), batch(8), retry_interval(5)
+    {
+        /* NOP */
+    }
+};
+
+/*!
+ * Queue of POST requests served by a single upload thread, so every
+ * receive pipeline can hand off its reports without blocking on the
+ * network. When the queue is full the oldest request is dropped, or with
+ * a spool moved to an overflow queue of the same depth the upload thread
+ * writes to the spool, so the pushing threads never touch the disk.
+ *
+ * With a spool, requests that fail are appended to it instead of being
+ * lost. While the server is unreachable new requests go straight to the
+ * spool, one is tried every retry interval to probe the connection. Once
+ * it is back, the spool is replayed in batches when there is no live
+ * request waiting and at most at the replay rate, so live reports go first.
+ * Deferred requests take the same queue but go to the spool unsent, the
+ * replay sends them once the live traffic leaves room.
+ */
+class upload_queue
+{
+public:
+    //! Send one request, returns false if it should be retried later
+    typedef std::function<bool(const std::string& json, const std::string& url)> post_fn;
+    //! Runs first on the upload thread, for its scheduling settings
+    typedef std::function<void(void)> init_fn;
+
+    upload_queue(size_t max_depth = 64)
+        : _max_depth(max_depth), _running(false), _dropped(0), _spool(nullptr)
+    {
+        /* NOP */
+    }
+
+    ~upload_queue(void)
+    {
+        stop();
+    }
+
+    /*!
+     * Keep failed requests in a spool, call before start().
+     * \param spool the spool, owned by the caller
+     * \param config the replay settings
+     */
+    void set_spool(esc_spool::spool* spool, const replay_config& config)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _spool  = spool;
+        _replay = config;
+    }
+
+    //! Start the upload thread, requests are sent with post
+    void start(post_fn post, init_fn init = init_fn())
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_running)
+            return;
+        _post    = post;
+        _init    = init;
+        _running = true;
+        _thread  = std::thread(&upload_queue::run, this);
+    }
+
+    //! Send the queued requests and stop the upload thread
+    void stop(void)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (not _running)
+                return;
+            _running = false;
+        }
+        _cond.notify_all();
+        _thread.join();
+    }
+
+    //! Queue a request, never blocks on the network
+    void push(const std::string& json, const std::string& url)
+    {
+        enqueue(json, url, false);
+    }
+
+    /*!
+     * Queue a request for the spool, to be sent when the replay gets to it.
+     * \param json the request body
+     * \param url the request url
+     * \return false if it was dropped because there is no spool
+     */
+    bool defer(const std::string& json, const std::string& url)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (not _spool)
+                return false;
+        }
+        enqueue(json, url, true);
+        return true;
+    }
+
+    //! The number of requests waiting to be sent
+    size_t get_depth(void)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _queue.size();
+    }
+
+    //! The depth at which the oldest request is dropped or spooled
+    size_t get_max_depth(void) const
+    {
+        return _max_depth;
+    }
+
+    //! The number of requests dropped because the queue was full
+    size_t get_dropped(void)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _dropped;
+    }
+
+private:
+    typedef std::chrono::steady_clock clock_type;
+
+    void enqueue(const std::string& json, const std::string& url, bool deferred)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_queue.size() >= _max_depth and _spool) {
+                // the upload thread is stuck on the network, it spools the overflow once back
+                if (_overflow.size() >= _max_depth)
+                    drop_oldest(_overflow);
+                _overflow.push_back(_queue.front());
+                _queue.pop_front();
+            } else if (_queue.size() >= _max_depth) {
+                drop_oldest(_queue);
+            }
+            request_type req = {json, url, deferred};
+            _queue.push_back(req);
+        }
+        _cond.notify_one();
+    }
+
+    void drop_oldest(std::deque<request_type>& queue)
+    {
+        queue.pop_front();
+        _dropped++;
+        std::cerr << "Upload queue full, dropped " << _dropped << " requests" << std::endl;
+    }
+
+    void run(void)
+    {
+        if (_init)
+            _init();
+        _offline_until = clock_type::now();
+        _next_replay   = clock_type::now();
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            if (_queue.empty() and _overflow.empty() and _running and replay_due())
+                _cond.wait_until(lock, std::max(_offline_until, _next_replay));
+            else
+                _cond.wait(lock, [this] {
+                    return not _queue.empty() or not _overflow.empty() or not _running
+                           or replay_due();
+                });
+            if (not _overflow.empty()) {
+                std::deque<request_type> overflow;
+                overflow.swap(_overflow);
+                lock.unlock();
+                for (size_t i = 0; i < overflow.size(); i++)
+                    spool_append(overflow[i]);
+                lock.lock();
+            } else if (not _queue.empty()) {
+                request_type req = _queue.front();
+                _queue.pop_front();
+                lock.unlock();
+                send(req);
+                lock.lock();
+            } else if (not _running) {
+                return;
+            } else if (replay_due() and clock_type::now() >= std::max(_offline_until, _next_replay)) {
+                lock.unlock();
+                replay();
+                lock.lock();
+            }
+        }
+    }
+
+    //! A spool with records waiting, not necessarily due yet
+    bool replay_due(void) const
+    {
+        return _spool and not _spool->empty();
+    }
+
+    void spool_append(const request_type& req)
+    {
+        if (not _spool->append(req.url, req.json))
+            std::cerr << "Request too large for the spool, dropped" << std::endl;
+    }
+
+    //! Send a live request, spool it if the server is unreachable
+    void send(const request_type& req)
+    {
+        if (req.deferred) {
+            spool_append(req);
+            return;
+        }
+        if (not _spool) {
+            _post(req.json, req.url);
+            return;
+        }
+        if (clock_type::now() < _offline_until or not _post(req.json, req.url)) {
+            if (clock_type::now() >= _offline_until)
+                go_offline();
+            spool_append(req);
+        }
+    }
+
+    //! Send the oldest spooled records, consecutive ones to the same url as one JSON array
+    void replay(void)
+    {
+        std::vector<esc_spool::record_type> records;
+        const uint64_t end = _spool->peek(std::max<size_t>(_replay.batch, 1), records);
+        size_t count       = 1;
+        while (count < records.size() and records[count].url == records[0].url)
+            count++;
+        std::string json = records[0].json;
+        if (count > 1) {
+            json = "[" + json;
+            for (size_t i = 1; i < count; i++)
+                json += "," + records[i].json;
+            json += "]";
+        }
+        _next_replay = clock_type::now()
+                       + std::chrono::duration_cast<clock_type::duration>(
+                           std::chrono::duration<double>(1.0 / _replay.rate));
+        if (not _post(json, records[0].url)) {
+            go_offline();
+            return;
+        }
+        // only the records up to the url change were sent
+        _spool->consume(count == records.size() ? end : records[count - 1].end);
+    }
+
+    void go_offline(void)
+    {
+        _offline_until = clock_type::now()
+                         + std::chrono::duration_cast<clock_type::duration>(
+                             std::chrono::duration<double>(_replay.retry_interval));
+        std::cerr << "Server unreachable, spooling (" << _spool->size() << " spooled)"
+                  << std::endl;
+    }
+
+    size_t _max_depth;
+    bool _running;
+    size_t _dropped;
+    esc_spool::spool* _spool;
+    replay_config _replay;
+    clock_type::time_point _offline_until;
+    clock_type::time_point _next_replay;
+    post_fn _post;
+    init_fn _init;
+    std::deque<request_type> _queue;
+    std::deque<request_type> _overflow; // pushed out of the full queue, for the spool
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::thread _thread;
+};
+
+} // namespace esc_upload
+
+#endif /*ESC_UPLOAD_HPP*/
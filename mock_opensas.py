@@ -0,0 +1,232 @@
+#!/usr/bin/env python3
+#
+# Mock OpenSAS server for ESC node benchmarks
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+# Accepts the POST requests of the ESC node (measurements, samples, history,
+# zoom) over HTTPS, with an optional response delay and injected failures,
+# and keeps per endpoint counts and latencies:
+#   report latency    = arrival time - time_us of the report
+#   detection latency = arrival time - detect_time_us of the report
+# Replayed batches (JSON arrays) count every report in them. A summary is
+# printed every --report-interval seconds and written to --stats as JSON on
+# exit (SIGINT or SIGTERM).
+
+import argparse
+import json
+import random
+import signal
+import ssl
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, HTTPServer
+from socketserver import ThreadingMixIn
+
+
+def percentiles(values):
+    if not values:
+        return {}
+    values = sorted(values)
+    pick = lambda q: values[min(len(values) - 1, int(q * len(values)))]
+    return {"count": len(values), "p50": pick(0.5), "p90": pick(0.9), "p99": pick(0.99), "max": values[-1]}
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.start = time.time()
+        self.endpoints = {}
+
+    def endpoint(self, name):
+        if name not in self.endpoints:
+            self.endpoints[name] = {"requests": 0, "reports": 0, "bytes": 0, "outcomes": {},
+                                    "report_latency_ms": [], "detect_latency_ms": []}
+        return self.endpoints[name]
+
+    def add(self, name, outcome, size=0, reports=(), arrival=None):
+        with self.lock:
+            ep = self.endpoint(name)
+            ep["requests"] += 1
+            ep["bytes"] += size
+            ep["outcomes"][outcome] = ep["outcomes"].get(outcome, 0) + 1
+            for report in reports:
+                ep["reports"] += 1
+                if report.get("time_us"):
+                    ep["report_latency_ms"].append((arrival - report["time_us"] / 1e6) * 1e3)
+                if report.get("detect_time_us"):
+                    ep["detect_latency_ms"].append((arrival - report["detect_time_us"] / 1e6) * 1e3)
+
+    def summary(self):
+        with self.lock:
+            out = {"elapsed_s": time.time() - self.start, "endpoints": {}}
+            for name, ep in sorted(self.endpoints.items()):
+                out["endpoints"][name] = {
+                    "requests": ep["requests"], "reports": ep["reports"], "bytes": ep["bytes"],
+                    "outcomes": dict(ep["outcomes"]),
+                    "report_latency_ms": percentiles(ep["report_latency_ms"]),
+                    "detect_latency_ms": percentiles(ep["detect_latency_ms"]),
+                }
+            return out
+
+
+class Handler(BaseHTTPRequestHandler):
+    def log_message(self, fmt, *args):
+        if self.server.args.verbose:
+            sys.stderr.write("%s - %s\n" % (self.address_string(), fmt % args))
+
+    def do_POST(self):
+        args = self.server.args
+        arrival = time.time()
+        name = self.path.rstrip("/").split("/")[-1]
+        length = int(self.headers.get("Content-Length", 0))
+        body = self.rfile.read(length)
+
+        roll = random.random()
+        if roll < args.drop_rate:
+            self.server.stats.add(name, "dropped", length)
+            self.close_connection = True
+            return
+        roll -= args.drop_rate
+        if args.delay > 0 or args.jitter > 0:
+            time.sleep(max(0.0, random.gauss(args.delay, args.jitter)))
+        if roll < args.fail_rate:
+            self.server.stats.add(name, "503", length)
+            self.reply(503, b'{"error":"injected failure"}')
+            return
+        roll -= args.fail_rate
+        if roll < args.reject_rate:
+            self.server.stats.add(name, "400", length)
+            self.reply(400, b'{"error":"injected rejection"}')
+            return
+
+        try:
+            parsed = json.loads(body)
+        except ValueError:
+            self.server.stats.add(name, "400", length)
+            self.reply(400, b'{"error":"invalid JSON"}')
+            return
+        reports = parsed if isinstance(parsed, list) else [parsed]
+        self.server.stats.add(name, "200", length, reports, arrival)
+        self.reply(200, b'{"status":"ok"}')
+
+    def reply(self, code, body):
+        self.send_response(code)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+
+class Server(ThreadingMixIn, HTTPServer):
+    daemon_threads = True
+
+    def __init__(self, args, context):
+        HTTPServer.__init__(self, (args.host, args.port), Handler)
+        self.args = args
+        self.context = context
+        self.stats = Stats()
+
+    def in_outage(self):
+        now = time.time() - self.stats.start
+        return any(start <= now < start + length for start, length in self.args.outage)
+
+    def verify_request(self, request, client_address):
+        # an outage looks like a server that is down, the connection closes before TLS
+        if self.in_outage():
+            self.stats.add("(outage)", "refused")
+            return False
+        return True
+
+    def finish_request(self, request, client_address):
+        # the TLS handshake runs on the request thread, a slow client does not block accept
+        request.settimeout(30)
+        try:
+            request = self.context.wrap_socket(request, server_side=True)
+        except (ssl.SSLError, OSError) as err:
+            self.stats.add("(tls)", "handshake failed")
+            if self.args.verbose:
+                sys.stderr.write("TLS handshake with %s failed: %s\n" % (client_address[0], err))
+            return
+        try:
+            Handler(request, client_address, self)
+        finally:
+            request.close()
+
+
+def parse_outage(text):
+    windows = []
+    for item in text.split(","):
+        if item:
+            start, length = item.split(":")
+            windows.append((float(start), float(length)))
+    return windows
+
+
+def print_summary(summary):
+    print("--- %.0f s ---" % summary["elapsed_s"])
+    for name, ep in summary["endpoints"].items():
+        line = "%-14s %6d requests %6d reports %10.1f kB  %s" % (
+            name, ep["requests"], ep["reports"], ep["bytes"] / 1e3,
+            " ".join("%s:%d" % item for item in sorted(ep["outcomes"].items())))
+        for key in ("report_latency_ms", "detect_latency_ms"):
+            p = ep[key]
+            if p:
+                line += "  %s p50 %.1f p99 %.1f max %.1f ms" % (key.split("_")[0], p["p50"], p["p99"], p["max"])
+        print(line)
+    sys.stdout.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Mock OpenSAS HTTPS server for ESC node benchmarks")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=1443)
+    parser.add_argument("--cert", required=True, help="server certificate (PEM)")
+    parser.add_argument("--key", required=True, help="server key (PEM)")
+    parser.add_argument("--ca", help="CA that signed the client certificates, required from clients when given")
+    parser.add_argument("--delay", type=float, default=0, help="mean response delay in seconds")
+    parser.add_argument("--jitter", type=float, default=0, help="standard deviation of the response delay in seconds")
+    parser.add_argument("--fail-rate", type=float, default=0, help="fraction of requests answered 503 (retried by the node)")
+    parser.add_argument("--reject-rate", type=float, default=0, help="fraction of requests answered 400 (not retried)")
+    parser.add_argument("--drop-rate", type=float, default=0, help="fraction of requests closed without a response")
+    parser.add_argument("--outage", type=parse_outage, default=[], metavar="START:LEN[,START:LEN]",
+                        help="windows in seconds after startup during which connections are refused")
+    parser.add_argument("--report-interval", type=float, default=5, help="seconds between summaries, 0 for none")
+    parser.add_argument("--stats", help="file the final summary is written to as JSON")
+    parser.add_argument("--seed", type=int, help="seed of the failure injection")
+    parser.add_argument("--verbose", action="store_true", help="log every request")
+    args = parser.parse_args()
+    random.seed(args.seed)
+
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    context.load_cert_chain(args.cert, args.key)
+    if args.ca:
+        context.load_verify_locations(args.ca)
+        context.verify_mode = ssl.CERT_REQUIRED
+
+    server = Server(args, context)
+    print("Mock OpenSAS on https://%s:%d/sas-api/" % (args.host, args.port))
+    sys.stdout.flush()
+
+    def stop(signum, frame):
+        threading.Thread(target=server.shutdown).start()
+    signal.signal(signal.SIGINT, stop)
+    signal.signal(signal.SIGTERM, stop)
+
+    def report():
+        while args.report_interval > 0:
+            time.sleep(args.report_interval)
+            print_summary(server.stats.summary())
+    threading.Thread(target=report, daemon=True).start()
+
+    server.serve_forever()
+    summary = server.stats.summary()
+    print_summary(summary)
+    if args.stats:
+        with open(args.stats, "w") as f:
+            json.dump(summary, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()